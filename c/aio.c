@@ -0,0 +1,211 @@
+#include "db.h"
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Asynchronous page reads for the server's event loop. Reads go through
+// io_uring, which posts an eventfd as they complete so the loop can wait
+// on it with everything else. Where io_uring is unavailable reads are done
+// on the spot and their completions queued behind the same eventfd, so
+// callers see one behaviour either way.
+
+typedef struct PendingRead {
+	void* data;
+	int32_t result;
+	struct PendingRead* next;
+} PendingRead;
+
+struct AsyncIO {
+	int event_fd;
+	int ring_fd; // -1 without io_uring
+	uint32_t num_in_flight;
+	// Submission queue
+	uint32_t* sq_head;
+	uint32_t* sq_tail;
+	uint32_t* sq_mask;
+	uint32_t* sq_array;
+	uint32_t sq_entries;
+	struct io_uring_sqe* sqes;
+	// Completion queue
+	uint32_t* cq_head;
+	uint32_t* cq_tail;
+	uint32_t* cq_mask;
+	struct io_uring_cqe* cqes;
+	uint32_t cq_entries;
+	void* rings[2];
+	size_t ring_sizes[2];
+	size_t sqes_size;
+	// Reads done on the spot, completions not yet reaped
+	PendingRead* pending;
+	PendingRead** pending_tail;
+};
+
+bool aio_ring_setup(AsyncIO* aio, uint32_t entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring_fd < 0) {
+		return false;
+	}
+
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap && cq_size > sq_size) {
+		sq_size = cq_size;
+	}
+	void* sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	void* cq = single_mmap ? sq :
+		mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	void* sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED ||
+		syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_EVENTFD, &aio->event_fd, 1) < 0) {
+		close(ring_fd);
+		return false;
+	}
+
+	aio->ring_fd = ring_fd;
+	aio->sq_head = sq + params.sq_off.head;
+	aio->sq_tail = sq + params.sq_off.tail;
+	aio->sq_mask = sq + params.sq_off.ring_mask;
+	aio->sq_array = sq + params.sq_off.array;
+	aio->sq_entries = params.sq_entries;
+	aio->sqes = sqes;
+	aio->cq_head = cq + params.cq_off.head;
+	aio->cq_tail = cq + params.cq_off.tail;
+	aio->cq_mask = cq + params.cq_off.ring_mask;
+	aio->cqes = cq + params.cq_off.cqes;
+	aio->cq_entries = params.cq_entries;
+	aio->rings[0] = sq;
+	aio->ring_sizes[0] = sq_size;
+	aio->rings[1] = single_mmap ? NULL : cq;
+	aio->ring_sizes[1] = cq_size;
+	aio->sqes_size = sqes_size;
+	return true;
+}
+
+AsyncIO* aio_create(uint32_t entries) {
+	AsyncIO* aio = calloc(1, sizeof(AsyncIO));
+	aio->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (aio->event_fd == -1) {
+		printf("Error creating eventfd: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	aio->ring_fd = -1;
+	aio->pending_tail = &aio->pending;
+	aio_ring_setup(aio, entries);
+	return aio;
+}
+
+bool aio_uses_io_uring(AsyncIO* aio) {
+	return aio->ring_fd != -1;
+}
+
+// Becomes readable when completions are waiting for aio_reap()
+int aio_event_fd(AsyncIO* aio) {
+	return aio->event_fd;
+}
+
+void aio_complete_now(AsyncIO* aio, int fd, void* buffer, uint32_t length, off_t offset, void* data) {
+	PendingRead* done = malloc(sizeof(PendingRead));
+	ssize_t bytes_read = pread(fd, buffer, length, offset);
+	done->data = data;
+	done->result = bytes_read == -1 ? -errno : bytes_read;
+	done->next = NULL;
+	*aio->pending_tail = done;
+	aio->pending_tail = &done->next;
+	uint64_t one = 1;
+	write(aio->event_fd, &one, sizeof(one));
+}
+
+// Read length bytes at offset into buffer. fn passed to aio_reap() gets
+// data and the result of the read, a byte count or -errno.
+void aio_read(AsyncIO* aio, int fd, void* buffer, uint32_t length, off_t offset, void* data) {
+	// Never more reads in flight than completions fit in the ring
+	if (aio->ring_fd == -1 || aio->num_in_flight == aio->cq_entries ||
+		*aio->sq_tail - __atomic_load_n(aio->sq_head, __ATOMIC_ACQUIRE) == aio->sq_entries) {
+		aio_complete_now(aio, fd, buffer, length, offset, data);
+		return;
+	}
+
+	uint32_t tail = *aio->sq_tail;
+	uint32_t index = tail & *aio->sq_mask;
+	struct io_uring_sqe* sqe = &aio->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buffer;
+	sqe->len = length;
+	sqe->off = offset;
+	sqe->user_data = (uint64_t)(uintptr_t)data;
+	aio->sq_array[index] = index;
+	__atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (syscall(__NR_io_uring_enter, aio->ring_fd, 1, 0, 0, NULL, 0) < 0) {
+		// Take the entry back and read it ourselves
+		__atomic_store_n(aio->sq_tail, tail, __ATOMIC_RELEASE);
+		aio_complete_now(aio, fd, buffer, length, offset, data);
+		return;
+	}
+	aio->num_in_flight++;
+}
+
+// Hand every finished read to fn. Returns how many there were.
+uint32_t aio_reap(AsyncIO* aio, AsyncReadFunction fn) {
+	uint64_t count;
+	read(aio->event_fd, &count, sizeof(count));
+
+	uint32_t num_reaped = 0;
+	while (aio->pending != NULL) {
+		PendingRead* done = aio->pending;
+		aio->pending = done->next;
+		if (aio->pending == NULL) {
+			aio->pending_tail = &aio->pending;
+		}
+		fn(done->data, done->result);
+		free(done);
+		num_reaped++;
+	}
+	if (aio->ring_fd == -1) {
+		return num_reaped;
+	}
+
+	uint32_t head = *aio->cq_head;
+	while (head != __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe* cqe = &aio->cqes[head & *aio->cq_mask];
+		void* data = (void*)(uintptr_t)cqe->user_data;
+		int32_t result = cqe->res;
+		head++;
+		__atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+		aio->num_in_flight--;
+		fn(data, result);
+		num_reaped++;
+	}
+	return num_reaped;
+}
+
+// Wait for every read in flight and reap it, so no buffer is still being
+// written into when the caller frees it
+void aio_drain(AsyncIO* aio, AsyncReadFunction fn) {
+	aio_reap(aio, fn);
+	while (aio->num_in_flight > 0) {
+		syscall(__NR_io_uring_enter, aio->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		aio_reap(aio, fn);
+	}
+}
+
+void aio_destroy(AsyncIO* aio) {
+	if (aio->ring_fd != -1) {
+		munmap(aio->sqes, aio->sqes_size);
+		munmap(aio->rings[0], aio->ring_sizes[0]);
+		if (aio->rings[1] != NULL) {
+			munmap(aio->rings[1], aio->ring_sizes[1]);
+		}
+		close(aio->ring_fd);
+	}
+	close(aio->event_fd);
+	free(aio);
+}
@@ -0,0 +1,390 @@
+#include "db.h"
+
+#include <glob.h>
+#include <math.h>
+
+// Benchmark driver. Runs a fixed set of workloads against a scratch
+// database and prints one JSON document with the throughput and latency
+// percentiles of each, so runs can be compared across versions. Keys come
+// from a seeded generator: the same options give the same statements.
+//
+// Statements go through prepare_statement() and execute_statement() like
+// those of the REPL. Point lookups select by username through the index,
+// since rows have unique usernames and the grammar has no lookup by id.
+// Range scans have no syntax either and walk a cursor from a random key,
+// which only the B-tree has.
+//
+// The B-tree holds at most TABLE_MAX_PAGES pages, a few hundred rows, so
+// the defaults are small and larger B-tree runs are refused before any
+// output. LSM tables (--lsm) take far more.
+
+typedef struct {
+	const char* path;
+	uint32_t flags;
+	uint32_t num_rows;
+	uint32_t num_ops;
+	uint32_t num_scans;
+	uint64_t seed;
+} BenchOptions;
+
+typedef struct {
+	BenchOptions* options;
+	Table* table;
+	Session* session;
+	uint64_t rng;
+	uint32_t next_id; // Inserted next by workloads that grow the table
+	uint64_t num_rows_read;
+	double zipf_zeta;
+	double zipf_eta;
+	double zipf_alpha;
+	// Latency of every operation of the running workload, in nanoseconds
+	uint64_t* samples;
+	uint32_t num_samples;
+} Bench;
+
+typedef void (*BenchOperation)(Bench* bench, uint32_t op);
+
+bool first_workload = true;
+
+uint64_t bench_random(Bench* bench) {
+	// xorshift64*
+	bench->rng ^= bench->rng >> 12;
+	bench->rng ^= bench->rng << 25;
+	bench->rng ^= bench->rng >> 27;
+	return bench->rng * 2685821657736338717ull;
+}
+
+uint32_t bench_uniform(Bench* bench, uint32_t n) {
+	return bench_random(bench) % n;
+}
+
+// YCSB's Zipfian over [0, num_rows) with theta 0.99, after Gray et al.,
+// "Quickly generating billion-record synthetic databases". Ranks are
+// hashed so the hot rows are spread over the key space.
+#define ZIPF_THETA 0.99
+
+void bench_zipf_init(Bench* bench) {
+	uint32_t n = bench->options->num_rows;
+	double zeta = 0;
+	for (uint32_t i = 1; i <= n; i++) {
+		zeta += 1 / pow(i, ZIPF_THETA);
+	}
+	double zeta2 = 1 + 1 / pow(2, ZIPF_THETA);
+	bench->zipf_zeta = zeta;
+	bench->zipf_alpha = 1 / (1 - ZIPF_THETA);
+	bench->zipf_eta = (1 - pow(2.0 / n, 1 - ZIPF_THETA)) / (1 - zeta2 / zeta);
+}
+
+uint32_t bench_zipf(Bench* bench) {
+	uint32_t n = bench->options->num_rows;
+	double u = (double)(bench_random(bench) >> 11) / (1ull << 53);
+	double uz = u * bench->zipf_zeta;
+	uint64_t rank;
+	if (uz < 1) {
+		rank = 0;
+	} else if (uz < 1 + pow(0.5, ZIPF_THETA)) {
+		rank = 1;
+	} else {
+		rank = (uint64_t)(n * pow(bench->zipf_eta * u - bench->zipf_eta + 1, bench->zipf_alpha));
+	}
+	rank = rank < n ? rank : n - 1;
+	// FNV-1a, to scatter ranks over ids
+	uint64_t hash = 14695981039346656037ull;
+	for (uint32_t i = 0; i < 8; i++) {
+		hash = (hash ^ ((rank >> (i * 8)) & 0xff)) * 1099511628211ull;
+	}
+	return hash % n;
+}
+
+void count_row(Row* row, void* arg) {
+	Bench* bench = arg;
+	bench->num_rows_read++;
+}
+
+void bench_execute(Bench* bench, const char* format, uint32_t id) {
+	char sql[128];
+	snprintf(sql, sizeof(sql), format, id, id, id);
+	Statement statement;
+	if (prepare_statement(sql, &statement) != PREPARE_SUCCESS) {
+		fprintf(stderr, "Unable to prepare '%s'\n", sql);
+		exit(EXIT_FAILURE);
+	}
+	ExecuteResult result = execute_statement(&statement, bench->session, count_row, bench);
+	if (result != EXECUTE_SUCCESS) {
+		fprintf(stderr, "%s\n", execute_result_message(result));
+		exit(EXIT_FAILURE);
+	}
+}
+
+void bench_insert(Bench* bench, uint32_t id) {
+	bench_execute(bench, "insert %u user%u person%u@example.com", id);
+}
+
+void bench_lookup(Bench* bench, uint32_t id) {
+	bench_execute(bench, "select where username = user%u", id);
+}
+
+// Read up to num_rows rows in key order from key on
+void bench_range(Bench* bench, uint32_t key, uint32_t num_rows) {
+	Snapshot* snapshot = snapshot_begin(bench->table);
+	Cursor* cursor = table_scan(bench->table, snapshot, key);
+	for (uint32_t i = 0; i < num_rows && !cursor->end_of_table; i++) {
+		Row row;
+		deserialize_row(cursor_value(cursor), &row);
+		count_row(&row, bench);
+		cursor_advance(cursor);
+	}
+	cursor_close(cursor);
+	snapshot_end(bench->table, snapshot);
+}
+
+// Start over with no database files
+void bench_open(Bench* bench) {
+	char pattern[256];
+	snprintf(pattern, sizeof(pattern), "%s-*", bench->options->path);
+	glob_t files;
+	if (glob(pattern, 0, NULL, &files) == 0) {
+		for (size_t i = 0; i < files.gl_pathc; i++) {
+			unlink(files.gl_pathv[i]);
+		}
+	}
+	globfree(&files);
+	unlink(bench->options->path);
+	bench->table = db_open(bench->options->path, bench->options->flags);
+	bench->session = session_new(bench->table);
+}
+
+void bench_close(Bench* bench) {
+	session_close(bench->session);
+	db_close(bench->table);
+}
+
+// Rows 1 to num_rows in random order, indexed by username
+void bench_load(Bench* bench) {
+	uint32_t num_rows = bench->options->num_rows;
+	uint32_t* ids = malloc(num_rows * sizeof(uint32_t));
+	for (uint32_t i = 0; i < num_rows; i++) {
+		ids[i] = i + 1;
+	}
+	for (uint32_t i = num_rows; i > 1; i--) {
+		uint32_t j = bench_uniform(bench, i);
+		uint32_t id = ids[i - 1];
+		ids[i - 1] = ids[j];
+		ids[j] = id;
+	}
+	for (uint32_t i = 0; i < num_rows; i++) {
+		bench_insert(bench, ids[i]);
+	}
+	free(ids);
+	bench_execute(bench, "create index on username", 0);
+	bench->next_id = num_rows + 1;
+}
+
+int compare_samples(const void* a, const void* b) {
+	uint64_t sample_a = *(const uint64_t*)a;
+	uint64_t sample_b = *(const uint64_t*)b;
+	return sample_a < sample_b ? -1 : sample_a > sample_b;
+}
+
+double bench_percentile(Bench* bench, double fraction) {
+	uint32_t rank = (uint32_t)(fraction * bench->num_samples + 0.5);
+	rank = rank > 0 ? rank : 1;
+	return bench->samples[rank - 1] / 1000.0;
+}
+
+void bench_report_start(const char* name) {
+	printf("%s\n    {\"name\": \"%s\"", first_workload ? "" : ",", name);
+	first_workload = false;
+}
+
+// Time num_ops calls of operation and report them as workload name
+void bench_run(Bench* bench, const char* name, uint32_t num_ops, BenchOperation operation) {
+	bench->samples = realloc(bench->samples, (num_ops > 0 ? num_ops : 1) * sizeof(uint64_t));
+	bench->num_samples = num_ops;
+	bench->num_rows_read = 0;
+	uint64_t start = clock_ns();
+	for (uint32_t i = 0; i < num_ops; i++) {
+		uint64_t op_start = clock_ns();
+		operation(bench, i);
+		bench->samples[i] = clock_ns() - op_start;
+	}
+	double seconds = (clock_ns() - start) / 1e9;
+
+	qsort(bench->samples, num_ops, sizeof(uint64_t), compare_samples);
+	bench_report_start(name);
+	printf(", \"ops\": %u, \"rows_read\": %llu, \"seconds\": %.6f, \"ops_per_sec\": %.1f", num_ops,
+			(unsigned long long)bench->num_rows_read, seconds, seconds > 0 ? num_ops / seconds : 0);
+	if (num_ops > 0) {
+		printf(", \"latency_us\": {\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f}",
+				bench_percentile(bench, 0.5), bench_percentile(bench, 0.9), bench_percentile(bench, 0.99),
+				bench_percentile(bench, 0.999), bench->samples[num_ops - 1] / 1000.0);
+	}
+	printf("}");
+}
+
+void bench_skip(const char* name, const char* reason) {
+	bench_report_start(name);
+	printf(", \"skipped\": \"%s\"}", reason);
+}
+
+void op_sequential_insert(Bench* bench, uint32_t op) {
+	bench_insert(bench, op + 1);
+}
+
+uint32_t* shuffled_ids = NULL;
+
+void op_random_insert(Bench* bench, uint32_t op) {
+	bench_insert(bench, shuffled_ids[op]);
+}
+
+void op_lookup_hit(Bench* bench, uint32_t op) {
+	bench_lookup(bench, bench_uniform(bench, bench->options->num_rows) + 1);
+}
+
+void op_lookup_miss(Bench* bench, uint32_t op) {
+	// Above every id a workload inserts
+	bench_lookup(bench, UINT32_MAX - bench_uniform(bench, bench->options->num_rows));
+}
+
+void op_full_scan(Bench* bench, uint32_t op) {
+	bench_execute(bench, "select", 0);
+}
+
+void op_range_scan(Bench* bench, uint32_t op) {
+	bench_range(bench, bench_uniform(bench, bench->options->num_rows) + 1, 1 + bench_uniform(bench, 100));
+}
+
+// YCSB's core workloads. Updates are inserts of new rows, since there is
+// no update statement: A is half lookups, half inserts; B 95% lookups;
+// C all lookups; E 95% short scans, the rest inserts.
+void ycsb_operation(Bench* bench, uint32_t read_percent, bool scans) {
+	if (bench_uniform(bench, 100) >= read_percent) {
+		bench_insert(bench, bench->next_id++);
+	} else if (scans) {
+		bench_range(bench, bench_zipf(bench) + 1, 1 + bench_uniform(bench, 100));
+	} else {
+		bench_lookup(bench, bench_zipf(bench) + 1);
+	}
+}
+
+void op_ycsb_a(Bench* bench, uint32_t op) {
+	ycsb_operation(bench, 50, false);
+}
+
+void op_ycsb_b(Bench* bench, uint32_t op) {
+	ycsb_operation(bench, 95, false);
+}
+
+void op_ycsb_c(Bench* bench, uint32_t op) {
+	ycsb_operation(bench, 100, false);
+}
+
+void op_ycsb_e(Bench* bench, uint32_t op) {
+	ycsb_operation(bench, 95, true);
+}
+
+// Run a workload on a freshly loaded table
+void bench_run_loaded(Bench* bench, const char* name, uint32_t num_ops, BenchOperation operation) {
+	bench_open(bench);
+	bench_load(bench);
+	bench_run(bench, name, num_ops, operation);
+	bench_close(bench);
+}
+
+// Rows a B-tree table is sure to hold: split leaves stay at least half
+// full, and internal nodes take no more than a third of the pages.
+uint32_t btree_max_rows() {
+	return TABLE_MAX_PAGES * 2 / 3 * LEAF_NODE_RIGHT_SPLIT_COUNT;
+}
+
+void usage() {
+	printf("Usage: db-bench [--rows N] [--ops N] [--scans N] [--seed N] [--lsm] [--buffered] [--db path]\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+	BenchOptions options = {"bench.db", 0, 200, 200, 20, 42};
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+			options.num_rows = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+			options.num_ops = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--scans") == 0 && i + 1 < argc) {
+			options.num_scans = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			options.seed = strtoull(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--lsm") == 0) {
+			options.flags |= DB_OPEN_LSM;
+		} else if (strcmp(argv[i], "--buffered") == 0) {
+			options.flags |= DB_OPEN_BUFFERED;
+		} else if (strcmp(argv[i], "--db") == 0 && i + 1 < argc) {
+			options.path = argv[++i];
+		} else {
+			usage();
+		}
+	}
+	if (options.num_rows == 0) {
+		usage();
+	}
+	// The YCSB workloads insert on top of a loaded table, at most once per
+	// operation. Refuse up front rather than fail halfway through the JSON.
+	bool lsm = (options.flags & DB_OPEN_LSM) != 0;
+	if (!lsm && (uint64_t)options.num_rows + options.num_ops > btree_max_rows()) {
+		fprintf(stderr, "Error: a B-tree holds at most %u rows, --rows plus --ops is %llu.\n", btree_max_rows(),
+				(unsigned long long)options.num_rows + options.num_ops);
+		exit(EXIT_FAILURE);
+	}
+
+	Bench bench = {0};
+	bench.options = &options;
+	bench.rng = options.seed * 2 + 1; // Never 0
+	bench_zipf_init(&bench);
+
+	printf("{\n  \"engine\": \"%s\",\n  \"rows\": %u,\n  \"ops\": %u,\n  \"scans\": %u,\n  \"seed\": %llu,\n  \"workloads\": [",
+			lsm ? "lsm" : "btree", options.num_rows, options.num_ops, options.num_scans, (unsigned long long)options.seed);
+
+	bench_open(&bench);
+	bench_run(&bench, "sequential_insert", options.num_rows, op_sequential_insert);
+	bench_close(&bench);
+
+	shuffled_ids = malloc(options.num_rows * sizeof(uint32_t));
+	for (uint32_t i = 0; i < options.num_rows; i++) {
+		shuffled_ids[i] = i + 1;
+	}
+	for (uint32_t i = options.num_rows; i > 1; i--) {
+		uint32_t j = bench_uniform(&bench, i);
+		uint32_t id = shuffled_ids[i - 1];
+		shuffled_ids[i - 1] = shuffled_ids[j];
+		shuffled_ids[j] = id;
+	}
+	bench_open(&bench);
+	bench_run(&bench, "random_insert", options.num_rows, op_random_insert);
+	bench_close(&bench);
+	free(shuffled_ids);
+
+	// The read-only workloads share one load
+	bench_open(&bench);
+	bench_load(&bench);
+	bench_run(&bench, "lookup_hit", options.num_ops, op_lookup_hit);
+	bench_run(&bench, "lookup_miss", options.num_ops, op_lookup_miss);
+	bench_run(&bench, "full_scan", options.num_scans, op_full_scan);
+	if (lsm) {
+		bench_skip("range_scan", "LSM tables have no range cursor");
+	} else {
+		bench_run(&bench, "range_scan", options.num_ops, op_range_scan);
+	}
+	bench_close(&bench);
+
+	bench_run_loaded(&bench, "ycsb_a", options.num_ops, op_ycsb_a);
+	bench_run_loaded(&bench, "ycsb_b", options.num_ops, op_ycsb_b);
+	bench_run_loaded(&bench, "ycsb_c", options.num_ops, op_ycsb_c);
+	if (lsm) {
+		bench_skip("ycsb_e", "LSM tables have no range cursor");
+	} else {
+		bench_run_loaded(&bench, "ycsb_e", options.num_ops, op_ycsb_e);
+	}
+
+	printf("\n  ]\n}\n");
+	free(bench.samples);
+	return EXIT_SUCCESS;
+}
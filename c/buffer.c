@@ -0,0 +1,242 @@
+#include "db.h"
+
+// Internal nodes hold only a few separators, so the rest of their page is
+// a buffer of rows on their way down, kept in leaf cell format and sorted
+// by key. In a table opened with DB_OPEN_BUFFERED, explicit transactions
+// append each insert to the highest node on its path that has room, and
+// only once every buffer on the path is full do those buffers empty into
+// the leaves, in key order. Rows then reach their leaves in batches
+// instead of one scattered leaf write at a time.
+//
+// Buffering is left to explicit transactions because they are the only
+// writer until they end: a row is checked against the whole path and
+// appended under the same latches, and a flush can take rows out of the
+// buffers before putting them in the leaves without another writer
+// missing them in between. Statements running on their own insert into
+// the leaves as before. Snapshots see buffers as of their timestamp like
+// any other part of a page, and rollback restores them with the page.
+//
+// The top TOP_LEVELS levels never buffer. Lookups skip them through the
+// flattened array in top.c, and a node only ever gets deeper as the tree
+// grows, so every lookup still passes every buffer that may hold its key.
+// Lookups check the buffers on the way down, and scans merge the buffered
+// rows in with the leaves.
+
+// Index of the first message in node with a key at or after key
+uint32_t buffer_search(void* node, uint32_t key) {
+	uint32_t min_index = 0;
+	uint32_t one_past_max_index = *internal_node_num_messages(node);
+	while (one_past_max_index != min_index) {
+		uint32_t index = (min_index + one_past_max_index) / 2;
+		if (*internal_node_message_key(node, index) < key) {
+			min_index = index + 1;
+		} else {
+			one_past_max_index = index;
+		}
+	}
+	return min_index;
+}
+
+bool buffer_holds(void* node, uint32_t key) {
+	uint32_t index = buffer_search(node, key);
+	return index < *internal_node_num_messages(node) && *internal_node_message_key(node, index) == key;
+}
+
+// A lookup of key is passing node. Remember the row if node buffers it.
+void buffer_find(Cursor* cursor, void* node, uint32_t key) {
+	if (*internal_node_num_messages(node) == 0 || !buffer_holds(node, key)) {
+		return;
+	}
+	if (cursor->message == NULL) {
+		cursor->message = malloc(INTERNAL_NODE_MESSAGE_SIZE);
+	}
+	memcpy(cursor->message, internal_node_message(node, buffer_search(node, key)), INTERNAL_NODE_MESSAGE_SIZE);
+}
+
+void buffer_add(Transaction* txn, uint32_t page_num, uint32_t key, Row* row) {
+	void* node = txn_write(txn, page_num);
+	uint32_t num_messages = *internal_node_num_messages(node);
+	uint32_t index = buffer_search(node, key);
+	memmove(internal_node_message(node, index + 1), internal_node_message(node, index), (num_messages - index) * INTERNAL_NODE_MESSAGE_SIZE);
+	*internal_node_message_key(node, index) = key;
+	serialize_row(row, internal_node_message_value(node, index));
+	*internal_node_num_messages(node) = num_messages + 1;
+}
+
+int buffer_compare_messages(const void* a, const void* b) {
+	uint32_t key_a;
+	uint32_t key_b;
+	memcpy(&key_a, a, sizeof(key_a));
+	memcpy(&key_b, b, sizeof(key_b));
+	return key_a < key_b ? -1 : key_a > key_b;
+}
+
+// Empty the full buffers of the pages on the cursor's path into the
+// leaves. Closes the cursor, since the inserts latch their own paths.
+void buffer_flush(Cursor* cursor, uint32_t* pages, uint32_t num_pages) {
+	Table* table = cursor->table;
+	Transaction* txn = cursor->txn;
+	void* messages = malloc(num_pages * INTERNAL_NODE_MAX_MESSAGES * INTERNAL_NODE_MESSAGE_SIZE);
+	uint32_t num_messages = 0;
+	for (uint32_t i = 0; i < num_pages; i++) {
+		void* node = txn_write(txn, pages[i]);
+		uint32_t num_buffered = *internal_node_num_messages(node);
+		memcpy(messages + num_messages * INTERNAL_NODE_MESSAGE_SIZE, internal_node_message(node, 0), num_buffered * INTERNAL_NODE_MESSAGE_SIZE);
+		num_messages += num_buffered;
+		*internal_node_num_messages(node) = 0;
+	}
+	cursor_close(cursor);
+
+	// In key order, so the batch walks the leaves left to right
+	qsort(messages, num_messages, INTERNAL_NODE_MESSAGE_SIZE, buffer_compare_messages);
+	for (uint32_t i = 0; i < num_messages; i++) {
+		void* message = messages + i * INTERNAL_NODE_MESSAGE_SIZE;
+		Row row;
+		deserialize_row(message + LEAF_NODE_KEY_SIZE, &row);
+		Cursor* leaf_cursor = table_find_for_write(table, txn, row.id);
+		leaf_node_add(leaf_cursor, row.id, &row);
+		cursor_close(leaf_cursor);
+	}
+	free(messages);
+}
+
+// Insert row on behalf of an explicit transaction. Returns false if its
+// key is taken.
+bool buffer_insert(Table* table, Transaction* txn, Row* row) {
+	uint32_t key = row->id;
+	while (true) {
+		// The only writer, so the whole path can stay latched
+		Cursor* cursor = cursor_new(table, LATCH_WRITE);
+		cursor->txn = txn;
+		uint32_t page_num = table->root_page_num;
+		void* node = cursor_latch(cursor, page_num);
+		uint32_t target = INVALID_PAGE_NUM;
+		uint32_t full[CURSOR_MAX_LATCHES];
+		uint32_t num_full = 0;
+		bool taken = false;
+		for (uint32_t depth = 0; get_node_type(node) == NODE_INTERNAL; depth++) {
+			taken = taken || buffer_holds(node, key);
+			if (depth >= TOP_LEVELS && target == INVALID_PAGE_NUM) {
+				if (*internal_node_num_messages(node) < INTERNAL_NODE_MAX_MESSAGES) {
+					target = page_num;
+				} else {
+					full[num_full++] = page_num;
+				}
+			}
+			page_num = *internal_node_child(node, internal_node_find_child(node, key));
+			node = cursor_latch(cursor, page_num);
+		}
+		leaf_node_find(cursor, page_num, key);
+		taken = taken || (cursor->cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, cursor->cell_num) == key);
+
+		if (taken) {
+			cursor_close(cursor);
+			return false;
+		}
+		if (target != INVALID_PAGE_NUM) {
+			buffer_add(txn, target, key, row);
+			cursor_close(cursor);
+			index_insert_row(table, row);
+			row_cache_invalidate(table, key);
+			return true;
+		}
+		if (num_full == 0) {
+			// Too short to have levels that buffer
+			leaf_node_insert(cursor, key, row);
+			cursor_close(cursor);
+			return true;
+		}
+		buffer_flush(cursor, full, num_full);
+	}
+}
+
+// An internal node split at separator. The new right sibling takes the
+// buffered rows above it.
+void buffer_split(void* old_node, void* new_node, uint32_t separator) {
+	uint32_t num_messages = *internal_node_num_messages(old_node);
+	uint32_t num_kept = buffer_search(old_node, separator);
+	if (num_kept < num_messages && *internal_node_message_key(old_node, num_kept) == separator) {
+		num_kept++;
+	}
+	memcpy(internal_node_message(new_node, 0), internal_node_message(old_node, num_kept), (num_messages - num_kept) * INTERNAL_NODE_MESSAGE_SIZE);
+	*internal_node_num_messages(new_node) = num_messages - num_kept;
+	*internal_node_num_messages(old_node) = num_kept;
+}
+
+// Copy every row buffered in the tree with a key at or after key into
+// *messages, in key order. Returns how many there are. Nodes are latched
+// one at a time, level by level, so the caller must not hold a latch.
+uint32_t buffer_collect(Table* table, Snapshot* snapshot, uint32_t key, void** messages) {
+	uint32_t level[TABLE_MAX_PAGES];
+	uint32_t num_level = 1;
+	level[0] = table->root_page_num;
+	uint32_t num_messages = 0;
+	uint32_t capacity = 0;
+	*messages = NULL;
+
+	Cursor* cursor = cursor_new(table, LATCH_READ);
+	cursor->snapshot = snapshot;
+	while (num_level > 0) {
+		uint32_t children[TABLE_MAX_PAGES];
+		uint32_t num_children = 0;
+		bool leaves_below = false;
+		for (uint32_t i = 0; i < num_level; i++) {
+			void* node = cursor_latch(cursor, level[i]);
+			if (get_node_type(node) == NODE_LEAF) {
+				cursor_unlatch_all(cursor);
+				break;
+			}
+			uint32_t num_buffered = *internal_node_num_messages(node);
+			uint32_t first = buffer_search(node, key);
+			if (num_messages + num_buffered - first > capacity) {
+				capacity = (num_messages + num_buffered - first) * 2;
+				*messages = realloc(*messages, capacity * INTERNAL_NODE_MESSAGE_SIZE);
+			}
+			memcpy(*messages + num_messages * INTERNAL_NODE_MESSAGE_SIZE, internal_node_message(node, first), (num_buffered - first) * INTERNAL_NODE_MESSAGE_SIZE);
+			num_messages += num_buffered - first;
+
+			uint32_t num_keys = *internal_node_num_keys(node);
+			for (uint32_t j = 0; j <= num_keys; j++) {
+				children[num_children++] = *internal_node_child(node, j);
+			}
+			// Non-root pages never change type, peeking is safe
+			leaves_below = get_node_type(pager_pin(table->pager, children[0])) == NODE_LEAF;
+			pager_unpin(table->pager, children[0]);
+			cursor_unlatch_all(cursor);
+		}
+		if (leaves_below) {
+			break;
+		}
+		memcpy(level, children, num_children * sizeof(uint32_t));
+		num_level = num_children;
+	}
+	cursor_close(cursor);
+
+	qsort(*messages, num_messages, INTERNAL_NODE_MESSAGE_SIZE, buffer_compare_messages);
+	return num_messages;
+}
+
+// Put a merging scan on whichever comes first, its leaf row or its next
+// buffered row
+void buffer_merge(Cursor* cursor) {
+	cursor->message = NULL;
+	if (cursor->next_message < cursor->num_messages) {
+		void* message = cursor->messages + cursor->next_message * INTERNAL_NODE_MESSAGE_SIZE;
+		uint32_t message_key;
+		memcpy(&message_key, message, sizeof(message_key));
+		if (cursor->leaves_done || message_key < *leaf_node_key(cursor_page(cursor, cursor->page_num), cursor->cell_num)) {
+			cursor->message = message;
+		}
+	}
+	cursor->end_of_table = cursor->leaves_done && cursor->message == NULL;
+}
+
+void buffer_advance(Cursor* cursor) {
+	if (cursor->message != NULL) {
+		cursor->next_message++;
+	} else {
+		cursor_advance_leaf(cursor);
+		cursor->leaves_done = cursor->end_of_table;
+	}
+	buffer_merge(cursor);
+}
@@ -0,0 +1,161 @@
+#include "db.h"
+
+// Page replacement, 2Q. A page loaded for the first time goes on the
+// CACHE_IN FIFO. Most pages are only used in a burst, and they leave from
+// there without disturbing anything else. The page numbers of those that
+// leave are remembered for a while on CACHE_GHOST, and a page loaded again
+// while still remembered has proven to be reused: it goes on CACHE_MAIN,
+// an LRU list that holds the working set, internal nodes above all.
+//
+// Leaves loaded by a scan go on the CACHE_SCAN ring instead. Scan pages
+// only take frames nobody else needs: they are the first to go once the
+// cache is full, so from then on a scan keeps recycling its own oldest
+// frames and can read the whole table without pushing anything else out.
+//
+// Lists change under pager->lock, on cache misses. A hit only sets the
+// page's referenced bit, and the bit is looked at when the page reaches
+// the tail: a referenced page on CACHE_MAIN goes back to the head, a
+// referenced scan page has been used by something other than the scan
+// and moves to CACHE_IN.
+
+#define CACHE_NO_PAGE UINT32_MAX
+
+void cache_init(Pager* pager) {
+	pager->cache_capacity = TABLE_MAX_PAGES;
+	pager->num_cached = 0;
+	for (uint32_t i = 0; i < CACHE_NUM_LISTS; i++) {
+		pager->cache_lists[i].head = CACHE_NO_PAGE;
+		pager->cache_lists[i].tail = CACHE_NO_PAGE;
+		pager->cache_lists[i].length = 0;
+	}
+	for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+		pager->cache_list[i] = CACHE_NONE;
+		pager->referenced[i] = false;
+	}
+}
+
+// Keep at most num_pages pages in memory, as far as clean ones can be
+// evicted. Dirty pages stay until they are committed.
+void pager_set_cache_capacity(Pager* pager, uint32_t num_pages) {
+	pthread_mutex_lock(&pager->lock);
+	pager->cache_capacity = num_pages > 0 ? num_pages : 1;
+	pthread_mutex_unlock(&pager->lock);
+}
+
+// Pages CACHE_IN keeps before it gives them up in favour of CACHE_MAIN
+uint32_t cache_in_size(Pager* pager) {
+	return pager->cache_capacity / 4 > 0 ? pager->cache_capacity / 4 : 1;
+}
+
+// Evicted page numbers remembered
+uint32_t cache_ghost_size(Pager* pager) {
+	return pager->cache_capacity / 2 > 0 ? pager->cache_capacity / 2 : 1;
+}
+
+void cache_unlink(Pager* pager, uint32_t page_num) {
+	CacheList* list = &pager->cache_lists[pager->cache_list[page_num]];
+	uint32_t prev = pager->cache_prev[page_num];
+	uint32_t next = pager->cache_next[page_num];
+	if (prev == CACHE_NO_PAGE) {
+		list->head = next;
+	} else {
+		pager->cache_next[prev] = next;
+	}
+	if (next == CACHE_NO_PAGE) {
+		list->tail = prev;
+	} else {
+		pager->cache_prev[next] = prev;
+	}
+	list->length--;
+	pager->cache_list[page_num] = CACHE_NONE;
+}
+
+void cache_push(Pager* pager, CacheListId id, uint32_t page_num) {
+	if (pager->cache_list[page_num] != CACHE_NONE) {
+		cache_unlink(pager, page_num);
+	}
+	CacheList* list = &pager->cache_lists[id];
+	pager->cache_prev[page_num] = CACHE_NO_PAGE;
+	pager->cache_next[page_num] = list->head;
+	if (list->head == CACHE_NO_PAGE) {
+		list->tail = page_num;
+	} else {
+		pager->cache_prev[list->head] = page_num;
+	}
+	list->head = page_num;
+	list->length++;
+	pager->cache_list[page_num] = id;
+}
+
+// Put a page just loaded on its list
+void cache_admit(Pager* pager, uint32_t page_num, bool scan) {
+	pager->referenced[page_num] = false;
+	if (scan) {
+		cache_push(pager, CACHE_SCAN, page_num);
+	} else if (pager->cache_list[page_num] == CACHE_GHOST) {
+		cache_push(pager, CACHE_MAIN, page_num);
+	} else {
+		cache_push(pager, CACHE_IN, page_num);
+	}
+}
+
+// Forget a page that is being dropped
+void cache_forget(Pager* pager, uint32_t page_num) {
+	if (pager->cache_list[page_num] != CACHE_NONE) {
+		cache_unlink(pager, page_num);
+	}
+	if (pager->pages[page_num] != NULL) {
+		pager->num_cached--;
+	}
+}
+
+void cache_remember(Pager* pager, uint32_t page_num) {
+	cache_push(pager, CACHE_GHOST, page_num);
+	CacheList* ghosts = &pager->cache_lists[CACHE_GHOST];
+	if (ghosts->length > cache_ghost_size(pager)) {
+		cache_unlink(pager, ghosts->tail);
+	}
+}
+
+// Evict the oldest page of a list that can go, giving referenced pages
+// the treatment described at the top. Returns false if none could.
+bool cache_evict_from(Pager* pager, CacheListId id) {
+	CacheList* list = &pager->cache_lists[id];
+	uint32_t num_steps = list->length;
+	uint32_t page_num = list->tail;
+	for (uint32_t step = 0; step < num_steps && page_num != CACHE_NO_PAGE; step++) {
+		uint32_t prev = pager->cache_prev[page_num];
+		if (pager->referenced[page_num] && id != CACHE_IN) {
+			pager->referenced[page_num] = false;
+			cache_push(pager, id == CACHE_SCAN ? CACHE_IN : CACHE_MAIN, page_num);
+		} else if (pager_evict(pager, page_num)) {
+			if (id == CACHE_IN) {
+				cache_remember(pager, page_num);
+			} else {
+				cache_unlink(pager, page_num);
+			}
+			return true;
+		}
+		page_num = prev;
+	}
+	return false;
+}
+
+// Make room for a page about to be loaded. Pages that are dirty or in use
+// can not be evicted; when nothing else can, the cache goes over capacity
+// and comes back down as they are committed and released.
+void cache_make_room(Pager* pager) {
+	CacheList* lists = pager->cache_lists;
+	while (pager->num_cached >= pager->cache_capacity) {
+		if (cache_evict_from(pager, CACHE_SCAN)) {
+			continue;
+		}
+		if (lists[CACHE_IN].length > cache_in_size(pager) && cache_evict_from(pager, CACHE_IN)) {
+			continue;
+		}
+		if (cache_evict_from(pager, CACHE_MAIN) || cache_evict_from(pager, CACHE_IN)) {
+			continue;
+		}
+		break;
+	}
+}
@@ -0,0 +1,262 @@
+#include "db.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Command line client for server mode. Reads statements like the REPL
+// does and prints the same output. Parameters follow a |, as in
+//   insert ? ? ? | 1 user1 person1@example.com
+// where anything that looks like a number is sent as an integer. Select
+// results are streamed rather than fetched.
+
+#define CLIENT_PIPELINE_DEPTH 64 // Statements sent per write
+#define CLIENT_CHUNK_ROWS 256
+
+int connect_unix(const char* path) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
+		printf("Unable to connect to %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+int connect_tcp(uint16_t port) {
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
+		printf("Unable to connect to port %d\n", port);
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+void send_all(int fd, Buffer* out) {
+	uint32_t sent = 0;
+	while (sent < out->length) {
+		ssize_t written = send(fd, out->data + sent, out->length - sent, MSG_NOSIGNAL);
+		if (written == -1) {
+			printf("Error writing to server: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+		sent += written;
+	}
+	out->length = 0;
+}
+
+// Block until a whole frame is at the front of in. Returns its size.
+uint32_t receive_frame(int fd, Buffer* in) {
+	int64_t size;
+	while ((size = frame_size(in)) == 0) {
+		buffer_reserve(in, 65536);
+		ssize_t bytes_read = read(fd, in->data + in->length, in->capacity - in->length);
+		if (bytes_read <= 0) {
+			printf("Server closed the connection.\n");
+			exit(EXIT_FAILURE);
+		}
+		in->length += bytes_read;
+	}
+	if (size < 0) {
+		printf("Malformed reply from server.\n");
+		exit(EXIT_FAILURE);
+	}
+	return size;
+}
+
+bool is_integer(const char* text) {
+	if (*text == '-') {
+		text++;
+	}
+	if (*text == '\0') {
+		return false;
+	}
+	for (; *text != '\0'; text++) {
+		if (*text < '0' || *text > '9') {
+			return false;
+		}
+	}
+	return true;
+}
+
+void put_bind(Buffer* out, uint32_t id, char* params) {
+	char* values[256];
+	uint16_t num_params = 0;
+	for (char* value = strtok(params, " "); value != NULL && num_params < 256; value = strtok(NULL, " ")) {
+		values[num_params++] = value;
+	}
+
+	uint32_t start = frame_begin(out, MESSAGE_BIND);
+	buffer_put_u32(out, id);
+	buffer_put_u16(out, num_params);
+	for (uint16_t i = 0; i < num_params; i++) {
+		if (is_integer(values[i])) {
+			buffer_put_u8(out, PARAM_INT);
+			buffer_put_u32(out, atoi(values[i]));
+		} else {
+			buffer_put_u8(out, PARAM_TEXT);
+			buffer_put_u16(out, strlen(values[i]));
+			buffer_put_bytes(out, values[i], strlen(values[i]));
+		}
+	}
+	frame_end(out, start);
+}
+
+// Queue the requests that run one line: prepare, bind if it has
+// parameters, and execute with the rows streamed. Returns whether it binds.
+bool put_statement(Buffer* out, uint32_t id, char* line) {
+	char* params = strstr(line, " | ");
+	if (params != NULL) {
+		*params = '\0';
+		params += 3;
+	}
+
+	uint32_t start = frame_begin(out, MESSAGE_PREPARE);
+	buffer_put_u32(out, id);
+	buffer_put_bytes(out, line, strlen(line));
+	frame_end(out, start);
+
+	if (params != NULL) {
+		put_bind(out, id, params);
+	}
+
+	start = frame_begin(out, MESSAGE_EXECUTE);
+	buffer_put_u32(out, id);
+	buffer_put_u32(out, CLIENT_CHUNK_ROWS);
+	frame_end(out, start);
+	return params != NULL;
+}
+
+void print_error(uint8_t* frame) {
+	Reader reader;
+	reader_init(&reader, frame);
+	uint32_t length = reader_remaining(&reader);
+	printf("%.*s\n", (int)length, (char*)reader_bytes(&reader, length));
+}
+
+void print_rows(uint8_t* frame) {
+	Reader reader;
+	reader_init(&reader, frame);
+	uint32_t count = reader_u32(&reader);
+	reader_u8(&reader);
+	for (uint32_t i = 0; i < count && !reader.error; i++) {
+		uint32_t id = reader_u32(&reader);
+		uint8_t username_length = reader_u8(&reader);
+		char* username = (char*)reader_bytes(&reader, username_length);
+		uint8_t email_length = reader_u8(&reader);
+		char* email = (char*)reader_bytes(&reader, email_length);
+		if (!reader.error) {
+			printf("(%d, %.*s, %.*s)\n", id, username_length, username, email_length, email);
+		}
+	}
+	if (reader.error) {
+		printf("Malformed reply from server.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Read the replies to one line's requests and print what the REPL would.
+// Once a request fails the ones after it fail too; only the first error
+// is shown.
+void print_statement_result(int fd, Buffer* in, bool binds) {
+	bool failed = false;
+	uint32_t num_replies = binds ? 2 : 1;
+	for (uint32_t i = 0; i < num_replies; i++) {
+		uint32_t size = receive_frame(fd, in);
+		if (in->data[4] == MESSAGE_ERROR && !failed) {
+			print_error(in->data);
+			failed = true;
+		}
+		buffer_consume(in, size);
+	}
+
+	while (true) {
+		uint32_t size = receive_frame(fd, in);
+		uint8_t type = in->data[4];
+		if (type == MESSAGE_ROWS) {
+			print_rows(in->data);
+		} else if (type == MESSAGE_ERROR && !failed) {
+			print_error(in->data);
+		} else if (type == MESSAGE_OK && !failed) {
+			printf("Executed.\n");
+		}
+		buffer_consume(in, size);
+		if (type != MESSAGE_ROWS) {
+			return;
+		}
+	}
+}
+
+int main(int argc, char* argv[]) {
+	int fd;
+	if (argc == 3 && strcmp(argv[1], "--tcp") == 0) {
+		fd = connect_tcp(atoi(argv[2]));
+	} else if (argc == 2) {
+		fd = connect_unix(argv[1]);
+	} else {
+		printf("Usage: db-client SOCKET | db-client --tcp PORT\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// A person typing waits for each result. Piped input goes out in
+	// batches of statements, one write each.
+	bool interactive = isatty(STDIN_FILENO);
+	uint32_t depth = interactive ? 1 : CLIENT_PIPELINE_DEPTH;
+
+	Buffer out = {NULL, 0, 0};
+	Buffer in = {NULL, 0, 0};
+	char* line = NULL;
+	size_t line_capacity = 0;
+	bool binds[CLIENT_PIPELINE_DEPTH];
+	bool finished = false;
+	while (!finished) {
+		uint32_t num_statements = 0;
+		while (num_statements < depth) {
+			if (interactive) {
+				printf("db > ");
+				fflush(stdout);
+			}
+			ssize_t line_length = getline(&line, &line_capacity, stdin);
+			if (line_length <= 0) {
+				finished = true;
+				break;
+			}
+			if (line[line_length - 1] == '\n') {
+				line[line_length - 1] = '\0';
+			}
+			if (strcmp(line, ".exit") == 0) {
+				finished = true;
+				break;
+			}
+			binds[num_statements] = put_statement(&out, num_statements + 1, line);
+			num_statements++;
+		}
+
+		send_all(fd, &out);
+		for (uint32_t i = 0; i < num_statements; i++) {
+			if (!interactive) {
+				printf("db > ");
+			}
+			print_statement_result(fd, &in, binds[i]);
+		}
+	}
+	if (!interactive) {
+		printf("db > ");
+	}
+
+	free(line);
+	buffer_free(&out);
+	buffer_free(&in);
+	close(fd);
+	return EXIT_SUCCESS;
+}
@@ -26,7 +26,9 @@ const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_HIGH_KEY_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_HIGH_KEY_OFFSET = LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE + LEAF_NODE_HIGH_KEY_SIZE;
 
 // Leaf Node Body Layout
 const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
@@ -45,7 +47,13 @@ const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET = INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
-const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const uint32_t INTERNAL_NODE_RIGHT_SIBLING_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_RIGHT_SIBLING_OFFSET = INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const uint32_t INTERNAL_NODE_HIGH_KEY_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_HIGH_KEY_OFFSET = INTERNAL_NODE_RIGHT_SIBLING_OFFSET + INTERNAL_NODE_RIGHT_SIBLING_SIZE;
+const uint32_t INTERNAL_NODE_NUM_MESSAGES_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_NUM_MESSAGES_OFFSET = INTERNAL_NODE_HIGH_KEY_OFFSET + INTERNAL_NODE_HIGH_KEY_SIZE;
+const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE + INTERNAL_NODE_RIGHT_SIBLING_SIZE + INTERNAL_NODE_HIGH_KEY_SIZE + INTERNAL_NODE_NUM_MESSAGES_SIZE;
 
 // Internal Node Body Layout
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
@@ -53,3 +61,9 @@ const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
 // Keep this small for testing
 const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
+
+// Internal Node Buffer Layout, after the cells. Buffered rows use the leaf
+// cell format.
+const uint32_t INTERNAL_NODE_MESSAGE_SIZE = LEAF_NODE_CELL_SIZE;
+const uint32_t INTERNAL_NODE_BUFFER_OFFSET = INTERNAL_NODE_HEADER_SIZE + INTERNAL_NODE_MAX_CELLS * INTERNAL_NODE_CELL_SIZE;
+const uint32_t INTERNAL_NODE_MAX_MESSAGES = (PAGE_SIZE - INTERNAL_NODE_BUFFER_OFFSET) / INTERNAL_NODE_MESSAGE_SIZE;
@@ -1,8 +1,12 @@
 #ifndef __db_h__
 #define __db_h__
 
+#define _GNU_SOURCE // O_DIRECT
+
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,45 +43,564 @@ const uint32_t ROWS_PER_PAGE;
 const uint32_t TABLE_MAX_ROWS;
 
 
+// Flags for db_open()
+#define DB_OPEN_DIRECT_IO 0x1 // Bypass the kernel page cache with O_DIRECT
+#define DB_OPEN_SHADOW 0x2 // Create new files in shadow paging mode
+#define DB_OPEN_LSM 0x4 // Create new files as LSM tables, see lsm.c
+#define DB_OPEN_BUFFERED 0x8 // Buffer inserts of explicit transactions in internal nodes, see buffer.c
+
+// An older image of a page kept for snapshots that started before it was
+// overwritten. Chains are ordered newest first.
+typedef struct PageVersion {
+	uint64_t commit_ts; // Commit timestamp of the image
+	void* data;
+	struct PageVersion* older;
+} PageVersion;
+
+// Commit timestamp of a page modified by a transaction that has not committed yet
+#define COMMIT_TS_PENDING UINT64_MAX
+
+// Lists of the 2Q page cache, see cache.c
+typedef enum {
+	CACHE_NONE, // Not cached
+	CACHE_SCAN, // Loaded by a scan, recycled first
+	CACHE_IN, // Loaded once, FIFO
+	CACHE_MAIN, // Used again after leaving CACHE_IN, LRU
+	CACHE_GHOST, // Evicted from CACHE_IN recently, page number only
+	CACHE_NUM_LISTS
+} CacheListId;
+
+// Pages linked through Pager.cache_prev and cache_next, newest at the head
+typedef struct {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t length;
+} CacheList;
+
 typedef struct {
 	int file_descriptor;
-	uint32_t file_length;
+	uint32_t file_length; // Committed pages times PAGE_SIZE in shadow mode
 	uint32_t num_pages;
-	void* pages[TABLE_MAX_PAGES];
+	bool direct_io; // false if O_DIRECT was not requested or the filesystem rejected it
+	_Atomic(void*) pages[TABLE_MAX_PAGES];
+	pthread_mutex_t lock; // Guards cache misses and page allocation
+	pthread_rwlock_t latches[TABLE_MAX_PAGES];
+	atomic_uint pin_counts[TABLE_MAX_PAGES];
+	// Commit timestamp of the cached image. Atomic because new pages are
+	// stamped before anyone latches them.
+	_Atomic uint64_t commit_ts[TABLE_MAX_PAGES];
+	PageVersion* versions[TABLE_MAX_PAGES]; // Guarded by the page latch
+	// Which pages have versions, and how many, for gc_versions() to look
+	// at without latching every page. Changed under the page latch.
+	atomic_bool has_versions[TABLE_MAX_PAGES];
+	atomic_uint num_versioned_pages;
+	atomic_bool dirty[TABLE_MAX_PAGES]; // Written since the last pager_commit()
+	// Clean pages past the capacity are evicted, see cache.c. The lists
+	// are guarded by lock; hits only set the referenced bit.
+	uint32_t cache_capacity;
+	uint32_t num_cached;
+	CacheList cache_lists[CACHE_NUM_LISTS];
+	uint8_t cache_list[TABLE_MAX_PAGES]; // CacheListId the page is on
+	uint32_t cache_prev[TABLE_MAX_PAGES]; // Towards the head
+	uint32_t cache_next[TABLE_MAX_PAGES]; // Towards the tail
+	atomic_bool referenced[TABLE_MAX_PAGES]; // Used since it was last looked at
+	char* journal_path;
+	int journal_fd; // -1 until the first commit
+	// Shadow paging: pages are never overwritten in place. page_table maps
+	// each page to where its committed image lives in the file.
+	bool shadow;
+	uint64_t shadow_txn_id;
+	uint32_t page_table[TABLE_MAX_PAGES];
 } Pager;
 
-Pager* pager_open(const char* filename);
+typedef enum { LATCH_READ, LATCH_WRITE } LatchMode;
+
+Pager* pager_open(const char* filename, uint32_t flags);
+void pager_read(Pager* pager, void* page, uint32_t location);
+void pager_write(Pager* pager, void* page, uint32_t location);
 void pager_flush(Pager* pager, uint32_t page_num);
+void pager_commit(Pager* pager);
 void* get_page(Pager* pager, uint32_t page_num);
+bool pager_page_cached(Pager* pager, uint32_t page_num);
+bool pager_page_offset(Pager* pager, uint32_t page_num, off_t* offset);
+void pager_install_page(Pager* pager, uint32_t page_num, void* page);
+bool pager_evict(Pager* pager, uint32_t page_num);
+void cache_init(Pager* pager);
+void pager_set_cache_capacity(Pager* pager, uint32_t num_pages);
+void cache_admit(Pager* pager, uint32_t page_num, bool scan);
+void cache_make_room(Pager* pager);
+void cache_forget(Pager* pager, uint32_t page_num);
+void* pager_pin(Pager* pager, uint32_t page_num);
+void pager_unpin(Pager* pager, uint32_t page_num);
+void* pager_latch(Pager* pager, uint32_t page_num, LatchMode mode);
+void* pager_latch_for_scan(Pager* pager, uint32_t page_num, LatchMode mode);
+void pager_unlatch(Pager* pager, uint32_t page_num);
 uint32_t get_unused_page_num(Pager* pager);
+void pager_save_version(Pager* pager, uint32_t page_num);
+void* pager_image_as_of(Pager* pager, uint32_t page_num, uint64_t snapshot_ts);
+void* pager_page_as_of(Pager* pager, uint32_t page_num, uint64_t snapshot_ts);
+void pager_drop_versions(Pager* pager, uint32_t page_num, uint64_t oldest_snapshot_ts);
+void free_versions(PageVersion* version);
+void* pager_alloc_page();
+uint32_t page_checksum(uint32_t seed, void* page);
+void sync_or_exit(int fd);
+
+bool shadow_open(Pager* pager, uint32_t flags);
+void shadow_commit(Pager* pager);
+
 
+typedef struct Snapshot {
+	uint64_t ts; // Sees every commit up to and including this timestamp
+	struct Snapshot* next;
+} Snapshot;
+
+#define TOP_LEVELS 2 // Levels of the tree lookups skip, see top.c
+#define HASH_INDEX_SLOTS 1024 // Hot keys remembered, see hash.c
+
+typedef struct TopLevels TopLevels;
 
 typedef struct {
 	Pager* pager;
 	uint32_t root_page_num;
+	pthread_mutex_t mvcc_lock; // Guards last_commit_ts and snapshots
+	uint64_t last_commit_ts;
+	Snapshot* snapshots; // Active snapshots
+	atomic_uint num_snapshots;
+	// Writers that skip saving page versions hold this shared. New
+	// snapshots take it exclusively to wait for them to finish.
+	pthread_rwlock_t version_barrier;
+	// Statements hold this shared. An explicit transaction holds it
+	// exclusively from BEGIN until COMMIT or ROLLBACK.
+	pthread_rwlock_t write_lock;
+	pthread_mutex_t index_build_lock; // One index build at a time
+	pthread_rwlock_t index_lock; // Guards username_index
+	_Atomic(struct UsernameIndex*) username_index; // NULL until created, read without the lock by inserts
+	struct RowCache* row_cache; // NULL unless one was created
+	struct Lsm* lsm; // NULL for B-tree tables
+	bool buffered; // Explicit transactions insert through node buffers
+	_Atomic(TopLevels*) top_levels; // NULL until the first snapshot reader
+	_Atomic uint64_t top_levels_changed_ts; // Last commit that split a page they cover
+	pthread_mutex_t top_levels_lock; // One rebuild at a time
+	_Atomic uint64_t hash_index[HASH_INDEX_SLOTS]; // Packed entries, see hash.c
 } Table;
 
-Table* db_open(const char* filename);
+Table* db_open(const char* filename, uint32_t flags);
 void db_close(Table* table);
 
 
+typedef struct {
+	uint32_t page_num;
+	uint64_t commit_ts; // Commit timestamp before the transaction wrote it
+	void* before_image; // Explicit transactions only, NULL for new pages
+} DirtyPage;
+
 typedef struct {
 	Table* table;
+	bool save_versions; // A snapshot may need the images this transaction overwrites
+	bool explicit; // Started by BEGIN, can be rolled back
+	uint32_t start_num_pages;
+	DirtyPage* dirty_pages;
+	uint32_t num_dirty_pages;
+	uint32_t dirty_pages_capacity;
+	bool splits_top_levels; // Commit makes table->top_levels out of date
+	uint32_t* lsm_keys; // Rows inserted into an LSM table
+	uint32_t num_lsm_keys;
+	uint32_t lsm_keys_capacity;
+} Transaction;
+
+Snapshot* snapshot_begin(Table* table);
+void snapshot_end(Table* table, Snapshot* snapshot);
+uint64_t oldest_snapshot_ts(Table* table);
+void gc_versions(Table* table);
+Transaction* txn_begin(Table* table);
+Transaction* txn_begin_explicit(Table* table);
+void* txn_write(Transaction* txn, uint32_t page_num);
+uint32_t txn_new_page(Transaction* txn);
+void txn_commit(Transaction* txn);
+void txn_rollback(Transaction* txn);
+
+
+#define CURSOR_MAX_LATCHES 16
+
+typedef struct {
+	Table* table;
+	Snapshot* snapshot; // Read cursors only, NULL reads the latest images
+	Transaction* txn; // Write cursors only
 	uint32_t page_num;
 	uint32_t cell_num;
 	bool end_of_table; // Indicates a position one past the last element
+	LatchMode latch_mode;
+	bool optimistic; // Write cursor that read-latches internal nodes
+	bool scan; // Walks every leaf, which the cache should not hold on to
+	// The row at the cursor when it is buffered in an internal node
+	// rather than in the leaf. A lookup owns its copy, a scan points
+	// into messages: every buffered row it merges with the leaves.
+	void* message;
+	void* messages;
+	uint32_t num_messages;
+	uint32_t next_message;
+	bool leaves_done; // A merging scan is past the last leaf row
+	// Pages latched by this cursor, root side first. A read cursor only
+	// holds its leaf. A write cursor holds the path up to the lowest
+	// ancestor that a split below can not reach.
+	uint32_t latched_pages[CURSOR_MAX_LATCHES];
+	void* latched_frames[CURSOR_MAX_LATCHES]; // The image each one reads as
+	uint32_t num_latched;
 } Cursor;
 
-Cursor* table_start(Table* table);
+Cursor* cursor_new(Table* table, LatchMode latch_mode);
+void* cursor_page(Cursor* cursor, uint32_t page_num);
+void* cursor_latch(Cursor* cursor, uint32_t page_num);
+void* cursor_latch_if_visible(Cursor* cursor, uint32_t page_num);
+void cursor_unlatch_all(Cursor* cursor);
+Cursor* table_start(Table* table, Snapshot* snapshot);
+Cursor* table_seek(Table* table, Snapshot* snapshot, uint32_t key);
+Cursor* table_scan(Table* table, Snapshot* snapshot, uint32_t key);
 void* cursor_value(Cursor* cursor);
+uint32_t cursor_key(Cursor* cursor);
 void cursor_advance(Cursor* cursor);
-
-Cursor* table_find(Table* table, uint32_t key);
-Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key);
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key);
+void cursor_advance_leaf(Cursor* cursor);
+void cursor_close(Cursor* cursor);
+uint32_t cursor_parent(Cursor* cursor, uint32_t page_num);
+
+Cursor* table_find(Table* table, Snapshot* snapshot, uint32_t key);
+Cursor* table_find_for_write(Table* table, Transaction* txn, uint32_t key);
+uint32_t table_missing_pages(Table* table, bool whole_tree, uint32_t key, uint32_t* pages);
+void leaf_node_find(Cursor* cursor, uint32_t page_num, uint32_t key);
+void internal_node_find(Cursor* cursor, uint32_t page_num, uint32_t key);
 uint32_t internal_node_find_child(void* node, uint32_t key);
 
+void top_levels_init(Table* table);
+void top_levels_free(Table* table);
+bool top_levels_find(Table* table, Snapshot* snapshot, uint32_t key, uint32_t* page_num);
+void top_levels_note_split(Transaction* txn, uint32_t page_num);
+
+void hash_index_init(Table* table);
+bool hash_index_find(Cursor* cursor, uint32_t key);
+void hash_index_note(Cursor* cursor, uint32_t key);
+
+void buffer_find(Cursor* cursor, void* node, uint32_t key);
+bool buffer_insert(Table* table, Transaction* txn, Row* row);
+void buffer_split(void* old_node, void* new_node, uint32_t separator);
+uint32_t buffer_collect(Table* table, Snapshot* snapshot, uint32_t key, void** messages);
+void buffer_merge(Cursor* cursor);
+void buffer_advance(Cursor* cursor);
+
+typedef void (*TaskFunction)(void* arg);
+typedef struct ThreadPool ThreadPool;
+
+// Tasks spawned together so a caller can wait for all of them
+typedef struct {
+	ThreadPool* pool;
+	atomic_uint pending;
+} TaskGroup;
+
+ThreadPool* pool_create(uint32_t num_threads, bool pin);
+void pool_destroy(ThreadPool* pool);
+uint32_t pool_num_threads(ThreadPool* pool);
+void shared_pool_configure(uint32_t num_threads, bool pin);
+ThreadPool* shared_pool();
+void task_group_init(TaskGroup* group, ThreadPool* pool);
+void task_group_spawn(TaskGroup* group, TaskFunction fn, void* arg);
+void task_group_wait(TaskGroup* group);
+
+// Memory for queries, see memory.c. Each query is granted a budget out of
+// a global limit when it is admitted, and spills what does not fit.
+typedef struct {
+	size_t granted; // Taken from the global limit until memory_finish()
+	atomic_size_t used;
+} QueryMemory;
+
+// Rows kept by an operator, in memory while the budget lasts and in a
+// temporary file after that. Read back in the order they were added.
+typedef struct {
+	QueryMemory* memory;
+	void* rows;
+	uint32_t num_rows; // In memory, ahead of the spilled ones
+	uint32_t rows_capacity;
+	FILE* spill; // NULL until the budget runs out
+	uint32_t num_spilled;
+	uint32_t next_row;
+	void* spilled_row; // Where row_store_next() reads a spilled row
+} RowStore;
+
+void memory_configure(size_t limit, size_t query_budget);
+bool memory_try_admit(QueryMemory* memory);
+void memory_admit(QueryMemory* memory);
+void memory_admit_spilling(QueryMemory* memory);
+bool memory_reserve(QueryMemory* memory, size_t size);
+void memory_release(QueryMemory* memory, size_t size);
+void memory_finish(QueryMemory* memory);
+void row_store_init(RowStore* store, QueryMemory* memory);
+void row_store_append(RowStore* store, void* value);
+uint32_t row_store_count(RowStore* store);
+void* row_store_next(RowStore* store);
+void row_store_free(RowStore* store);
+
+#define SCAN_MAX_WORKERS 64
+
+// Called for every row of a parallel scan
+typedef void (*ScanRowFunction)(uint32_t worker, void* value, void* arg);
+
+void table_parallel_scan(Table* table, Snapshot* snapshot, uint32_t num_workers, bool ordered, QueryMemory* memory, ScanRowFunction fn, void* arg);
+
+typedef struct UsernameIndex UsernameIndex;
+
+void index_create(Table* table, bool in_transaction);
+void index_insert_row(Table* table, Row* row);
+bool index_ready(Table* table);
+int32_t index_lookup(Table* table, const char* username, uint32_t** ids);
+void index_free(UsernameIndex* index);
+
+typedef struct RowCache RowCache;
+
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint32_t num_rows;
+	uint32_t capacity; // Rows it can hold
+} RowCacheStats;
+
+void row_cache_create(Table* table, size_t size);
+void row_cache_free(RowCache* cache);
+bool row_cache_get(Table* table, Snapshot* snapshot, uint32_t id, Row* row);
+void row_cache_put(Table* table, Snapshot* snapshot, Row* row);
+void row_cache_invalidate(Table* table, uint32_t id);
+bool row_cache_stats(Table* table, RowCacheStats* stats);
+
+// LSM engine, see lsm.c. Tables created with DB_OPEN_LSM keep their rows
+// in a memtable and sorted runs instead of the B-tree.
+typedef struct Lsm Lsm;
+
+Lsm* lsm_open(const char* filename, bool create);
+void lsm_close(Table* table);
+bool lsm_insert(Table* table, Transaction* txn, Row* row);
+void lsm_commit(Transaction* txn, uint64_t commit_ts);
+void lsm_schedule_flush(Table* table);
+void lsm_sync(Table* table);
+void lsm_rollback(Transaction* txn);
+bool lsm_get(Table* table, Snapshot* snapshot, uint32_t key, Row* row);
+void lsm_scan(Table* table, Snapshot* snapshot, ScanRowFunction fn, void* arg);
+void lsm_print(Table* table);
+
+// Engine-wide counters, see stats.c
+typedef enum {
+	STAT_CACHE_HITS,
+	STAT_CACHE_MISSES,
+	STAT_CACHE_EVICTIONS,
+	STAT_PAGES_READ,
+	STAT_PAGES_WRITTEN,
+	STAT_BYTES_READ,
+	STAT_BYTES_WRITTEN,
+	STAT_FSYNCS,
+	STAT_LEAF_SPLITS,
+	STAT_INTERNAL_SPLITS,
+	STAT_ROWS_INSERTED,
+	STAT_ROWS_SCANNED,
+	STAT_STATEMENTS, // One per StatementType, in the same order
+	STAT_NUM_COUNTERS = STAT_STATEMENTS + 6
+} StatCounter;
+
+typedef struct {
+	uint64_t counters[STAT_NUM_COUNTERS];
+} Stats;
+
+void stats_add(StatCounter counter, uint64_t n);
+void stats_read(Stats* stats);
+void stats_thread(Stats* stats);
+void stats_hand_over(Stats* since, Stats* delta);
+void stats_add_all(Stats* stats);
+const char* stats_name(StatCounter counter);
+
+// Statement latency histograms, see latency.c
+typedef enum {
+	LATENCY_INSERT,
+	LATENCY_LOOKUP, // Select through the username index
+	LATENCY_SCAN, // Select reading the whole table
+	LATENCY_OTHER,
+	LATENCY_NUM_KINDS
+} LatencyKind;
+
+typedef enum {
+	PHASE_PARSE,
+	PHASE_PLAN, // Taking a snapshot or transaction and picking a way to run
+	PHASE_EXECUTE,
+	PHASE_OUTPUT, // Handing rows to the caller
+	LATENCY_NUM_PHASES
+} LatencyPhase;
+
+// In nanoseconds
+typedef struct {
+	uint64_t count;
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+} LatencySummary;
+
+uint64_t clock_ns();
+void latency_record(LatencyKind kind, LatencyPhase phase, uint64_t ns);
+void latency_summary(LatencyKind kind, LatencyPhase phase, LatencySummary* summary);
+bool latency_dump(const char* path);
+const char* latency_kind_name(LatencyKind kind);
+const char* latency_phase_name(LatencyPhase phase);
+
+typedef enum {
+	EXECUTE_SUCCESS,
+	EXECUTE_DUPLICATE_KEY,
+	EXECUTE_TABLE_FULL,
+	EXECUTE_TRANSACTION_ACTIVE,
+	EXECUTE_NO_TRANSACTION
+} ExecuteResult;
+
+typedef enum {
+	PREPARE_SUCCESS,
+	PREPARE_NEGATIVE_ID,
+	PREPARE_STRING_TOO_LONG,
+	PREPARE_SYNTAX_ERROR,
+	PREPARE_UNRECOGNIZED_STATEMENT
+} PrepareResult;
+
+typedef enum {
+	STATEMENT_INSERT,
+	STATEMENT_SELECT,
+	STATEMENT_BEGIN,
+	STATEMENT_COMMIT,
+	STATEMENT_ROLLBACK,
+	STATEMENT_CREATE_INDEX
+} StatementType;
+
+typedef enum {
+	EXPLAIN_NONE,
+	EXPLAIN_PLAN, // explain <statement>
+	EXPLAIN_ANALYZE // explain analyze <statement>
+} ExplainMode;
+
+// How a statement gets at the table
+typedef enum {
+	ACCESS_NONE,
+	ACCESS_KEY_SEEK, // Insert into the leaf its id leads to
+	ACCESS_BUFFERED_INSERT, // Insert into a buffer on the way down, see buffer.c
+	ACCESS_LSM_INSERT,
+	ACCESS_INDEX_LOOKUP,
+	ACCESS_FULL_SCAN,
+	ACCESS_PARALLEL_SCAN,
+	ACCESS_LSM_SCAN
+} AccessPath;
+
+// What running a statement took, filled in by execute_statement()
+typedef struct {
+	LatencyKind kind;
+	uint64_t parse_ns;
+	uint64_t planned_at; // Clock when the plan phase ended, 0 if it has none
+	uint64_t plan_ns;
+	uint64_t execute_ns;
+	uint64_t output_ns;
+	uint64_t rows_examined; // By a select, before its filter
+	uint64_t rows_returned;
+} StatementProfile;
+
+typedef struct {
+	StatementType type;
+	ExplainMode explain;
+	Row row_to_insert; // only used by insert statement
+	bool has_username_filter; // only used by select statement
+	char username_filter[COLUMN_USERNAME_SIZE + 1];
+	StatementProfile profile;
+} Statement;
+
+// State of one connection to the database, the REPL or a server client
+typedef struct {
+	Table* table;
+	Transaction* txn; // Open explicit transaction, if any
+	uint32_t scan_workers;
+} Session;
+
+// Called for every row a select returns
+typedef void (*RowFunction)(Row* row, void* arg);
+
+Session* session_new(Table* table);
+void session_close(Session* session);
+PrepareResult prepare_statement(char* sql, Statement* statement);
+ExecuteResult execute_statement(Statement* statement, Session* session, RowFunction emit, void* arg);
+AccessPath statement_access_path(Statement* statement, Session* session);
+ExecuteResult explain_statement(Statement* statement, Session* session, char* text, size_t size);
+void describe_prepare_result(PrepareResult result, const char* sql, char* message, size_t size);
+const char* execute_result_message(ExecuteResult result);
+uint32_t statement_missing_pages(Statement* statement, Session* session, uint32_t* pages);
+
+// Server protocol, see protocol.c. Requests name statements by an id the
+// client picks, so it can send a whole batch without waiting. Every
+// request gets one reply, in order, except a streamed EXECUTE which gets
+// its ROWS frames first.
+#define PROTOCOL_MAX_FRAME (1 << 20)
+
+typedef enum {
+	MESSAGE_PREPARE = 0x01, // u32 stmt id, sql with ? for parameters
+	MESSAGE_BIND = 0x02, // u32 stmt id, u16 count, then per parameter a u8 type and value
+	MESSAGE_EXECUTE = 0x03, // u32 stmt id, optional u32 chunk rows to stream a select's rows in ROWS frames before the OK
+	MESSAGE_FETCH = 0x04, // u32 stmt id, u32 max rows
+	MESSAGE_CLOSE = 0x05, // u32 stmt id
+	MESSAGE_OK = 0x81, // u32 row count
+	MESSAGE_ERROR = 0x82, // message text
+	MESSAGE_PREPARED = 0x83, // u32 stmt id, u16 parameter count
+	MESSAGE_ROWS = 0x84 // u32 count, u8 done, then per row a u32 id and u8 length prefixed username and email
+} MessageType;
+
+#define PARAM_INT 1 // i32
+#define PARAM_TEXT 2 // u16 length, bytes
+
+typedef struct {
+	uint8_t* data;
+	uint32_t length;
+	uint32_t capacity;
+} Buffer;
+
+typedef struct {
+	uint8_t* data;
+	uint32_t length;
+	uint32_t offset;
+	bool error;
+} Reader;
+
+void buffer_reserve(Buffer* buffer, uint32_t size);
+void buffer_put_bytes(Buffer* buffer, const void* bytes, uint32_t size);
+void buffer_put_u8(Buffer* buffer, uint8_t value);
+void buffer_put_u16(Buffer* buffer, uint16_t value);
+void buffer_put_u32(Buffer* buffer, uint32_t value);
+void buffer_consume(Buffer* buffer, uint32_t size);
+void buffer_free(Buffer* buffer);
+uint32_t frame_begin(Buffer* buffer, uint8_t type);
+void frame_end(Buffer* buffer, uint32_t start);
+int64_t frame_size(Buffer* buffer);
+void reader_init(Reader* reader, uint8_t* frame);
+uint8_t* reader_bytes(Reader* reader, uint32_t size);
+uint8_t reader_u8(Reader* reader);
+uint16_t reader_u16(Reader* reader);
+uint32_t reader_u32(Reader* reader);
+uint32_t reader_remaining(Reader* reader);
+
+typedef struct AsyncIO AsyncIO;
+
+// Called for every finished asynchronous read
+typedef void (*AsyncReadFunction)(void* data, int32_t result);
+
+AsyncIO* aio_create(uint32_t entries);
+bool aio_uses_io_uring(AsyncIO* aio);
+int aio_event_fd(AsyncIO* aio);
+void aio_read(AsyncIO* aio, int fd, void* buffer, uint32_t length, off_t offset, void* data);
+uint32_t aio_reap(AsyncIO* aio, AsyncReadFunction fn);
+void aio_drain(AsyncIO* aio, AsyncReadFunction fn);
+void aio_destroy(AsyncIO* aio);
+
+// Serve clients on a Unix socket and, if tcp_port is not 0, on loopback
+// TCP until SIGINT or SIGTERM. With async_io a statement that needs pages
+// from disk waits for them off the event loop.
+void server_run(Table* table, const char* socket_path, uint16_t tcp_port, bool async_io);
+
 void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value);
+void leaf_node_add(Cursor* cursor, uint32_t key, Row* value);
 void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value);
 
 
@@ -97,6 +620,8 @@ const uint32_t LEAF_NODE_NUM_CELLS_SIZE;
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET;
 const uint32_t LEAF_NODE_NEXT_LEAF_SIZE;
 const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET;
+const uint32_t LEAF_NODE_HIGH_KEY_SIZE;
+const uint32_t LEAF_NODE_HIGH_KEY_OFFSET;
 const uint32_t LEAF_NODE_HEADER_SIZE;
 
 // Leaf Node Body Layout
@@ -116,6 +641,12 @@ const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE;
 const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET;
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE;
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+const uint32_t INTERNAL_NODE_RIGHT_SIBLING_SIZE;
+const uint32_t INTERNAL_NODE_RIGHT_SIBLING_OFFSET;
+const uint32_t INTERNAL_NODE_HIGH_KEY_SIZE;
+const uint32_t INTERNAL_NODE_HIGH_KEY_OFFSET;
+const uint32_t INTERNAL_NODE_NUM_MESSAGES_SIZE;
+const uint32_t INTERNAL_NODE_NUM_MESSAGES_OFFSET;
 const uint32_t INTERNAL_NODE_HEADER_SIZE;
 
 // Internal Node Body Layout
@@ -125,13 +656,29 @@ const uint32_t INTERNAL_NODE_CELL_SIZE;
 // Keep this small for testing
 const uint32_t INTERNAL_NODE_MAX_CELLS;
 
+// Internal Node Buffer Layout
+const uint32_t INTERNAL_NODE_MESSAGE_SIZE;
+const uint32_t INTERNAL_NODE_BUFFER_OFFSET;
+const uint32_t INTERNAL_NODE_MAX_MESSAGES;
+#define INVALID_PAGE_NUM UINT32_MAX // Right child of an internal node being built
+
+// B-link tree: every node has a high key (the largest key that may live in
+// it) and a link to its right sibling on the same level. A reader that
+// finds its key above the high key lost a race with a split and moves right.
+#define HIGH_KEY_INFINITY UINT32_MAX // Rightmost node of its level
+
+// The root has no parent, its parent pointer holds the format of the file
+// instead. Change it along with the layout of any page.
+#define DB_FILE_FORMAT 0x64620002
+
 // helper function
-uint32_t* node_parent(void* node);
 NodeType get_node_type(void* node);
 void set_node_type(void* node, NodeType type);
 bool is_node_root(void* node);
 void set_node_root(void* node, bool is_root);
-uint32_t get_node_max_key(void* node);
+uint32_t* root_node_format(void* node);
+uint32_t* node_high_key(void* node);
+uint32_t* node_right_sibling(void* node);
 
 void initialize_leaf_node(void* node);
 uint32_t* leaf_node_num_cells(void* node);
@@ -139,13 +686,20 @@ void* leaf_node_cell(void* node, uint32_t cell_num);
 uint32_t* leaf_node_key(void* node, uint32_t cell_num);
 void* leaf_node_value(void* node, uint32_t cell_num);
 uint32_t* leaf_node_next_leaf(void* node);
+uint32_t* leaf_node_high_key(void* node);
 
 void initialize_internal_node(void* node);
 uint32_t* internal_node_num_keys(void* node);
 uint32_t* internal_node_right_child(void* node);
+uint32_t* internal_node_right_sibling(void* node);
+uint32_t* internal_node_high_key(void* node);
 uint32_t* internal_node_cell(void* node, uint32_t cell_num);
 uint32_t* internal_node_key(void* node, uint32_t key_num);
 uint32_t* internal_node_child(void* node, uint32_t child_num);
+uint32_t* internal_node_num_messages(void* node);
+void* internal_node_message(void* node, uint32_t message_num);
+uint32_t* internal_node_message_key(void* node, uint32_t message_num);
+void* internal_node_message_value(void* node, uint32_t message_num);
 
 
 #endif
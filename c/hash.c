@@ -0,0 +1,115 @@
+#include "db.h"
+
+// Adaptive hash index. The same keys tend to be looked up over and over,
+// a hot user fetched through the username index for one. Every slot
+// remembers a key, the leaf and cell a lookup last found it in, and how
+// hot it is: lookups of the key heat it up, lookups of other keys that
+// hash to the slot cool it down and, once it is cold, take the slot over.
+// A hot key is looked up straight from its leaf, without descending the
+// tree or searching the leaf.
+//
+// Entries are hints, checked under the leaf's latch. Splits and inserts
+// move cells around; a lookup that does not find its key where the entry
+// says searches the leaf, and if the key is not there either, descends as
+// usual and corrects the entry. Entries name pages rather than frames, so
+// eviction does not affect them.
+//
+// Only snapshot lookups use the index. Snapshots only see committed pages,
+// which are never freed, so an entry never names a page a rollback dropped.
+// Each entry packs key, page, cell and heat into one word, so lookups
+// update it without locking.
+
+#define HASH_INDEX_HOT 3 // Lookups before a key is served from the index
+#define HASH_INDEX_MAX_HEAT 15
+
+uint64_t hash_entry(uint32_t key, uint32_t page_num, uint32_t cell_num, uint32_t heat) {
+	return (uint64_t)key << 32 | (uint64_t)page_num << 16 | cell_num << 4 | heat;
+}
+
+uint32_t hash_entry_key(uint64_t entry) {
+	return entry >> 32;
+}
+
+uint32_t hash_entry_page(uint64_t entry) {
+	return (entry >> 16) & 0xffff;
+}
+
+uint32_t hash_entry_cell(uint64_t entry) {
+	return (entry >> 4) & 0xfff;
+}
+
+uint32_t hash_entry_heat(uint64_t entry) {
+	return entry & 0xf;
+}
+
+_Atomic uint64_t* hash_index_slot(Table* table, uint32_t key) {
+	return &table->hash_index[(key * 2654435761u) % HASH_INDEX_SLOTS];
+}
+
+void hash_index_init(Table* table) {
+	for (uint32_t i = 0; i < HASH_INDEX_SLOTS; i++) {
+		atomic_init(&table->hash_index[i], 0);
+	}
+}
+
+bool cursor_on_key(Cursor* cursor, uint32_t key) {
+	void* node = cursor_page(cursor, cursor->page_num);
+	return cursor->cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, cursor->cell_num) == key;
+}
+
+// A snapshot lookup of key ended at the cursor. If it found the key,
+// remember where.
+void hash_index_note(Cursor* cursor, uint32_t key) {
+	if (!cursor_on_key(cursor, key)) {
+		return;
+	}
+	_Atomic uint64_t* slot = hash_index_slot(cursor->table, key);
+	uint64_t entry = atomic_load(slot);
+	uint64_t updated;
+	if (hash_entry_key(entry) == key || hash_entry_heat(entry) == 0) {
+		uint32_t heat = hash_entry_key(entry) == key ? hash_entry_heat(entry) + 1 : 1;
+		if (heat > HASH_INDEX_MAX_HEAT) {
+			heat = HASH_INDEX_MAX_HEAT;
+		}
+		updated = hash_entry(key, cursor->page_num, cursor->cell_num, heat);
+	} else {
+		// Another key has the slot and cools down
+		updated = entry - 1;
+	}
+	if (updated != entry) {
+		// Lost races only lose a hint
+		atomic_compare_exchange_strong(slot, &entry, updated);
+	}
+}
+
+// Position a snapshot read cursor on key from the index. Returns false,
+// holding no latch, if the key is not hot or not where the entry says.
+bool hash_index_find(Cursor* cursor, uint32_t key) {
+	uint64_t entry = atomic_load(hash_index_slot(cursor->table, key));
+	if (hash_entry_key(entry) != key || hash_entry_heat(entry) < HASH_INDEX_HOT) {
+		return false;
+	}
+
+	// Apart from the root, which can only have turned internal, the page
+	// is still a leaf of the tree the snapshot sees, if it sees it at all
+	uint32_t page_num = hash_entry_page(entry);
+	void* node = cursor_latch_if_visible(cursor, page_num);
+	if (node == NULL) {
+		return false;
+	}
+	if (get_node_type(node) != NODE_LEAF) {
+		cursor_unlatch_all(cursor);
+		return false;
+	}
+	cursor->page_num = page_num;
+	cursor->cell_num = hash_entry_cell(entry);
+	if (!cursor_on_key(cursor, key)) {
+		leaf_node_find(cursor, page_num, key);
+		if (!cursor_on_key(cursor, key)) {
+			cursor_unlatch_all(cursor);
+			return false;
+		}
+	}
+	hash_index_note(cursor, key);
+	return true;
+}
@@ -0,0 +1,453 @@
+#include "db.h"
+
+// Secondary index on username, kept in memory. It is built in one go from
+// a snapshot scan as a pipeline on the shared pool: every scan range
+// collects and sorts its own run of (username, id) entries, the runs are
+// merged in parallel into one sorted array, and fully packed nodes are
+// laid over it bottom-up. Rows inserted afterwards go to a small sorted
+// delta next to the packed tree, which is merged into the packed leaves
+// once it holds INDEX_DELTA_MAX entries.
+//
+// Entries are hints: a lookup fetches every row it finds and checks the
+// username again, so entries of rolled back inserts are harmless.
+
+typedef struct {
+	char username[COLUMN_USERNAME_SIZE + 1];
+	uint32_t id;
+} IndexEntry;
+
+#define INDEX_MAX_LEVELS 16
+#define INDEX_DELTA_MAX 256 // Keep this small for testing
+
+typedef struct IndexNode {
+	uint32_t num_children; // 0 for leaves
+	IndexEntry* first_entries; // Smallest entry under each child
+	struct IndexNode* children;
+	uint32_t first_leaf; // Position of the first leaf under this node
+} IndexNode;
+
+struct UsernameIndex {
+	// Packed leaves, in order. Leaf i holds the entries starting at
+	// i * leaf_capacity.
+	IndexEntry* entries;
+	uint32_t num_entries;
+	uint32_t leaf_capacity;
+	// Levels of nodes, leaves first. The root is the only node of the last.
+	IndexNode* levels[INDEX_MAX_LEVELS];
+	uint32_t level_sizes[INDEX_MAX_LEVELS];
+	uint32_t num_levels;
+	IndexEntry* delta;
+	uint32_t num_delta;
+	uint32_t delta_capacity;
+};
+
+int index_entry_compare(const void* a, const void* b) {
+	const IndexEntry* x = a;
+	const IndexEntry* y = b;
+	int result = strcmp(x->username, y->username);
+	if (result != 0) {
+		return result;
+	}
+	return x->id < y->id ? -1 : x->id > y->id;
+}
+
+// First position in a sorted array whose entry is not less than key
+uint32_t index_lower_bound(IndexEntry* entries, uint32_t num_entries, IndexEntry* key) {
+	uint32_t low = 0;
+	uint32_t high = num_entries;
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+		if (index_entry_compare(&entries[mid], key) < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+typedef struct {
+	IndexEntry* entries;
+	uint32_t num_entries;
+	uint32_t capacity;
+} IndexRun;
+
+void index_collect_row(uint32_t worker, void* value, void* arg) {
+	IndexRun* run = &((IndexRun*)arg)[worker];
+	if (run->num_entries == run->capacity) {
+		run->capacity = run->capacity ? run->capacity * 2 : 256;
+		run->entries = realloc(run->entries, run->capacity * sizeof(IndexEntry));
+	}
+	Row row;
+	deserialize_row(value, &row);
+	IndexEntry* entry = &run->entries[run->num_entries++];
+	strcpy(entry->username, row.username);
+	entry->id = row.id;
+}
+
+void index_sort_run(void* arg) {
+	IndexRun* run = arg;
+	qsort(run->entries, run->num_entries, sizeof(IndexEntry), index_entry_compare);
+}
+
+// One slice of the merged output: the part of every run between two
+// splitters
+typedef struct {
+	IndexRun* runs;
+	uint32_t num_runs;
+	uint32_t* starts;
+	uint32_t* ends;
+	IndexEntry* output;
+} IndexMerge;
+
+void index_merge_slice(void* arg) {
+	IndexMerge* merge = arg;
+	uint32_t positions[SCAN_MAX_WORKERS];
+	memcpy(positions, merge->starts, merge->num_runs * sizeof(uint32_t));
+
+	IndexEntry* output = merge->output;
+	while (true) {
+		// Few runs, a linear pick of the smallest head beats a heap
+		int32_t smallest = -1;
+		for (uint32_t r = 0; r < merge->num_runs; r++) {
+			if (positions[r] < merge->ends[r] && (smallest == -1 ||
+					index_entry_compare(&merge->runs[r].entries[positions[r]],
+						&merge->runs[smallest].entries[positions[smallest]]) < 0)) {
+				smallest = r;
+			}
+		}
+		if (smallest == -1) {
+			return;
+		}
+		*output++ = merge->runs[smallest].entries[positions[smallest]++];
+	}
+}
+
+// Merge sorted runs into one array, with each slice of the output merged by
+// its own task. Splitters come from a sample of every run.
+IndexEntry* index_merge_runs(IndexRun* runs, uint32_t num_runs, uint32_t num_entries, uint32_t num_slices) {
+	IndexEntry* merged = malloc((num_entries ? num_entries : 1) * sizeof(IndexEntry));
+
+	uint32_t samples_per_run = 16;
+	IndexEntry* samples = malloc(num_runs * samples_per_run * sizeof(IndexEntry));
+	uint32_t num_samples = 0;
+	for (uint32_t r = 0; r < num_runs; r++) {
+		for (uint32_t s = 1; s <= samples_per_run && runs[r].num_entries > 0; s++) {
+			samples[num_samples++] = runs[r].entries[(uint64_t)runs[r].num_entries * s / (samples_per_run + 1)];
+		}
+	}
+	qsort(samples, num_samples, sizeof(IndexEntry), index_entry_compare);
+	if (num_samples < num_slices) {
+		num_slices = num_samples > 0 ? num_samples : 1;
+	}
+
+	IndexMerge* merges = malloc(num_slices * sizeof(IndexMerge));
+	uint32_t* bounds = malloc((num_slices + 1) * num_runs * sizeof(uint32_t));
+	for (uint32_t p = 0; p <= num_slices; p++) {
+		for (uint32_t r = 0; r < num_runs; r++) {
+			uint32_t bound;
+			if (p == 0) {
+				bound = 0;
+			} else if (p == num_slices) {
+				bound = runs[r].num_entries;
+			} else {
+				bound = index_lower_bound(runs[r].entries, runs[r].num_entries, &samples[(uint64_t)num_samples * p / num_slices]);
+			}
+			bounds[p * num_runs + r] = bound;
+		}
+	}
+
+	TaskGroup group;
+	task_group_init(&group, shared_pool());
+	uint32_t offset = 0;
+	for (uint32_t p = 0; p < num_slices; p++) {
+		IndexMerge* merge = &merges[p];
+		merge->runs = runs;
+		merge->num_runs = num_runs;
+		merge->starts = &bounds[p * num_runs];
+		merge->ends = &bounds[(p + 1) * num_runs];
+		merge->output = merged + offset;
+		for (uint32_t r = 0; r < num_runs; r++) {
+			offset += merge->ends[r] - merge->starts[r];
+		}
+		task_group_spawn(&group, index_merge_slice, merge);
+	}
+	task_group_wait(&group);
+
+	free(bounds);
+	free(merges);
+	free(samples);
+	return merged;
+}
+
+// Lay nodes over the packed leaves bottom-up, every node full except the
+// last of each level
+void index_build_levels(UsernameIndex* index) {
+	uint32_t num_leaves = (index->num_entries + index->leaf_capacity - 1) / index->leaf_capacity;
+	if (num_leaves == 0) {
+		num_leaves = 1;
+	}
+
+	IndexNode* level = malloc(num_leaves * sizeof(IndexNode));
+	for (uint32_t i = 0; i < num_leaves; i++) {
+		level[i].num_children = 0;
+		level[i].first_entries = &index->entries[i * index->leaf_capacity];
+		level[i].children = NULL;
+		level[i].first_leaf = i;
+	}
+	index->levels[0] = level;
+	index->level_sizes[0] = num_leaves;
+	index->num_levels = 1;
+
+	uint32_t fanout = PAGE_SIZE / sizeof(IndexEntry);
+	uint32_t num_level = num_leaves;
+	while (num_level > 1) {
+		uint32_t num_parents = (num_level + fanout - 1) / fanout;
+		IndexNode* parents = malloc(num_parents * sizeof(IndexNode));
+		for (uint32_t p = 0; p < num_parents; p++) {
+			IndexNode* parent = &parents[p];
+			uint32_t first = p * fanout;
+			parent->num_children = num_level - first < fanout ? num_level - first : fanout;
+			parent->children = &level[first];
+			parent->first_entries = malloc(parent->num_children * sizeof(IndexEntry));
+			parent->first_leaf = level[first].first_leaf;
+			for (uint32_t c = 0; c < parent->num_children; c++) {
+				parent->first_entries[c] = level[first + c].first_entries[0];
+			}
+		}
+		level = parents;
+		num_level = num_parents;
+		index->levels[index->num_levels] = level;
+		index->level_sizes[index->num_levels] = num_level;
+		index->num_levels++;
+	}
+}
+
+void index_free_levels(UsernameIndex* index) {
+	for (uint32_t l = 0; l < index->num_levels; l++) {
+		if (l > 0) {
+			for (uint32_t i = 0; i < index->level_sizes[l]; i++) {
+				free(index->levels[l][i].first_entries);
+			}
+		}
+		free(index->levels[l]);
+	}
+	index->num_levels = 0;
+}
+
+void index_free(UsernameIndex* index) {
+	if (index == NULL) {
+		return;
+	}
+	index_free_levels(index);
+	free(index->entries);
+	free(index->delta);
+	free(index);
+}
+
+// Build an index over every row visible to snapshot
+UsernameIndex* index_build(Table* table, Snapshot* snapshot) {
+	ThreadPool* pool = shared_pool();
+	uint32_t num_workers = pool_num_threads(pool);
+	if (num_workers > SCAN_MAX_WORKERS) {
+		num_workers = SCAN_MAX_WORKERS;
+	}
+
+	// Partitioned scan, one run per range
+	IndexRun runs[SCAN_MAX_WORKERS];
+	memset(runs, 0, sizeof(runs));
+	table_parallel_scan(table, snapshot, num_workers, false, NULL, index_collect_row, runs);
+
+	// Sort the runs
+	uint32_t num_runs = 0;
+	uint32_t num_entries = 0;
+	TaskGroup group;
+	task_group_init(&group, pool);
+	for (uint32_t r = 0; r < SCAN_MAX_WORKERS; r++) {
+		if (runs[r].num_entries > 0) {
+			runs[num_runs++] = runs[r];
+			num_entries += runs[r].num_entries;
+		}
+	}
+	for (uint32_t r = 0; r < num_runs; r++) {
+		task_group_spawn(&group, index_sort_run, &runs[r]);
+	}
+	task_group_wait(&group);
+
+	// Merge them
+	IndexEntry* merged = index_merge_runs(runs, num_runs, num_entries, num_workers);
+	for (uint32_t r = 0; r < num_runs; r++) {
+		free(runs[r].entries);
+	}
+
+	// The merged array is already laid out as packed leaves, build the
+	// levels above them
+	UsernameIndex* index = malloc(sizeof(UsernameIndex));
+	index->num_entries = num_entries;
+	index->leaf_capacity = PAGE_SIZE / sizeof(IndexEntry);
+	index->entries = merged;
+	index->delta = NULL;
+	index->num_delta = 0;
+	index->delta_capacity = 0;
+
+	index_build_levels(index);
+	return index;
+}
+
+// Create the username index, replacing any previous one. Rows committed
+// while we build land in the delta of the new index, since it is installed
+// before the snapshot we build from is taken. Inside a transaction we are
+// the only writer and index our own rows too.
+void index_create(Table* table, bool in_transaction) {
+	pthread_mutex_lock(&table->index_build_lock);
+	UsernameIndex* building = calloc(1, sizeof(UsernameIndex));
+
+	pthread_rwlock_wrlock(&table->index_lock);
+	UsernameIndex* old = table->username_index;
+	table->username_index = building;
+	pthread_rwlock_unlock(&table->index_lock);
+	index_free(old);
+
+	Snapshot* snapshot = NULL;
+	if (!in_transaction) {
+		snapshot = snapshot_begin(table);
+	}
+	UsernameIndex* index = index_build(table, snapshot);
+	if (snapshot != NULL) {
+		snapshot_end(table, snapshot);
+	}
+
+	pthread_rwlock_wrlock(&table->index_lock);
+	index->delta = building->delta;
+	index->num_delta = building->num_delta;
+	index->delta_capacity = building->delta_capacity;
+	table->username_index = index;
+	pthread_rwlock_unlock(&table->index_lock);
+	free(building);
+	pthread_mutex_unlock(&table->index_build_lock);
+}
+
+// Merge the delta into the packed leaves and lay new levels over them.
+// The packed entries and the delta are the two runs of a single merge
+// slice, run right here rather than on the pool: the inserting writer may
+// hold latches that the pool's tasks wait for.
+void index_fold_delta(UsernameIndex* index) {
+	IndexRun runs[2] = {
+		{index->entries, index->num_entries, index->num_entries},
+		{index->delta, index->num_delta, index->delta_capacity},
+	};
+	uint32_t starts[2] = {0, 0};
+	uint32_t ends[2] = {index->num_entries, index->num_delta};
+	IndexEntry* merged = malloc((index->num_entries + index->num_delta) * sizeof(IndexEntry));
+	IndexMerge merge = {runs, 2, starts, ends, merged};
+	index_merge_slice(&merge);
+
+	// The merged array is already laid out as packed leaves
+	index_free_levels(index);
+	free(index->entries);
+	index->entries = merged;
+	index->num_entries += index->num_delta;
+	index->num_delta = 0;
+	index_build_levels(index);
+}
+
+// Called for every row inserted into the table. Without an index there is
+// nothing to do, and inserts must not all queue up on index_lock for it.
+// An index created after the check builds from a snapshot taken once it
+// is installed, same as if we had looked under the lock.
+void index_insert_row(Table* table, Row* row) {
+	if (atomic_load(&table->username_index) == NULL) {
+		return;
+	}
+	pthread_rwlock_wrlock(&table->index_lock);
+	UsernameIndex* index = table->username_index;
+	if (index != NULL) {
+		// Not while the index is being built, its delta moves to the new one
+		if (index->num_delta >= INDEX_DELTA_MAX && index->num_levels > 0) {
+			index_fold_delta(index);
+		}
+		if (index->num_delta == index->delta_capacity) {
+			index->delta_capacity = index->delta_capacity ? index->delta_capacity * 2 : 64;
+			index->delta = realloc(index->delta, index->delta_capacity * sizeof(IndexEntry));
+		}
+		IndexEntry entry;
+		strcpy(entry.username, row->username);
+		entry.id = row->id;
+		uint32_t position = index_lower_bound(index->delta, index->num_delta, &entry);
+		memmove(&index->delta[position + 1], &index->delta[position], (index->num_delta - position) * sizeof(IndexEntry));
+		index->delta[position] = entry;
+		index->num_delta++;
+	}
+	pthread_rwlock_unlock(&table->index_lock);
+}
+
+// Position of the first packed entry not less than key, found by
+// descending the levels to a leaf
+uint32_t index_seek(UsernameIndex* index, IndexEntry* key) {
+	IndexNode* node = &index->levels[index->num_levels - 1][0];
+	while (node->num_children > 0) {
+		uint32_t child = 0;
+		while (child + 1 < node->num_children && index_entry_compare(&node->first_entries[child + 1], key) < 0) {
+			child++;
+		}
+		node = &node->children[child];
+	}
+	uint32_t first = node->first_leaf * index->leaf_capacity;
+	uint32_t num_in_leaf = index->num_entries - first < index->leaf_capacity ? index->num_entries - first : index->leaf_capacity;
+	// Past the end of the leaf means the next leaf, which follows directly
+	return first + index_lower_bound(&index->entries[first], num_in_leaf, key);
+}
+
+// Whether index_lookup() has an index to use
+bool index_ready(Table* table) {
+	pthread_rwlock_rdlock(&table->index_lock);
+	UsernameIndex* index = table->username_index;
+	bool ready = index != NULL && index->num_levels > 0;
+	pthread_rwlock_unlock(&table->index_lock);
+	return ready;
+}
+
+// Ids of rows that may have this username, ascending. Returns how many and
+// sets *ids to an array the caller frees, or returns -1 if there is no
+// index. Rows still have to be checked.
+int32_t index_lookup(Table* table, const char* username, uint32_t** ids) {
+	pthread_rwlock_rdlock(&table->index_lock);
+	UsernameIndex* index = table->username_index;
+	if (index == NULL || index->num_levels == 0) {
+		pthread_rwlock_unlock(&table->index_lock);
+		return -1;
+	}
+
+	IndexEntry key;
+	strcpy(key.username, username);
+	key.id = 0;
+	uint32_t packed = index_seek(index, &key);
+	uint32_t delta = index_lower_bound(index->delta, index->num_delta, &key);
+
+	uint32_t num_ids = 0;
+	uint32_t capacity = 16;
+	*ids = malloc(capacity * sizeof(uint32_t));
+	while (true) {
+		bool more_packed = packed < index->num_entries && strcmp(index->entries[packed].username, username) == 0;
+		bool more_delta = delta < index->num_delta && strcmp(index->delta[delta].username, username) == 0;
+		uint32_t id;
+		if (more_packed && (!more_delta || index->entries[packed].id <= index->delta[delta].id)) {
+			id = index->entries[packed++].id;
+		} else if (more_delta) {
+			id = index->delta[delta++].id;
+		} else {
+			break;
+		}
+		// A row inserted during the build can be in both
+		if (num_ids > 0 && (*ids)[num_ids - 1] == id) {
+			continue;
+		}
+		if (num_ids == capacity) {
+			capacity *= 2;
+			*ids = realloc(*ids, capacity * sizeof(uint32_t));
+		}
+		(*ids)[num_ids++] = id;
+	}
+	pthread_rwlock_unlock(&table->index_lock);
+	return num_ids;
+}
@@ -0,0 +1,118 @@
+#include "db.h"
+
+#include <time.h>
+
+// Statement latency, one histogram per kind of statement and phase of
+// running it. Histograms are HDR style: exact below 2^LATENCY_SUB_BITS
+// nanoseconds, and above that every power of two is split into
+// 2^(LATENCY_SUB_BITS - 1) buckets, so any value is off by less than 2%.
+// Recording takes a few relaxed atomic adds and no lock, and percentiles
+// are read off the buckets while recording goes on.
+
+#define LATENCY_SUB_BITS 7
+#define LATENCY_HALF (1 << (LATENCY_SUB_BITS - 1))
+#define LATENCY_MAX_BITS 48 // About three days, longer is clamped
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 2) * LATENCY_HALF)
+
+typedef struct {
+	atomic_uint_fast64_t count;
+	atomic_uint_fast64_t max;
+	atomic_uint_fast64_t buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+static LatencyHistogram histograms[LATENCY_NUM_KINDS][LATENCY_NUM_PHASES];
+
+static const char* kind_names[LATENCY_NUM_KINDS] = {"insert", "lookup", "scan", "other"};
+static const char* phase_names[LATENCY_NUM_PHASES] = {"parse", "plan", "execute", "output"};
+
+uint64_t clock_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+uint32_t latency_bucket(uint64_t ns) {
+	if (ns >= (1ull << LATENCY_MAX_BITS)) {
+		ns = (1ull << LATENCY_MAX_BITS) - 1;
+	}
+	if (ns < (1 << LATENCY_SUB_BITS)) {
+		return ns;
+	}
+	uint32_t shift = 63 - __builtin_clzll(ns) - (LATENCY_SUB_BITS - 1);
+	return shift * LATENCY_HALF + (ns >> shift);
+}
+
+// Largest value that lands in bucket
+uint64_t latency_bucket_value(uint32_t bucket) {
+	if (bucket < (1 << LATENCY_SUB_BITS)) {
+		return bucket;
+	}
+	uint32_t shift = bucket / LATENCY_HALF - 1;
+	uint64_t low = (uint64_t)(bucket % LATENCY_HALF + LATENCY_HALF) << shift;
+	return low + (1ull << shift) - 1;
+}
+
+void latency_record(LatencyKind kind, LatencyPhase phase, uint64_t ns) {
+	LatencyHistogram* histogram = &histograms[kind][phase];
+	atomic_fetch_add_explicit(&histogram->buckets[latency_bucket(ns)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+	uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+	while (ns > max && !atomic_compare_exchange_weak_explicit(&histogram->max, &max, ns, memory_order_relaxed, memory_order_relaxed)) {
+	}
+}
+
+// Value at or below which fraction of the samples fall, never above the
+// largest sample
+uint64_t latency_percentile(LatencyHistogram* histogram, uint64_t count, uint64_t max, double fraction) {
+	uint64_t rank = (uint64_t)(fraction * count + 0.5);
+	rank = rank > 0 ? rank : 1;
+	uint64_t seen = 0;
+	for (uint32_t i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+		if (seen >= rank) {
+			return latency_bucket_value(i) < max ? latency_bucket_value(i) : max;
+		}
+	}
+	// Samples recorded while we read
+	return max;
+}
+
+void latency_summary(LatencyKind kind, LatencyPhase phase, LatencySummary* summary) {
+	LatencyHistogram* histogram = &histograms[kind][phase];
+	summary->count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+	summary->max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+	summary->p50 = latency_percentile(histogram, summary->count, summary->max, 0.5);
+	summary->p90 = latency_percentile(histogram, summary->count, summary->max, 0.9);
+	summary->p99 = latency_percentile(histogram, summary->count, summary->max, 0.99);
+	summary->p999 = latency_percentile(histogram, summary->count, summary->max, 0.999);
+}
+
+// Write every histogram out, one line per bucket that has samples. Returns
+// false if path can not be written.
+bool latency_dump(const char* path) {
+	FILE* file = fopen(path, "w");
+	if (file == NULL) {
+		return false;
+	}
+	fprintf(file, "# kind phase value_ns count\n");
+	for (uint32_t kind = 0; kind < LATENCY_NUM_KINDS; kind++) {
+		for (uint32_t phase = 0; phase < LATENCY_NUM_PHASES; phase++) {
+			LatencyHistogram* histogram = &histograms[kind][phase];
+			for (uint32_t i = 0; i < LATENCY_BUCKETS; i++) {
+				uint64_t count = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+				if (count > 0) {
+					fprintf(file, "%s %s %llu %llu\n", kind_names[kind], phase_names[phase], (unsigned long long)latency_bucket_value(i), (unsigned long long)count);
+				}
+			}
+		}
+	}
+	return fclose(file) == 0;
+}
+
+const char* latency_kind_name(LatencyKind kind) {
+	return kind_names[kind];
+}
+
+const char* latency_phase_name(LatencyPhase phase) {
+	return phase_names[phase];
+}
@@ -0,0 +1,1087 @@
+#include "db.h"
+
+// LSM engine, chosen for a table when its file is created. Inserts go to
+// an in-memory skiplist, the memtable, and are logged when they commit.
+// Once the memtable has enough committed rows a task on the shared pool
+// writes them out as an immutable sorted run: a file of leaf pages in the
+// B-tree's own format. Runs from
+// the memtable land on level 0, where they may overlap. A background
+// compaction merges level 0 into level 1 once it has LSM_L0_RUNS runs,
+// and every level past that into the next once it outgrows its share,
+// so levels 1 and up hold one run each, each LSM_FANOUT times the size
+// of the one above. Random inserts cost a log append and, later,
+// sequential run writes, instead of splits and scattered page writes.
+//
+// Reads merge the memtable with every run. Each run keeps the first key
+// of every page and a Bloom filter in memory, so a point lookup reads at
+// most one page of each run that may hold the key.
+//
+// Memtable entries carry the commit timestamp of their insert, and only
+// entries every snapshot can see are flushed, so runs need none. Ids are
+// never reused, which keeps runs disjoint and merges simple. The set of
+// runs is an immutable, reference counted version that readers hold on
+// to while flushes and compactions publish new ones.
+//
+// Files next to the database: the manifest "<db>-lsm" lists the runs and
+// marks the table as an LSM table, "<db>-run-<id>" are the runs and
+// "<db>-lsm-log" holds the committed rows still in the memtable. The log
+// is appended to at every commit and synced by explicit transactions,
+// the same durability the pager gives B-tree tables.
+
+#define LSM_MEMTABLE_ROWS 256 // Rows every snapshot can see before a flush
+#define LSM_L0_RUNS 4 // Level 0 runs that make a compaction
+#define LSM_FANOUT 10 // Growth from one level to the next
+#define LSM_MAX_LEVELS 8
+#define LSM_MAX_HEIGHT 12 // Of the skiplist
+#define LSM_BLOOM_BITS_PER_KEY 10
+#define LSM_BLOOM_HASHES 7
+
+typedef struct LsmEntry {
+	uint32_t key;
+	uint64_t ts; // COMMIT_TS_PENDING until the insert commits
+	void* value;
+	uint32_t height;
+	struct LsmEntry* next[];
+} LsmEntry;
+
+typedef struct {
+	uint32_t id;
+	uint32_t level;
+	char* path;
+	int fd;
+	uint32_t num_pages;
+	uint32_t num_rows;
+	uint32_t* first_keys; // Of every page
+	uint8_t* bloom;
+	uint32_t bloom_bits;
+	atomic_uint refs;
+	atomic_bool obsolete; // Compacted away, deleted with the last reference
+} LsmRun;
+
+typedef struct {
+	atomic_uint refs;
+	uint32_t num_runs;
+	LsmRun** runs; // Level 0 newest first, then one run per level
+} LsmVersion;
+
+struct Lsm {
+	char* path; // Of the database, the other files are named after it
+	pthread_mutex_t lock; // Guards everything below
+	LsmEntry* head;
+	uint32_t height;
+	uint32_t num_entries;
+	unsigned int seed;
+	LsmVersion* version;
+	uint32_t next_run_id;
+	int log_fd;
+	uint32_t num_committed; // Entries whose insert committed
+	bool flushing;
+	bool flush_scheduled;
+	// The last flush found too few rows as of this horizon. Only a
+	// snapshot ending moves it, and with it what is flushable.
+	bool flush_failed;
+	uint64_t flush_failed_horizon;
+	bool compacting;
+	bool closing;
+	TaskGroup background; // Flushes and compactions
+};
+
+// A committed row in the log
+typedef struct {
+	uint32_t key;
+	uint32_t checksum;
+} LsmLogRecord;
+
+char* lsm_file_path(Lsm* lsm, const char* suffix) {
+	char* path = malloc(strlen(lsm->path) + strlen(suffix) + 1);
+	strcpy(path, lsm->path);
+	strcat(path, suffix);
+	return path;
+}
+
+char* lsm_run_path(Lsm* lsm, uint32_t id) {
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), "-run-%u", id);
+	return lsm_file_path(lsm, suffix);
+}
+
+void lsm_write(int fd, const void* buffer, size_t length, off_t offset) {
+	stats_add(STAT_BYTES_WRITTEN, length);
+	if (pwrite(fd, buffer, length, offset) != (ssize_t)length) {
+		printf("Error writing LSM file: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void lsm_read_page(LsmRun* run, uint32_t page_num, void* page) {
+	if (pread(run->fd, page, PAGE_SIZE, (off_t)page_num * PAGE_SIZE) != PAGE_SIZE) {
+		printf("Error reading run %u: %d\n", run->id, errno);
+		exit(EXIT_FAILURE);
+	}
+	stats_add(STAT_PAGES_READ, 1);
+	stats_add(STAT_BYTES_READ, PAGE_SIZE);
+}
+
+uint32_t lsm_checksum(uint32_t key, void* value) {
+	uint32_t checksum = key;
+	uint8_t* bytes = value;
+	for (uint32_t i = 0; i < ROW_SIZE; i++) {
+		checksum = (checksum << 1 | checksum >> 31) + bytes[i];
+	}
+	return checksum;
+}
+
+// Memtable
+
+uint32_t memtable_random_height(Lsm* lsm) {
+	uint32_t height = 1;
+	while (height < LSM_MAX_HEIGHT && rand_r(&lsm->seed) % 4 == 0) {
+		height++;
+	}
+	return height;
+}
+
+LsmEntry* memtable_entry_new(uint32_t key, uint32_t height) {
+	LsmEntry* entry = calloc(1, sizeof(LsmEntry) + height * sizeof(LsmEntry*));
+	entry->key = key;
+	entry->height = height;
+	return entry;
+}
+
+// The first entry at or after key. Fills before with the last entry
+// before key on every level, if given.
+LsmEntry* memtable_seek(Lsm* lsm, uint32_t key, LsmEntry** before) {
+	LsmEntry* entry = lsm->head;
+	for (int32_t level = lsm->height - 1; level >= 0; level--) {
+		while (entry->next[level] != NULL && entry->next[level]->key < key) {
+			entry = entry->next[level];
+		}
+		if (before != NULL) {
+			before[level] = entry;
+		}
+	}
+	return entry->next[0];
+}
+
+LsmEntry* memtable_find(Lsm* lsm, uint32_t key) {
+	LsmEntry* entry = memtable_seek(lsm, key, NULL);
+	return entry != NULL && entry->key == key ? entry : NULL;
+}
+
+// The caller checked key is not there yet
+void memtable_insert(Lsm* lsm, uint32_t key, void* value, uint64_t ts) {
+	LsmEntry* before[LSM_MAX_HEIGHT];
+	memtable_seek(lsm, key, before);
+	uint32_t height = memtable_random_height(lsm);
+	for (uint32_t level = lsm->height; level < height; level++) {
+		before[level] = lsm->head;
+	}
+	if (height > lsm->height) {
+		lsm->height = height;
+	}
+
+	LsmEntry* entry = memtable_entry_new(key, height);
+	entry->ts = ts;
+	entry->value = value;
+	for (uint32_t level = 0; level < height; level++) {
+		entry->next[level] = before[level]->next[level];
+		before[level]->next[level] = entry;
+	}
+	lsm->num_entries++;
+	lsm->num_committed += ts != COMMIT_TS_PENDING;
+}
+
+void memtable_remove(Lsm* lsm, uint32_t key) {
+	LsmEntry* before[LSM_MAX_HEIGHT];
+	LsmEntry* entry = memtable_seek(lsm, key, before);
+	if (entry == NULL || entry->key != key) {
+		return;
+	}
+	for (uint32_t level = 0; level < entry->height; level++) {
+		before[level]->next[level] = entry->next[level];
+	}
+	lsm->num_committed -= entry->ts != COMMIT_TS_PENDING;
+	free(entry->value);
+	free(entry);
+	lsm->num_entries--;
+}
+
+bool memtable_visible(LsmEntry* entry, Snapshot* snapshot) {
+	if (snapshot == NULL) {
+		return true;
+	}
+	return entry->ts != COMMIT_TS_PENDING && entry->ts <= snapshot->ts;
+}
+
+// Runs and versions
+
+uint32_t lsm_bloom_hash(uint32_t key, uint32_t i, uint32_t num_bits) {
+	uint32_t h1 = key * 2654435761u;
+	uint32_t h2 = (key * 2246822519u) | 1;
+	return (h1 + i * h2) % num_bits;
+}
+
+void lsm_bloom_add(LsmRun* run, uint32_t key) {
+	for (uint32_t i = 0; i < LSM_BLOOM_HASHES; i++) {
+		uint32_t bit = lsm_bloom_hash(key, i, run->bloom_bits);
+		run->bloom[bit / 8] |= 1 << (bit % 8);
+	}
+}
+
+bool lsm_bloom_may_contain(LsmRun* run, uint32_t key) {
+	for (uint32_t i = 0; i < LSM_BLOOM_HASHES; i++) {
+		uint32_t bit = lsm_bloom_hash(key, i, run->bloom_bits);
+		if (!(run->bloom[bit / 8] & (1 << (bit % 8)))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+LsmRun* lsm_run_new(Lsm* lsm, uint32_t id, uint32_t level, uint32_t max_rows) {
+	LsmRun* run = malloc(sizeof(LsmRun));
+	run->id = id;
+	run->level = level;
+	run->path = lsm_run_path(lsm, id);
+	run->fd = -1;
+	run->num_pages = 0;
+	run->num_rows = 0;
+	run->first_keys = malloc((max_rows / LEAF_NODE_MAX_CELLS + 1) * sizeof(uint32_t));
+	run->bloom_bits = max_rows * LSM_BLOOM_BITS_PER_KEY > 64 ? max_rows * LSM_BLOOM_BITS_PER_KEY : 64;
+	run->bloom = calloc(run->bloom_bits / 8 + 1, 1);
+	atomic_init(&run->refs, 1);
+	atomic_init(&run->obsolete, false);
+	return run;
+}
+
+void lsm_run_release(LsmRun* run) {
+	if (atomic_fetch_sub(&run->refs, 1) != 1) {
+		return;
+	}
+	close(run->fd);
+	if (atomic_load(&run->obsolete)) {
+		unlink(run->path);
+	}
+	free(run->path);
+	free(run->first_keys);
+	free(run->bloom);
+	free(run);
+}
+
+// Writes rows in key order into full leaf pages
+typedef struct {
+	LsmRun* run;
+	void* page;
+} LsmRunWriter;
+
+void lsm_writer_start(LsmRunWriter* writer, LsmRun* run) {
+	writer->run = run;
+	writer->page = pager_alloc_page();
+	run->fd = open(run->path, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+	if (run->fd == -1) {
+		printf("Unable to create run %u: %d\n", run->id, errno);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void lsm_writer_end_page(LsmRunWriter* writer, bool last) {
+	LsmRun* run = writer->run;
+	*leaf_node_next_leaf(writer->page) = last ? 0 : run->num_pages + 1;
+	lsm_write(run->fd, writer->page, PAGE_SIZE, (off_t)run->num_pages * PAGE_SIZE);
+	stats_add(STAT_PAGES_WRITTEN, 1);
+	run->num_pages++;
+}
+
+void lsm_writer_add(LsmRunWriter* writer, uint32_t key, void* value) {
+	LsmRun* run = writer->run;
+	void* page = writer->page;
+	if (run->num_rows > 0 && *leaf_node_num_cells(page) == LEAF_NODE_MAX_CELLS) {
+		lsm_writer_end_page(writer, false);
+	}
+	if (run->num_rows == 0 || *leaf_node_num_cells(page) == LEAF_NODE_MAX_CELLS) {
+		memset(page, 0, PAGE_SIZE);
+		initialize_leaf_node(page);
+		run->first_keys[run->num_pages] = key;
+	}
+	uint32_t cell = (*leaf_node_num_cells(page))++;
+	*leaf_node_key(page, cell) = key;
+	memcpy(leaf_node_value(page, cell), value, ROW_SIZE);
+	lsm_bloom_add(run, key);
+	run->num_rows++;
+}
+
+void lsm_writer_finish(LsmRunWriter* writer) {
+	if (writer->run->num_rows > 0) {
+		lsm_writer_end_page(writer, true);
+	}
+	sync_or_exit(writer->run->fd);
+	free(writer->page);
+}
+
+// Load a run's page index and Bloom filter
+LsmRun* lsm_run_open(Lsm* lsm, uint32_t id, uint32_t level) {
+	char* path = lsm_run_path(lsm, id);
+	int fd = open(path, O_RDONLY);
+	free(path);
+	if (fd == -1) {
+		printf("Unable to open run %u: %d\n", id, errno);
+		exit(EXIT_FAILURE);
+	}
+	uint32_t num_pages = lseek(fd, 0, SEEK_END) / PAGE_SIZE;
+	LsmRun* run = lsm_run_new(lsm, id, level, num_pages * LEAF_NODE_MAX_CELLS);
+	run->fd = fd;
+	run->num_pages = num_pages;
+	void* page = pager_alloc_page();
+	for (uint32_t i = 0; i < num_pages; i++) {
+		lsm_read_page(run, i, page);
+		uint32_t num_cells = *leaf_node_num_cells(page);
+		run->first_keys[i] = *leaf_node_key(page, 0);
+		for (uint32_t j = 0; j < num_cells; j++) {
+			lsm_bloom_add(run, *leaf_node_key(page, j));
+		}
+		run->num_rows += num_cells;
+	}
+	free(page);
+	return run;
+}
+
+// Copy the value of key into value if the run holds it
+bool lsm_run_find(LsmRun* run, uint32_t key, void* value) {
+	if (run->num_pages == 0 || key < run->first_keys[0] || !lsm_bloom_may_contain(run, key)) {
+		return false;
+	}
+	// Last page starting at or before key
+	uint32_t min_index = 0;
+	uint32_t max_index = run->num_pages - 1;
+	while (min_index != max_index) {
+		uint32_t index = (min_index + max_index + 1) / 2;
+		if (run->first_keys[index] <= key) {
+			min_index = index;
+		} else {
+			max_index = index - 1;
+		}
+	}
+
+	void* page = pager_alloc_page();
+	lsm_read_page(run, min_index, page);
+	bool found = false;
+	uint32_t min_cell = 0;
+	uint32_t one_past_max_cell = *leaf_node_num_cells(page);
+	while (min_cell != one_past_max_cell && !found) {
+		uint32_t cell = (min_cell + one_past_max_cell) / 2;
+		uint32_t key_at_cell = *leaf_node_key(page, cell);
+		if (key_at_cell == key) {
+			found = true;
+			if (value != NULL) {
+				memcpy(value, leaf_node_value(page, cell), ROW_SIZE);
+			}
+		} else if (key < key_at_cell) {
+			one_past_max_cell = cell;
+		} else {
+			min_cell = cell + 1;
+		}
+	}
+	free(page);
+	return found;
+}
+
+int lsm_compare_runs(const void* a, const void* b) {
+	LsmRun* run_a = *(LsmRun**)a;
+	LsmRun* run_b = *(LsmRun**)b;
+	if (run_a->level != run_b->level) {
+		return run_a->level < run_b->level ? -1 : 1;
+	}
+	return run_a->id > run_b->id ? -1 : run_a->id < run_b->id;
+}
+
+// Takes over the callers' references to runs
+LsmVersion* lsm_version_new(LsmRun** runs, uint32_t num_runs) {
+	LsmVersion* version = malloc(sizeof(LsmVersion));
+	atomic_init(&version->refs, 1);
+	version->num_runs = num_runs;
+	version->runs = malloc((num_runs ? num_runs : 1) * sizeof(LsmRun*));
+	memcpy(version->runs, runs, num_runs * sizeof(LsmRun*));
+	qsort(version->runs, num_runs, sizeof(LsmRun*), lsm_compare_runs);
+	return version;
+}
+
+// The caller holds lsm->lock
+LsmVersion* lsm_version_acquire(Lsm* lsm) {
+	atomic_fetch_add(&lsm->version->refs, 1);
+	return lsm->version;
+}
+
+void lsm_version_release(LsmVersion* version) {
+	if (atomic_fetch_sub(&version->refs, 1) != 1) {
+		return;
+	}
+	for (uint32_t i = 0; i < version->num_runs; i++) {
+		lsm_run_release(version->runs[i]);
+	}
+	free(version->runs);
+	free(version);
+}
+
+// Replace the current version. The caller holds lsm->lock.
+void lsm_version_install(Lsm* lsm, LsmVersion* version) {
+	LsmVersion* old = lsm->version;
+	lsm->version = version;
+	lsm_version_release(old);
+}
+
+bool lsm_version_find(LsmVersion* version, uint32_t key, void* value) {
+	for (uint32_t i = 0; i < version->num_runs; i++) {
+		if (lsm_run_find(version->runs[i], key, value)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Manifest and log, written under lsm->lock
+
+void lsm_write_manifest(Lsm* lsm) {
+	char* path = lsm_file_path(lsm, "-lsm");
+	char* temp_path = lsm_file_path(lsm, "-lsm.tmp");
+	FILE* file = fopen(temp_path, "w");
+	if (file == NULL) {
+		printf("Unable to write LSM manifest: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	fprintf(file, "next %u\n", lsm->next_run_id);
+	for (uint32_t i = 0; i < lsm->version->num_runs; i++) {
+		fprintf(file, "run %u %u\n", lsm->version->runs[i]->id, lsm->version->runs[i]->level);
+	}
+	fflush(file);
+	sync_or_exit(fileno(file));
+	fclose(file);
+	if (rename(temp_path, path) == -1) {
+		printf("Unable to write LSM manifest: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	free(temp_path);
+	free(path);
+}
+
+void lsm_log_entries(int fd, LsmEntry** entries, uint32_t num_entries) {
+	size_t record_size = sizeof(LsmLogRecord) + ROW_SIZE;
+	uint8_t* buffer = malloc(num_entries * record_size + 1);
+	for (uint32_t i = 0; i < num_entries; i++) {
+		LsmLogRecord record = {entries[i]->key, lsm_checksum(entries[i]->key, entries[i]->value)};
+		memcpy(buffer + i * record_size, &record, sizeof(record));
+		memcpy(buffer + i * record_size + sizeof(record), entries[i]->value, ROW_SIZE);
+	}
+	if (write(fd, buffer, num_entries * record_size) != (ssize_t)(num_entries * record_size)) {
+		printf("Error writing LSM log: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	stats_add(STAT_BYTES_WRITTEN, num_entries * record_size);
+	free(buffer);
+}
+
+int lsm_open_log(Lsm* lsm, bool truncate) {
+	char* path = lsm_file_path(lsm, "-lsm-log");
+	int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | (truncate ? O_TRUNC : 0), S_IWUSR | S_IRUSR);
+	free(path);
+	if (fd == -1) {
+		printf("Unable to open LSM log: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+// Start a new log with just the committed rows left in the memtable
+void lsm_rewrite_log(Lsm* lsm) {
+	char* path = lsm_file_path(lsm, "-lsm-log");
+	char* temp_path = lsm_file_path(lsm, "-lsm-log.tmp");
+	int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+	if (fd == -1) {
+		printf("Unable to write LSM log: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	LsmEntry** entries = malloc((lsm->num_entries + 1) * sizeof(LsmEntry*));
+	uint32_t num_entries = 0;
+	for (LsmEntry* entry = lsm->head->next[0]; entry != NULL; entry = entry->next[0]) {
+		if (entry->ts != COMMIT_TS_PENDING) {
+			entries[num_entries++] = entry;
+		}
+	}
+	lsm_log_entries(fd, entries, num_entries);
+	free(entries);
+	sync_or_exit(fd);
+	close(fd);
+	if (rename(temp_path, path) == -1) {
+		printf("Unable to write LSM log: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	free(temp_path);
+	free(path);
+	close(lsm->log_fd);
+	lsm->log_fd = lsm_open_log(lsm, false);
+}
+
+// Put the rows of the log back in the memtable, up to a torn write. The
+// torn tail is cut off, or the commits appended after it would be lost
+// the next time the log is replayed. A crash between a flush installing
+// its run and rewriting the log leaves rows in both, those stay in the
+// run: an id is only ever in one place.
+void lsm_replay_log(Lsm* lsm) {
+	char* path = lsm_file_path(lsm, "-lsm-log");
+	int fd = open(path, O_RDWR);
+	free(path);
+	if (fd == -1) {
+		return;
+	}
+	LsmLogRecord record;
+	void* value = malloc(ROW_SIZE);
+	off_t good = 0;
+	while (read(fd, &record, sizeof(record)) == sizeof(record) && read(fd, value, ROW_SIZE) == ROW_SIZE && record.checksum == lsm_checksum(record.key, value)) {
+		good += sizeof(record) + ROW_SIZE;
+		if (memtable_find(lsm, record.key) == NULL && !lsm_version_find(lsm->version, record.key, NULL)) {
+			memtable_insert(lsm, record.key, value, 0);
+			value = malloc(ROW_SIZE);
+		}
+	}
+	free(value);
+	if (lseek(fd, 0, SEEK_END) != good) {
+		if (ftruncate(fd, good) == -1) {
+			printf("Unable to truncate LSM log: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+		sync_or_exit(fd);
+	}
+	close(fd);
+}
+
+// The LSM engine of the table stored at filename, or NULL if it is a
+// B-tree table. With create a table that has neither becomes an LSM table.
+Lsm* lsm_open(const char* filename, bool create) {
+	Lsm* lsm = malloc(sizeof(Lsm));
+	lsm->path = strdup(filename);
+	char* manifest_path = lsm_file_path(lsm, "-lsm");
+	FILE* manifest = fopen(manifest_path, "r");
+	free(manifest_path);
+	if (manifest == NULL && !create) {
+		free(lsm->path);
+		free(lsm);
+		return NULL;
+	}
+
+	pthread_mutex_init(&lsm->lock, NULL);
+	lsm->head = memtable_entry_new(0, LSM_MAX_HEIGHT);
+	lsm->height = 1;
+	lsm->num_entries = 0;
+	lsm->seed = 1;
+	lsm->next_run_id = 1;
+	lsm->num_committed = 0;
+	lsm->flushing = false;
+	lsm->flush_scheduled = false;
+	lsm->flush_failed = false;
+	lsm->compacting = false;
+	lsm->closing = false;
+	task_group_init(&lsm->background, shared_pool());
+
+	LsmRun** runs = NULL;
+	uint32_t num_runs = 0;
+	if (manifest != NULL) {
+		char line[64];
+		while (fgets(line, sizeof(line), manifest) != NULL) {
+			uint32_t id;
+			uint32_t level;
+			if (sscanf(line, "next %u", &id) == 1) {
+				lsm->next_run_id = id;
+			} else if (sscanf(line, "run %u %u", &id, &level) == 2) {
+				runs = realloc(runs, (num_runs + 1) * sizeof(LsmRun*));
+				runs[num_runs++] = lsm_run_open(lsm, id, level);
+			}
+		}
+		fclose(manifest);
+	}
+	lsm->version = lsm_version_new(runs, num_runs);
+	free(runs);
+	if (manifest == NULL) {
+		lsm_write_manifest(lsm);
+	}
+	lsm_replay_log(lsm);
+	lsm->log_fd = lsm_open_log(lsm, false);
+	return lsm;
+}
+
+// Compaction
+
+// Level 0 once it has enough runs, or else the first level that outgrew
+// its share, goes into a new run together with the next level's run.
+// Returns how many inputs it picked.
+uint32_t lsm_pick_compaction(LsmVersion* version, LsmRun** inputs, uint32_t* output_level) {
+	LsmRun* levels[LSM_MAX_LEVELS] = {NULL};
+	uint32_t num_l0 = 0;
+	for (uint32_t i = 0; i < version->num_runs; i++) {
+		LsmRun* run = version->runs[i];
+		if (run->level == 0) {
+			inputs[num_l0++] = run;
+		} else {
+			levels[run->level] = run;
+		}
+	}
+	if (num_l0 >= LSM_L0_RUNS) {
+		*output_level = 1;
+		if (levels[1] != NULL) {
+			inputs[num_l0++] = levels[1];
+		}
+		return num_l0;
+	}
+
+	uint32_t capacity = LSM_MEMTABLE_ROWS * LSM_L0_RUNS;
+	for (uint32_t level = 1; level + 1 < LSM_MAX_LEVELS; level++) {
+		if (levels[level] != NULL && levels[level]->num_rows > capacity) {
+			uint32_t num_inputs = 0;
+			inputs[num_inputs++] = levels[level];
+			if (levels[level + 1] != NULL) {
+				inputs[num_inputs++] = levels[level + 1];
+			}
+			*output_level = level + 1;
+			return num_inputs;
+		}
+		capacity *= LSM_FANOUT;
+	}
+	return 0;
+}
+
+// Reads a run, or rows already in memory, in key order
+typedef struct {
+	LsmRun* run; // NULL for rows in memory
+	void* page;
+	uint32_t page_num;
+	uint32_t cell;
+	uint32_t* keys;
+	uint8_t* values;
+	uint32_t num_rows;
+	uint32_t row;
+} LsmCursor;
+
+void lsm_cursor_load(LsmCursor* cursor) {
+	while (cursor->page_num < cursor->run->num_pages) {
+		lsm_read_page(cursor->run, cursor->page_num, cursor->page);
+		if (*leaf_node_num_cells(cursor->page) > 0) {
+			return;
+		}
+		cursor->page_num++;
+	}
+}
+
+void lsm_cursor_open_run(LsmCursor* cursor, LsmRun* run) {
+	cursor->run = run;
+	cursor->page = pager_alloc_page();
+	cursor->page_num = 0;
+	cursor->cell = 0;
+	lsm_cursor_load(cursor);
+}
+
+void lsm_cursor_open_rows(LsmCursor* cursor, uint32_t* keys, uint8_t* values, uint32_t num_rows) {
+	cursor->run = NULL;
+	cursor->page = NULL;
+	cursor->keys = keys;
+	cursor->values = values;
+	cursor->num_rows = num_rows;
+	cursor->row = 0;
+}
+
+bool lsm_cursor_valid(LsmCursor* cursor) {
+	if (cursor->run == NULL) {
+		return cursor->row < cursor->num_rows;
+	}
+	return cursor->page_num < cursor->run->num_pages;
+}
+
+uint32_t lsm_cursor_key(LsmCursor* cursor) {
+	if (cursor->run == NULL) {
+		return cursor->keys[cursor->row];
+	}
+	return *leaf_node_key(cursor->page, cursor->cell);
+}
+
+void* lsm_cursor_value(LsmCursor* cursor) {
+	if (cursor->run == NULL) {
+		return cursor->values + (size_t)cursor->row * ROW_SIZE;
+	}
+	return leaf_node_value(cursor->page, cursor->cell);
+}
+
+void lsm_cursor_advance(LsmCursor* cursor) {
+	if (cursor->run == NULL) {
+		cursor->row++;
+		return;
+	}
+	if (++cursor->cell >= *leaf_node_num_cells(cursor->page)) {
+		cursor->page_num++;
+		cursor->cell = 0;
+		lsm_cursor_load(cursor);
+	}
+}
+
+// The cursor with the smallest key, or NULL once all are done. Ids are
+// unique, so no two cursors are ever on the same key.
+LsmCursor* lsm_cursor_next(LsmCursor* cursors, uint32_t num_cursors) {
+	LsmCursor* next = NULL;
+	for (uint32_t i = 0; i < num_cursors; i++) {
+		if (lsm_cursor_valid(&cursors[i]) && (next == NULL || lsm_cursor_key(&cursors[i]) < lsm_cursor_key(next))) {
+			next = &cursors[i];
+		}
+	}
+	return next;
+}
+
+void lsm_schedule_compaction(Lsm* lsm);
+
+void lsm_compact(void* arg) {
+	Lsm* lsm = arg;
+	while (true) {
+		uint32_t output_level;
+		pthread_mutex_lock(&lsm->lock);
+		LsmRun** inputs = malloc((lsm->version->num_runs + 1) * sizeof(LsmRun*));
+		uint32_t num_inputs = lsm->closing ? 0 : lsm_pick_compaction(lsm->version, inputs, &output_level);
+		if (num_inputs == 0) {
+			lsm->compacting = false;
+			pthread_mutex_unlock(&lsm->lock);
+			free(inputs);
+			return;
+		}
+		uint32_t max_rows = 0;
+		for (uint32_t i = 0; i < num_inputs; i++) {
+			atomic_fetch_add(&inputs[i]->refs, 1);
+			max_rows += inputs[i]->num_rows;
+		}
+		LsmRun* output = lsm_run_new(lsm, lsm->next_run_id++, output_level, max_rows);
+		pthread_mutex_unlock(&lsm->lock);
+
+		LsmCursor* cursors = malloc(num_inputs * sizeof(LsmCursor));
+		for (uint32_t i = 0; i < num_inputs; i++) {
+			lsm_cursor_open_run(&cursors[i], inputs[i]);
+		}
+		LsmRunWriter writer;
+		lsm_writer_start(&writer, output);
+		LsmCursor* cursor;
+		while ((cursor = lsm_cursor_next(cursors, num_inputs)) != NULL) {
+			lsm_writer_add(&writer, lsm_cursor_key(cursor), lsm_cursor_value(cursor));
+			lsm_cursor_advance(cursor);
+		}
+		lsm_writer_finish(&writer);
+		for (uint32_t i = 0; i < num_inputs; i++) {
+			free(cursors[i].page);
+		}
+		free(cursors);
+
+		// Flushes may have added level 0 runs meanwhile, start from
+		// the current version
+		pthread_mutex_lock(&lsm->lock);
+		LsmVersion* current = lsm->version;
+		LsmRun** runs = malloc((current->num_runs + 1) * sizeof(LsmRun*));
+		uint32_t num_runs = 0;
+		for (uint32_t i = 0; i < current->num_runs; i++) {
+			bool compacted = false;
+			for (uint32_t j = 0; j < num_inputs; j++) {
+				compacted = compacted || current->runs[i] == inputs[j];
+			}
+			if (!compacted) {
+				atomic_fetch_add(&current->runs[i]->refs, 1);
+				runs[num_runs++] = current->runs[i];
+			}
+		}
+		runs[num_runs++] = output;
+		lsm_version_install(lsm, lsm_version_new(runs, num_runs));
+		free(runs);
+		lsm_write_manifest(lsm);
+		for (uint32_t i = 0; i < num_inputs; i++) {
+			atomic_store(&inputs[i]->obsolete, true);
+		}
+		pthread_mutex_unlock(&lsm->lock);
+		for (uint32_t i = 0; i < num_inputs; i++) {
+			lsm_run_release(inputs[i]);
+		}
+		free(inputs);
+	}
+}
+
+void lsm_schedule_compaction(Lsm* lsm) {
+	uint32_t output_level;
+	pthread_mutex_lock(&lsm->lock);
+	LsmRun** inputs = malloc((lsm->version->num_runs + 1) * sizeof(LsmRun*));
+	if (!lsm->compacting && !lsm->closing && lsm_pick_compaction(lsm->version, inputs, &output_level) > 0) {
+		lsm->compacting = true;
+		task_group_spawn(&lsm->background, lsm_compact, lsm);
+	}
+	pthread_mutex_unlock(&lsm->lock);
+	free(inputs);
+}
+
+// Flushing
+
+bool lsm_flushable(LsmEntry* entry, uint64_t horizon) {
+	return entry->ts != COMMIT_TS_PENDING && entry->ts <= horizon;
+}
+
+// Write the memtable rows every snapshot can see to a new level 0 run.
+// With force however few there are, else only once there are enough.
+void lsm_flush(Table* table, bool force) {
+	Lsm* lsm = table->lsm;
+	uint64_t horizon = oldest_snapshot_ts(table);
+
+	pthread_mutex_lock(&lsm->lock);
+	uint32_t num_rows = 0;
+	for (LsmEntry* entry = lsm->head->next[0]; entry != NULL && !lsm->flushing; entry = entry->next[0]) {
+		num_rows += lsm_flushable(entry, horizon);
+	}
+	if (lsm->flushing || num_rows == 0 || (!force && num_rows < LSM_MEMTABLE_ROWS)) {
+		if (!lsm->flushing && !force) {
+			lsm->flush_failed = true;
+			lsm->flush_failed_horizon = horizon;
+		}
+		pthread_mutex_unlock(&lsm->lock);
+		return;
+	}
+	lsm->flush_failed = false;
+	uint32_t* keys = malloc(num_rows * sizeof(uint32_t));
+	uint8_t* values = malloc((size_t)num_rows * ROW_SIZE);
+	uint32_t row = 0;
+	for (LsmEntry* entry = lsm->head->next[0]; entry != NULL; entry = entry->next[0]) {
+		if (lsm_flushable(entry, horizon)) {
+			keys[row] = entry->key;
+			memcpy(values + (size_t)row * ROW_SIZE, entry->value, ROW_SIZE);
+			row++;
+		}
+	}
+	lsm->flushing = true;
+	LsmRun* run = lsm_run_new(lsm, lsm->next_run_id++, 0, num_rows);
+	pthread_mutex_unlock(&lsm->lock);
+
+	// Readers keep finding the rows in the memtable until the run is in
+	LsmRunWriter writer;
+	lsm_writer_start(&writer, run);
+	for (uint32_t i = 0; i < num_rows; i++) {
+		lsm_writer_add(&writer, keys[i], values + (size_t)i * ROW_SIZE);
+	}
+	lsm_writer_finish(&writer);
+
+	pthread_mutex_lock(&lsm->lock);
+	LsmVersion* current = lsm->version;
+	LsmRun** runs = malloc((current->num_runs + 1) * sizeof(LsmRun*));
+	for (uint32_t i = 0; i < current->num_runs; i++) {
+		atomic_fetch_add(&current->runs[i]->refs, 1);
+		runs[i] = current->runs[i];
+	}
+	runs[current->num_runs] = run;
+	lsm_version_install(lsm, lsm_version_new(runs, current->num_runs + 1));
+	free(runs);
+	for (uint32_t i = 0; i < num_rows; i++) {
+		memtable_remove(lsm, keys[i]);
+	}
+	lsm_write_manifest(lsm);
+	lsm_rewrite_log(lsm);
+	lsm->flushing = false;
+	pthread_mutex_unlock(&lsm->lock);
+
+	free(keys);
+	free(values);
+	lsm_schedule_compaction(lsm);
+}
+
+void lsm_flush_task(void* arg) {
+	Table* table = arg;
+	Lsm* lsm = table->lsm;
+	pthread_mutex_lock(&lsm->lock);
+	bool closing = lsm->closing;
+	pthread_mutex_unlock(&lsm->lock);
+	if (!closing) {
+		lsm_flush(table, false);
+	}
+	pthread_mutex_lock(&lsm->lock);
+	lsm->flush_scheduled = false;
+	pthread_mutex_unlock(&lsm->lock);
+}
+
+bool lsm_flush_wanted(Lsm* lsm) {
+	return !lsm->flushing && !lsm->flush_scheduled && !lsm->closing && lsm->num_committed >= LSM_MEMTABLE_ROWS;
+}
+
+// Flush on the shared pool if enough rows may have become flushable.
+// Called after commits and snapshot ends, the only things that make more
+// rows flushable. Checking costs a walk of the memtable, so it is not
+// repeated for a horizon it already failed at.
+void lsm_schedule_flush(Table* table) {
+	Lsm* lsm = table->lsm;
+	pthread_mutex_lock(&lsm->lock);
+	bool wanted = lsm_flush_wanted(lsm);
+	pthread_mutex_unlock(&lsm->lock);
+	if (!wanted) {
+		return;
+	}
+	uint64_t horizon = oldest_snapshot_ts(table);
+	pthread_mutex_lock(&lsm->lock);
+	if (lsm_flush_wanted(lsm) && !(lsm->flush_failed && lsm->flush_failed_horizon == horizon)) {
+		lsm->flush_scheduled = true;
+		task_group_spawn(&lsm->background, lsm_flush_task, table);
+	}
+	pthread_mutex_unlock(&lsm->lock);
+}
+
+// Operations
+
+// Insert a row on behalf of txn. Returns false if the id is taken.
+bool lsm_insert(Table* table, Transaction* txn, Row* row) {
+	Lsm* lsm = table->lsm;
+	void* value = malloc(ROW_SIZE);
+	serialize_row(row, value);
+
+	pthread_mutex_lock(&lsm->lock);
+	bool taken = memtable_find(lsm, row->id) != NULL || lsm_version_find(lsm->version, row->id, NULL);
+	if (!taken) {
+		memtable_insert(lsm, row->id, value, COMMIT_TS_PENDING);
+	}
+	pthread_mutex_unlock(&lsm->lock);
+	if (taken) {
+		free(value);
+		return false;
+	}
+
+	if (txn->num_lsm_keys == txn->lsm_keys_capacity) {
+		txn->lsm_keys_capacity = txn->lsm_keys_capacity ? txn->lsm_keys_capacity * 2 : 8;
+		txn->lsm_keys = realloc(txn->lsm_keys, txn->lsm_keys_capacity * sizeof(uint32_t));
+	}
+	txn->lsm_keys[txn->num_lsm_keys++] = row->id;
+	index_insert_row(table, row);
+	row_cache_invalidate(table, row->id);
+	return true;
+}
+
+// Stamp the rows txn inserted and log them. Called under mvcc_lock, like
+// the stamping of pages.
+void lsm_commit(Transaction* txn, uint64_t commit_ts) {
+	Lsm* lsm = txn->table->lsm;
+	LsmEntry** entries = malloc(txn->num_lsm_keys * sizeof(LsmEntry*));
+	pthread_mutex_lock(&lsm->lock);
+	for (uint32_t i = 0; i < txn->num_lsm_keys; i++) {
+		entries[i] = memtable_find(lsm, txn->lsm_keys[i]);
+		entries[i]->ts = commit_ts;
+	}
+	lsm->num_committed += txn->num_lsm_keys;
+	lsm_log_entries(lsm->log_fd, entries, txn->num_lsm_keys);
+	pthread_mutex_unlock(&lsm->lock);
+	free(entries);
+}
+
+// Make every committed row durable
+void lsm_sync(Table* table) {
+	Lsm* lsm = table->lsm;
+	pthread_mutex_lock(&lsm->lock);
+	sync_or_exit(lsm->log_fd);
+	pthread_mutex_unlock(&lsm->lock);
+}
+
+void lsm_rollback(Transaction* txn) {
+	Lsm* lsm = txn->table->lsm;
+	pthread_mutex_lock(&lsm->lock);
+	for (uint32_t i = 0; i < txn->num_lsm_keys; i++) {
+		memtable_remove(lsm, txn->lsm_keys[i]);
+	}
+	pthread_mutex_unlock(&lsm->lock);
+}
+
+// Copy the row with key visible to snapshot into row. Returns false if
+// there is none.
+bool lsm_get(Table* table, Snapshot* snapshot, uint32_t key, Row* row) {
+	Lsm* lsm = table->lsm;
+	void* value = malloc(ROW_SIZE);
+	pthread_mutex_lock(&lsm->lock);
+	LsmEntry* entry = memtable_find(lsm, key);
+	bool found = entry != NULL && memtable_visible(entry, snapshot);
+	if (found) {
+		memcpy(value, entry->value, ROW_SIZE);
+	}
+	if (entry != NULL) {
+		// An id is in one place only, whether the snapshot sees it or not
+		pthread_mutex_unlock(&lsm->lock);
+	} else {
+		LsmVersion* version = lsm_version_acquire(lsm);
+		pthread_mutex_unlock(&lsm->lock);
+		found = lsm_version_find(version, key, value);
+		lsm_version_release(version);
+	}
+	if (found) {
+		deserialize_row(value, row);
+	}
+	free(value);
+	return found;
+}
+
+// Call fn for every row visible to snapshot, in key order
+void lsm_scan(Table* table, Snapshot* snapshot, ScanRowFunction fn, void* arg) {
+	Lsm* lsm = table->lsm;
+	pthread_mutex_lock(&lsm->lock);
+	uint32_t* keys = malloc((lsm->num_entries + 1) * sizeof(uint32_t));
+	uint8_t* values = malloc((size_t)(lsm->num_entries + 1) * ROW_SIZE);
+	uint32_t num_rows = 0;
+	for (LsmEntry* entry = lsm->head->next[0]; entry != NULL; entry = entry->next[0]) {
+		if (memtable_visible(entry, snapshot)) {
+			keys[num_rows] = entry->key;
+			memcpy(values + (size_t)num_rows * ROW_SIZE, entry->value, ROW_SIZE);
+			num_rows++;
+		}
+	}
+	LsmVersion* version = lsm_version_acquire(lsm);
+	pthread_mutex_unlock(&lsm->lock);
+
+	uint32_t num_cursors = version->num_runs + 1;
+	LsmCursor* cursors = malloc(num_cursors * sizeof(LsmCursor));
+	lsm_cursor_open_rows(&cursors[0], keys, values, num_rows);
+	for (uint32_t i = 0; i < version->num_runs; i++) {
+		lsm_cursor_open_run(&cursors[i + 1], version->runs[i]);
+	}
+	LsmCursor* cursor;
+	while ((cursor = lsm_cursor_next(cursors, num_cursors)) != NULL) {
+		fn(0, lsm_cursor_value(cursor), arg);
+		lsm_cursor_advance(cursor);
+	}
+	for (uint32_t i = 0; i < num_cursors; i++) {
+		free(cursors[i].page);
+	}
+	free(cursors);
+	free(keys);
+	free(values);
+	lsm_version_release(version);
+}
+
+void lsm_print(Table* table) {
+	Lsm* lsm = table->lsm;
+	pthread_mutex_lock(&lsm->lock);
+	printf("- memtable (size %d)\n", lsm->num_entries);
+	for (uint32_t i = 0; i < lsm->version->num_runs; i++) {
+		LsmRun* run = lsm->version->runs[i];
+		printf("- level %d run (size %d)\n", run->level, run->num_rows);
+	}
+	pthread_mutex_unlock(&lsm->lock);
+}
+
+// Write out every committed row and free the engine. Rows of transactions
+// still open are dropped, as they are from B-tree tables.
+void lsm_close(Table* table) {
+	Lsm* lsm = table->lsm;
+	pthread_mutex_lock(&lsm->lock);
+	lsm->closing = true;
+	pthread_mutex_unlock(&lsm->lock);
+	task_group_wait(&lsm->background);
+	lsm_flush(table, true);
+
+	LsmEntry* entry = lsm->head;
+	while (entry != NULL) {
+		LsmEntry* next = entry->next[0];
+		free(entry->value);
+		free(entry);
+		entry = next;
+	}
+	lsm_version_release(lsm->version);
+	close(lsm->log_fd);
+	pthread_mutex_destroy(&lsm->lock);
+	free(lsm->path);
+	free(lsm);
+	table->lsm = NULL;
+}
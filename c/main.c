@@ -6,47 +6,11 @@ typedef struct {
 	ssize_t input_length;
 } InputBuffer;
 
-typedef enum {
-	EXECUTE_SUCCESS,
-	EXECUTE_DUPLICATE_KEY,
-	EXECUTE_TABLE_FULL
-} ExecuteResult;
-
 typedef enum {
 	META_COMMAND_SUCCESS,
 	META_COMMAND_UNRECOGNIZED_COMMAND
 } MetaCommandResult;
 
-typedef enum {
-	PREPARE_SUCCESS,
-	PREPARE_NEGATIVE_ID,
-	PREPARE_STRING_TOO_LONG,
-	PREPARE_SYNTAX_ERROR,
-	PREPARE_UNRECOGNIZED_STATEMENT
-} PrepareResult;
-
-typedef enum {
-	STATEMENT_INSERT,
-	STATEMENT_SELECT
-} StatementType;
-
-typedef struct {
-	StatementType type;
-	Row row_to_insert; // only used by insert statement
-} Statement;
-
-void serialize_row(Row* source, void* destination) {
-	memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-	memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
-	memcpy(destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
-}
-
-void deserialize_row(void* source, Row* destination) {
-	memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-	memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-	memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
-}
-
 void print_row(Row* row) {
 	printf("(%d, %s, %s)\n", row->id, row->username, row->email);
 }
@@ -76,7 +40,8 @@ void indent(uint32_t level) {
 }
 
 void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
-	void* node = get_page(pager, page_num);
+	// Pinned, or loading the children could evict it
+	void* node = pager_pin(pager, page_num);
 	uint32_t num_keys, child;
 
 	switch (get_node_type(node)) {
@@ -93,6 +58,10 @@ void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
 			num_keys = *internal_node_num_keys(node);
 			indent(indentation_level);
 			printf("- internal (size %d)\n", num_keys);
+			if (*internal_node_num_messages(node) > 0) {
+				indent(indentation_level + 1);
+				printf("- buffer (size %d)\n", *internal_node_num_messages(node));
+			}
 			for (uint32_t i = 0; i < num_keys; i++) {
 				child = *internal_node_child(node, i);
 				print_tree(pager, child, indentation_level + 1);
@@ -104,15 +73,68 @@ void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
 			print_tree(pager, child, indentation_level + 1);
 			break;
 	}
+	pager_unpin(pager, page_num);
+}
+
+// Percentiles of every kind of statement run so far, in microseconds
+void print_latency() {
+	printf("Latency (us): count p50 p90 p99 p999 max\n");
+	for (uint32_t kind = 0; kind < LATENCY_NUM_KINDS; kind++) {
+		for (uint32_t phase = 0; phase < LATENCY_NUM_PHASES; phase++) {
+			LatencySummary summary;
+			latency_summary(kind, phase, &summary);
+			if (summary.count == 0) {
+				continue;
+			}
+			printf("%s %s: %llu %.1f %.1f %.1f %.1f %.1f\n", latency_kind_name(kind), latency_phase_name(phase),
+					(unsigned long long)summary.count, summary.p50 / 1000.0, summary.p90 / 1000.0,
+					summary.p99 / 1000.0, summary.p999 / 1000.0, summary.max / 1000.0);
+		}
+	}
 }
 
-MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
+MetaCommandResult do_meta_command(InputBuffer* input_buffer, Session* session) {
+	Table* table = session->table;
 	if (strcmp(input_buffer->buffer, ".exit") == 0) {
+		session_close(session);
 		db_close(table);
 		exit(EXIT_SUCCESS);
 	} else if (strcmp(input_buffer->buffer, ".btree") == 0) {
 		printf("Tree:\n");
-		print_tree(table->pager, 0, 0);
+		if (table->lsm != NULL) {
+			lsm_print(table);
+		} else {
+			print_tree(table->pager, 0, 0);
+		}
+		return META_COMMAND_SUCCESS;
+	} else if (strncmp(input_buffer->buffer, ".parallel ", 10) == 0) {
+		int num_workers = atoi(input_buffer->buffer + 10);
+		if (num_workers < 1) {
+			return META_COMMAND_UNRECOGNIZED_COMMAND;
+		}
+		session->scan_workers = num_workers;
+		return META_COMMAND_SUCCESS;
+	} else if (strcmp(input_buffer->buffer, ".rowcache") == 0) {
+		RowCacheStats stats;
+		if (!row_cache_stats(table, &stats)) {
+			printf("Row cache is off.\n");
+		} else {
+			printf("Row cache: %llu hits, %llu misses, %u of %u rows.\n", (unsigned long long)stats.hits, (unsigned long long)stats.misses, stats.num_rows, stats.capacity);
+		}
+		return META_COMMAND_SUCCESS;
+	} else if (strcmp(input_buffer->buffer, ".stats") == 0) {
+		Stats stats;
+		stats_read(&stats);
+		printf("Stats:\n");
+		for (uint32_t i = 0; i < STAT_NUM_COUNTERS; i++) {
+			printf("%s: %llu\n", stats_name(i), (unsigned long long)stats.counters[i]);
+		}
+		print_latency();
+		return META_COMMAND_SUCCESS;
+	} else if (strncmp(input_buffer->buffer, ".stats ", 7) == 0) {
+		if (!latency_dump(input_buffer->buffer + 7)) {
+			printf("Unable to write '%s'.\n", input_buffer->buffer + 7);
+		}
 		return META_COMMAND_SUCCESS;
 	} else if (strcmp(input_buffer->buffer, ".constants") == 0) {
 		printf("Constants:\n");
@@ -123,91 +145,8 @@ MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
 	}
 }
 
-PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
-	statement->type = STATEMENT_INSERT;
-
-	char* keyword = strtok(input_buffer->buffer, " ");
-	char* id_string = strtok(NULL, " ");
-	char* username = strtok(NULL, " ");
-	char* email = strtok(NULL, " ");
-
-	if (id_string == NULL || username == NULL || email == NULL) {
-		return PREPARE_SYNTAX_ERROR;
-	}
-
-	int id = atoi(id_string);
-	if (id < 0) {
-		return PREPARE_NEGATIVE_ID;
-	}
-	if (strlen(username) > COLUMN_USERNAME_SIZE) {
-		return PREPARE_STRING_TOO_LONG;
-	}
-	if (strlen(email) > COLUMN_EMAIL_SIZE) {
-		return PREPARE_STRING_TOO_LONG;
-	}
-
-	statement->row_to_insert.id = id;
-	strcpy(statement->row_to_insert.username, username);
-	strcpy(statement->row_to_insert.email, email);
-
-	return PREPARE_SUCCESS;
-}
-
-PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement) {
-	if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
-		return prepare_insert(input_buffer, statement);
-	}
-	if (strcmp(input_buffer->buffer, "select") == 0) {
-		statement->type = STATEMENT_SELECT;
-		return PREPARE_SUCCESS;
-	}
-
-	return PREPARE_UNRECOGNIZED_STATEMENT;
-}
-
-ExecuteResult execute_insert(Statement *statement, Table* table) {
-	void* node = get_page(table->pager, table->root_page_num);
-	uint32_t num_cells = (*leaf_node_num_cells(node));
-
-	Row* row_to_insert = &(statement->row_to_insert);
-	uint32_t key_to_insert = row_to_insert->id;
-	Cursor* cursor = table_find(table, key_to_insert);
-
-	if (cursor->cell_num < num_cells) {
-		uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-		if (key_at_index == key_to_insert) {
-			return EXECUTE_DUPLICATE_KEY;
-		}
-	}
-
-	leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
-	free(cursor);
-
-	return EXECUTE_SUCCESS;
-}
-
-ExecuteResult execute_select(Statement *statement, Table* table) {
-	Cursor* cursor = table_start(table);
-
-	Row row;
-	while (!(cursor->end_of_table)) {
-		deserialize_row(cursor_value(cursor), &row);
-		print_row(&row);
-		cursor_advance(cursor);
-	}
-
-	free(cursor);
-
-	return EXECUTE_SUCCESS;
-}
-
-ExecuteResult execute_statement(Statement *statement, Table* table) {
-	switch (statement->type) {
-		case (STATEMENT_INSERT):
-			return execute_insert(statement, table);
-		case (STATEMENT_SELECT):
-			return execute_select(statement, table);
-	}
+void print_selected_row(Row* row, void* arg) {
+	print_row(row);
 }
 
 void print_prompt() { printf("db > "); }
@@ -231,13 +170,72 @@ void close_input_buffer(InputBuffer* input_buffer) {
 }
 
 int main(int argc, char* argv[]) {
-	if (argc < 2) {
+	char* filename = NULL;
+	uint32_t flags = 0;
+	uint32_t num_threads = 0;
+	bool pin_threads = false;
+	char* socket_path = NULL;
+	uint16_t tcp_port = 0;
+	bool async_io = false;
+	uint32_t cache_pages = 0;
+	size_t memory_limit = 0;
+	size_t query_memory = 0;
+	size_t row_cache = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--direct-io") == 0) {
+			flags |= DB_OPEN_DIRECT_IO;
+		} else if (strcmp(argv[i], "--shadow") == 0) {
+			flags |= DB_OPEN_SHADOW;
+		} else if (strcmp(argv[i], "--lsm") == 0) {
+			flags |= DB_OPEN_LSM;
+		} else if (strcmp(argv[i], "--buffered") == 0) {
+			flags |= DB_OPEN_BUFFERED;
+		} else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			num_threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--pin-threads") == 0) {
+			pin_threads = true;
+		} else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+			socket_path = argv[++i];
+		} else if (strcmp(argv[i], "--tcp") == 0 && i + 1 < argc) {
+			tcp_port = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--async-io") == 0) {
+			async_io = true;
+		} else if (strcmp(argv[i], "--cache-pages") == 0 && i + 1 < argc) {
+			cache_pages = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--memory-limit") == 0 && i + 1 < argc) {
+			memory_limit = (size_t)atoi(argv[++i]) * 1024;
+		} else if (strcmp(argv[i], "--query-memory") == 0 && i + 1 < argc) {
+			query_memory = (size_t)atoi(argv[++i]) * 1024;
+		} else if (strcmp(argv[i], "--row-cache") == 0 && i + 1 < argc) {
+			row_cache = (size_t)atoi(argv[++i]) * 1024;
+		} else {
+			filename = argv[i];
+		}
+	}
+
+	if (filename == NULL) {
 		printf("Must supply a database filename.\n");
 		exit(EXIT_FAILURE);
 	}
 
-	char* filename = argv[1];
-	Table* table = db_open(filename);
+	if ((tcp_port != 0 || async_io) && socket_path == NULL) {
+		printf("--tcp and --async-io need --listen.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	shared_pool_configure(num_threads, pin_threads);
+	memory_configure(memory_limit, query_memory);
+	Table* table = db_open(filename, flags);
+	if (cache_pages > 0) {
+		pager_set_cache_capacity(table->pager, cache_pages);
+	}
+	row_cache_create(table, row_cache);
+	if (socket_path != NULL) {
+		server_run(table, socket_path, tcp_port, async_io);
+		db_close(table);
+		exit(EXIT_SUCCESS);
+	}
+	Session* session = session_new(table);
 
 	InputBuffer* input_buffer = new_input_buffer();
 	while (true) {
@@ -245,7 +243,7 @@ int main(int argc, char* argv[]) {
 		read_input(input_buffer);
 
 		if (input_buffer->buffer[0] == '.') {
-			switch (do_meta_command(input_buffer, table)) {
+			switch (do_meta_command(input_buffer, session)) {
 				case (META_COMMAND_SUCCESS):
 					continue;
 				case (META_COMMAND_UNRECOGNIZED_COMMAND):
@@ -255,33 +253,22 @@ int main(int argc, char* argv[]) {
 		}
 
 		Statement statement;
-		switch (prepare_statement(input_buffer, &statement)) {
-			case (PREPARE_SUCCESS):
-				break;
-			case (PREPARE_NEGATIVE_ID):
-				printf("ID must be positive.\n");
-				continue;
-			case (PREPARE_STRING_TOO_LONG):
-				printf("String is too long.\n");
-				continue;
-			case (PREPARE_SYNTAX_ERROR):
-				printf("Syntax error. Could not parse statement.\n");
-				continue;
-			case (PREPARE_UNRECOGNIZED_STATEMENT):
-				printf("Unrecognized keyword at start of '%s'.\n", input_buffer->buffer);
-				continue;
+		PrepareResult prepare_result = prepare_statement(input_buffer->buffer, &statement);
+		if (prepare_result != PREPARE_SUCCESS) {
+			char message[256];
+			describe_prepare_result(prepare_result, input_buffer->buffer, message, sizeof(message));
+			printf("%s\n", message);
+			continue;
 		}
 
-		switch (execute_statement(&statement, table)) {
-			case (EXECUTE_SUCCESS):
-				printf("Executed.\n");
-				break;
-			case (EXECUTE_DUPLICATE_KEY):
-				printf("Error: Duplicate key.\n");
-				break;
-			case (EXECUTE_TABLE_FULL):
-				printf("Error: Table full.\n");
-				break;
+		if (statement.explain != EXPLAIN_NONE) {
+			char text[1024];
+			ExecuteResult execute_result = explain_statement(&statement, session, text, sizeof(text));
+			printf("%s%s\n", text, execute_result_message(execute_result));
+			continue;
 		}
+
+		ExecuteResult execute_result = execute_statement(&statement, session, print_selected_row, NULL);
+		printf("%s\n", execute_result_message(execute_result));
 	}
 }
@@ -0,0 +1,168 @@
+#include "db.h"
+
+// Memory governor. A query that buffers rows is admitted with a budget
+// granted out of a global limit, and holds it until it finishes. Once
+// the grants add up to the limit, further queries wait for one to finish
+// rather than pushing the process past it. Within its budget a query
+// keeps rows in memory and spills the rest to a temporary file.
+
+#define MEMORY_DEFAULT_LIMIT (64 << 20)
+#define MEMORY_DEFAULT_QUERY_BUDGET (8 << 20)
+
+static pthread_mutex_t memory_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t memory_freed = PTHREAD_COND_INITIALIZER;
+static size_t memory_limit = MEMORY_DEFAULT_LIMIT;
+static size_t memory_query_budget = MEMORY_DEFAULT_QUERY_BUDGET;
+static size_t memory_granted = 0;
+
+// Set the limit on memory granted to all queries together and the budget
+// each one gets. Sizes are in bytes, 0 keeps the current setting.
+void memory_configure(size_t limit, size_t query_budget) {
+	pthread_mutex_lock(&memory_lock);
+	if (limit > 0) {
+		memory_limit = limit;
+	}
+	if (query_budget > 0) {
+		memory_query_budget = query_budget;
+	}
+	pthread_mutex_unlock(&memory_lock);
+}
+
+// Grant a budget if the limit has room for it. With nothing granted a
+// query always gets in, with at most the whole limit.
+bool memory_try_admit(QueryMemory* memory) {
+	pthread_mutex_lock(&memory_lock);
+	size_t budget = memory_query_budget < memory_limit ? memory_query_budget : memory_limit;
+	bool admitted = memory_granted == 0 || memory_granted + budget <= memory_limit;
+	if (admitted) {
+		memory_granted += budget;
+		memory->granted = budget;
+		memory->used = 0;
+	}
+	pthread_mutex_unlock(&memory_lock);
+	return admitted;
+}
+
+// Wait until a budget can be granted
+void memory_admit(QueryMemory* memory) {
+	pthread_mutex_lock(&memory_lock);
+	size_t budget = memory_query_budget < memory_limit ? memory_query_budget : memory_limit;
+	while (memory_granted != 0 && memory_granted + budget > memory_limit) {
+		pthread_cond_wait(&memory_freed, &memory_lock);
+		budget = memory_query_budget < memory_limit ? memory_query_budget : memory_limit;
+	}
+	memory_granted += budget;
+	memory->granted = budget;
+	memory->used = 0;
+	pthread_mutex_unlock(&memory_lock);
+}
+
+// Run without a budget, spilling every row. For a caller that must not
+// wait, because what it would wait for is its own grants.
+void memory_admit_spilling(QueryMemory* memory) {
+	memory->granted = 0;
+	memory->used = 0;
+}
+
+// Take size bytes of the budget. Returns false if they do not fit, and
+// the caller should spill instead.
+bool memory_reserve(QueryMemory* memory, size_t size) {
+	size_t used = atomic_fetch_add(&memory->used, size) + size;
+	if (used > memory->granted) {
+		atomic_fetch_sub(&memory->used, size);
+		return false;
+	}
+	return true;
+}
+
+void memory_release(QueryMemory* memory, size_t size) {
+	atomic_fetch_sub(&memory->used, size);
+}
+
+// Give the budget back to the global limit
+void memory_finish(QueryMemory* memory) {
+	if (memory->granted == 0) {
+		return;
+	}
+	pthread_mutex_lock(&memory_lock);
+	memory_granted -= memory->granted;
+	memory->granted = 0;
+	pthread_cond_broadcast(&memory_freed);
+	pthread_mutex_unlock(&memory_lock);
+}
+
+void row_store_init(RowStore* store, QueryMemory* memory) {
+	store->memory = memory;
+	store->rows = NULL;
+	store->num_rows = 0;
+	store->rows_capacity = 0;
+	store->spill = NULL;
+	store->num_spilled = 0;
+	store->next_row = 0;
+	store->spilled_row = NULL;
+}
+
+// Add a serialized row. Rows go to the file for good once the budget
+// runs out, so the ones in memory always come first.
+void row_store_append(RowStore* store, void* value) {
+	if (store->spill == NULL && store->num_rows == store->rows_capacity) {
+		uint32_t capacity = store->rows_capacity ? store->rows_capacity * 2 : 64;
+		if (memory_reserve(store->memory, (size_t)(capacity - store->rows_capacity) * ROW_SIZE)) {
+			store->rows = realloc(store->rows, (size_t)capacity * ROW_SIZE);
+			store->rows_capacity = capacity;
+		} else {
+			store->spill = tmpfile();
+			if (store->spill == NULL) {
+				printf("Unable to open spill file: %d\n", errno);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	if (store->spill == NULL) {
+		memcpy(store->rows + (size_t)store->num_rows * ROW_SIZE, value, ROW_SIZE);
+		store->num_rows++;
+		return;
+	}
+	if (fwrite(value, ROW_SIZE, 1, store->spill) != 1) {
+		printf("Error writing spill file: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	store->num_spilled++;
+}
+
+uint32_t row_store_count(RowStore* store) {
+	return store->num_rows + store->num_spilled;
+}
+
+// The next row in the order they were added, or NULL after the last one.
+// The row stays valid until the next call.
+void* row_store_next(RowStore* store) {
+	if (store->next_row < store->num_rows) {
+		return store->rows + (size_t)store->next_row++ * ROW_SIZE;
+	}
+	if (store->next_row >= row_store_count(store)) {
+		return NULL;
+	}
+	if (store->next_row == store->num_rows) {
+		// First spilled row, go back to the start of the file
+		store->spilled_row = malloc(ROW_SIZE);
+		fseek(store->spill, 0, SEEK_SET);
+	}
+	if (fread(store->spilled_row, ROW_SIZE, 1, store->spill) != 1) {
+		printf("Error reading spill file: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	store->next_row++;
+	return store->spilled_row;
+}
+
+void row_store_free(RowStore* store) {
+	free(store->rows);
+	memory_release(store->memory, (size_t)store->rows_capacity * ROW_SIZE);
+	if (store->spill != NULL) {
+		fclose(store->spill);
+	}
+	free(store->spilled_row);
+	row_store_init(store, store->memory);
+}
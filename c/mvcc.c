@@ -0,0 +1,263 @@
+#include "db.h"
+
+// Snapshots see the database as of the last commit before they began.
+// Writers keep the images they overwrite while any snapshot may still need
+// them, so long scans never block inserts and never see half of one.
+
+Snapshot* snapshot_begin(Table* table) {
+	Snapshot* snapshot = malloc(sizeof(Snapshot));
+
+	// Register with a lower bound of our timestamp first, so garbage
+	// collection keeps everything we may end up reading.
+	pthread_mutex_lock(&table->mvcc_lock);
+	snapshot->ts = table->last_commit_ts;
+	snapshot->next = table->snapshots;
+	table->snapshots = snapshot;
+	atomic_fetch_add(&table->num_snapshots, 1);
+	pthread_mutex_unlock(&table->mvcc_lock);
+
+	// From here on new writers save versions. Writers already running
+	// without saving them must finish before we pick our timestamp.
+	pthread_rwlock_wrlock(&table->version_barrier);
+	pthread_rwlock_unlock(&table->version_barrier);
+
+	pthread_mutex_lock(&table->mvcc_lock);
+	snapshot->ts = table->last_commit_ts;
+	pthread_mutex_unlock(&table->mvcc_lock);
+
+	return snapshot;
+}
+
+uint64_t oldest_snapshot_ts(Table* table) {
+	uint64_t oldest_ts = UINT64_MAX;
+	pthread_mutex_lock(&table->mvcc_lock);
+	for (Snapshot* s = table->snapshots; s != NULL; s = s->next) {
+		if (s->ts < oldest_ts) {
+			oldest_ts = s->ts;
+		}
+	}
+	pthread_mutex_unlock(&table->mvcc_lock);
+	return oldest_ts;
+}
+
+// Commits at or before this replaced images no snapshot needs anymore:
+// every snapshot is at least this old, and one that starts later gets a
+// timestamp no older than the last commit.
+uint64_t gc_horizon(Table* table) {
+	pthread_mutex_lock(&table->mvcc_lock);
+	uint64_t horizon = table->last_commit_ts;
+	for (Snapshot* s = table->snapshots; s != NULL; s = s->next) {
+		if (s->ts < horizon) {
+			horizon = s->ts;
+		}
+	}
+	pthread_mutex_unlock(&table->mvcc_lock);
+	return horizon;
+}
+
+// Free page versions no snapshot can see anymore. Only pages that have
+// versions are latched, and the horizon is found once for all of them.
+void gc_versions(Table* table) {
+	Pager* pager = table->pager;
+	if (atomic_load(&pager->num_versioned_pages) == 0) {
+		return;
+	}
+	uint64_t horizon = gc_horizon(table);
+	for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+		if (!atomic_load(&pager->has_versions[i])) {
+			continue;
+		}
+		pthread_rwlock_wrlock(&pager->latches[i]);
+		if (pager->versions[i] != NULL) {
+			pager_drop_versions(pager, i, horizon);
+		}
+		pthread_rwlock_unlock(&pager->latches[i]);
+	}
+}
+
+void snapshot_end(Table* table, Snapshot* snapshot) {
+	pthread_mutex_lock(&table->mvcc_lock);
+	Snapshot** link = &table->snapshots;
+	while (*link != snapshot) {
+		link = &(*link)->next;
+	}
+	*link = snapshot->next;
+	atomic_fetch_sub(&table->num_snapshots, 1);
+	pthread_mutex_unlock(&table->mvcc_lock);
+
+	free(snapshot);
+	gc_versions(table);
+	if (table->lsm != NULL) {
+		lsm_schedule_flush(table);
+	}
+}
+
+Transaction* txn_new(Table* table, bool explicit) {
+	Transaction* txn = malloc(sizeof(Transaction));
+	txn->table = table;
+	txn->explicit = explicit;
+	txn->start_num_pages = 0;
+	txn->dirty_pages = NULL;
+	txn->num_dirty_pages = 0;
+	txn->dirty_pages_capacity = 0;
+	txn->splits_top_levels = false;
+	txn->lsm_keys = NULL;
+	txn->num_lsm_keys = 0;
+	txn->lsm_keys_capacity = 0;
+
+	// Saving a copy of every page we touch is only needed while someone
+	// might read an older image. Check under the barrier so a snapshot
+	// starting right now waits for us instead.
+	pthread_rwlock_rdlock(&table->version_barrier);
+	txn->save_versions = atomic_load(&table->num_snapshots) > 0;
+	if (txn->save_versions) {
+		pthread_rwlock_unlock(&table->version_barrier);
+	}
+	return txn;
+}
+
+// A single statement. Runs alongside other statements.
+Transaction* txn_begin(Table* table) {
+	pthread_rwlock_rdlock(&table->write_lock);
+	return txn_new(table, false);
+}
+
+// A transaction spanning many statements. It is the only writer until it
+// commits or rolls back, so its latches can be dropped between statements
+// and nobody else allocates pages behind its back.
+Transaction* txn_begin_explicit(Table* table) {
+	pthread_rwlock_wrlock(&table->write_lock);
+	Transaction* txn = txn_new(table, true);
+	txn->start_num_pages = table->pager->num_pages;
+	return txn;
+}
+
+void txn_add_dirty_page(Transaction* txn, uint32_t page_num, void* before_image) {
+	if (txn->num_dirty_pages == txn->dirty_pages_capacity) {
+		txn->dirty_pages_capacity = txn->dirty_pages_capacity ? txn->dirty_pages_capacity * 2 : 8;
+		txn->dirty_pages = realloc(txn->dirty_pages, txn->dirty_pages_capacity * sizeof(DirtyPage));
+	}
+	DirtyPage* dirty_page = &txn->dirty_pages[txn->num_dirty_pages++];
+	dirty_page->page_num = page_num;
+	dirty_page->commit_ts = txn->table->pager->commit_ts[page_num];
+	dirty_page->before_image = before_image;
+	txn->table->pager->dirty[page_num] = true;
+}
+
+// Get a page for modification. The caller holds its write latch.
+void* txn_write(Transaction* txn, uint32_t page_num) {
+	Pager* pager = txn->table->pager;
+	void* page = get_page(pager, page_num);
+	if (pager->commit_ts[page_num] != COMMIT_TS_PENDING) {
+		// First write to this page in the transaction
+		if (txn->save_versions) {
+			pager_save_version(pager, page_num);
+		}
+		void* before_image = NULL;
+		if (txn->explicit) {
+			before_image = malloc(PAGE_SIZE);
+			memcpy(before_image, page, PAGE_SIZE);
+		}
+		txn_add_dirty_page(txn, page_num, before_image);
+		pager->commit_ts[page_num] = COMMIT_TS_PENDING;
+	}
+	return page;
+}
+
+// Allocate a page. No snapshot can reach it until a page linking to it
+// commits, so there is nothing to save.
+uint32_t txn_new_page(Transaction* txn) {
+	Pager* pager = txn->table->pager;
+	uint32_t page_num = get_unused_page_num(pager);
+	txn_add_dirty_page(txn, page_num, NULL);
+	pager->commit_ts[page_num] = COMMIT_TS_PENDING;
+	return page_num;
+}
+
+void txn_end(Transaction* txn) {
+	Table* table = txn->table;
+	if (!txn->save_versions) {
+		pthread_rwlock_unlock(&table->version_barrier);
+	}
+	pthread_rwlock_unlock(&table->write_lock);
+	for (uint32_t i = 0; i < txn->num_dirty_pages; i++) {
+		free(txn->dirty_pages[i].before_image);
+	}
+	free(txn->dirty_pages);
+	free(txn->lsm_keys);
+	free(txn);
+}
+
+// Stamp every page the transaction wrote with a new commit timestamp.
+// Must be called while the pages are still latched, so that commits on
+// any single page happen in timestamp order.
+//
+// An explicit transaction also makes the database durable, along with
+// every statement committed before it, for the cost of one journaled
+// write-back however many statements it ran.
+void txn_commit(Transaction* txn) {
+	Table* table = txn->table;
+	if (txn->num_dirty_pages > 0 || txn->num_lsm_keys > 0) {
+		pthread_mutex_lock(&table->mvcc_lock);
+		uint64_t commit_ts = ++table->last_commit_ts;
+		for (uint32_t i = 0; i < txn->num_dirty_pages; i++) {
+			table->pager->commit_ts[txn->dirty_pages[i].page_num] = commit_ts;
+		}
+		if (txn->num_lsm_keys > 0) {
+			lsm_commit(txn, commit_ts);
+		}
+		if (txn->splits_top_levels) {
+			table->top_levels_changed_ts = commit_ts;
+		}
+		pthread_mutex_unlock(&table->mvcc_lock);
+	}
+
+	if (txn->explicit) {
+		pager_commit(table->pager);
+		if (table->lsm != NULL) {
+			lsm_sync(table);
+		}
+	}
+	if (txn->num_lsm_keys > 0) {
+		lsm_schedule_flush(table);
+	}
+	txn_end(txn);
+}
+
+// Put back every page an explicit transaction wrote and forget the pages
+// it allocated. Only pages it wrote link to the new ones, so once those
+// are restored nothing can reach them.
+void txn_rollback(Transaction* txn) {
+	if (!txn->explicit) {
+		printf("Only explicit transactions can roll back.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (txn->num_lsm_keys > 0) {
+		lsm_rollback(txn);
+	}
+
+	Pager* pager = txn->table->pager;
+	for (uint32_t i = txn->num_dirty_pages; i > 0; i--) {
+		DirtyPage* dirty_page = &txn->dirty_pages[i - 1];
+		if (dirty_page->before_image == NULL) {
+			continue;
+		}
+		void* page = pager_latch(pager, dirty_page->page_num, LATCH_WRITE);
+		memcpy(page, dirty_page->before_image, PAGE_SIZE);
+		pager->commit_ts[dirty_page->page_num] = dirty_page->commit_ts;
+		pager_unlatch(pager, dirty_page->page_num);
+	}
+
+	pthread_mutex_lock(&pager->lock);
+	for (uint32_t i = txn->start_num_pages; i < pager->num_pages; i++) {
+		cache_forget(pager, i);
+		free(pager->pages[i]);
+		pager->pages[i] = NULL;
+		pager->commit_ts[i] = 0;
+		pager->dirty[i] = false;
+	}
+	pager->num_pages = txn->start_num_pages;
+	pthread_mutex_unlock(&pager->lock);
+
+	txn_end(txn);
+}
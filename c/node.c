@@ -1,6 +1,16 @@
 #include "db.h"
 
-uint32_t* node_parent(void* node) { return node + PARENT_POINTER_OFFSET; }
+void serialize_row(Row* source, void* destination) {
+	memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
+	memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
+	memcpy(destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
+}
+
+void deserialize_row(void* source, Row* destination) {
+	memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
+	memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
+	memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+}
 
 NodeType get_node_type(void* node) {
 	uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSIZE));
@@ -20,15 +30,33 @@ bool is_node_root(void* node) {
 void set_node_root(void* node, bool is_root) {
 	uint8_t value = is_root;
 	*((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
+	if (is_root) {
+		*root_node_format(node) = DB_FILE_FORMAT;
+	}
 }
 
-uint32_t get_node_max_key(void* node) {
+uint32_t* root_node_format(void* node) {
+	return node + PARENT_POINTER_OFFSET;
+}
+
+uint32_t* node_high_key(void* node) {
 	switch (get_node_type(node)) {
 		case NODE_INTERNAL:
-			return *internal_node_key(node, *internal_node_num_keys(node) - 1);
+			return internal_node_high_key(node);
 		case NODE_LEAF:
-			return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+			return leaf_node_high_key(node);
 	}
+	return NULL;
+}
+
+uint32_t* node_right_sibling(void* node) {
+	switch (get_node_type(node)) {
+		case NODE_INTERNAL:
+			return internal_node_right_sibling(node);
+		case NODE_LEAF:
+			return leaf_node_next_leaf(node);
+	}
+	return NULL;
 }
 
 
@@ -37,6 +65,7 @@ void initialize_leaf_node(void* node) {
 	set_node_root(node, false);
 	*leaf_node_num_cells(node) = 0;
 	*leaf_node_next_leaf(node) = 0; // 0 represents no sibling
+	*leaf_node_high_key(node) = HIGH_KEY_INFINITY;
 }
 
 uint32_t* leaf_node_num_cells(void* node) {
@@ -59,11 +88,20 @@ uint32_t* leaf_node_next_leaf(void* node) {
 	return node + LEAF_NODE_NEXT_LEAF_OFFSET;
 }
 
+uint32_t* leaf_node_high_key(void* node) {
+	return node + LEAF_NODE_HIGH_KEY_OFFSET;
+}
+
 
 void initialize_internal_node(void* node) {
 	set_node_type(node, NODE_INTERNAL);
 	set_node_root(node, false);
 	*internal_node_num_keys(node) = 0;
+	// Page 0 is always the root, so 0 can not mark a missing child
+	*internal_node_right_child(node) = INVALID_PAGE_NUM;
+	*internal_node_right_sibling(node) = 0; // but it can mark a missing sibling
+	*internal_node_high_key(node) = HIGH_KEY_INFINITY;
+	*internal_node_num_messages(node) = 0;
 }
 
 uint32_t* internal_node_num_keys(void* node) {
@@ -74,6 +112,14 @@ uint32_t* internal_node_right_child(void* node) {
 	return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
 }
 
+uint32_t* internal_node_right_sibling(void* node) {
+	return node + INTERNAL_NODE_RIGHT_SIBLING_OFFSET;
+}
+
+uint32_t* internal_node_high_key(void* node) {
+	return node + INTERNAL_NODE_HIGH_KEY_OFFSET;
+}
+
 uint32_t* internal_node_cell(void* node, uint32_t cell_num) {
 	return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
 }
@@ -88,8 +134,30 @@ uint32_t* internal_node_child(void* node, uint32_t child_num) {
 		printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
 		exit(EXIT_FAILURE);
 	} else if (child_num == num_keys) {
-		return internal_node_right_child(node);
+		uint32_t* right_child = internal_node_right_child(node);
+		if (*right_child == INVALID_PAGE_NUM) {
+			printf("Tried to access right child of node, but was invalid page\n");
+			exit(EXIT_FAILURE);
+		}
+		return right_child;
 	} else {
 		return internal_node_cell(node, child_num);
 	}
 }
+
+// Rows buffered on their way down, see buffer.c. Sorted by key.
+uint32_t* internal_node_num_messages(void* node) {
+	return node + INTERNAL_NODE_NUM_MESSAGES_OFFSET;
+}
+
+void* internal_node_message(void* node, uint32_t message_num) {
+	return node + INTERNAL_NODE_BUFFER_OFFSET + message_num * INTERNAL_NODE_MESSAGE_SIZE;
+}
+
+uint32_t* internal_node_message_key(void* node, uint32_t message_num) {
+	return internal_node_message(node, message_num);
+}
+
+void* internal_node_message_value(void* node, uint32_t message_num) {
+	return internal_node_message(node, message_num) + LEAF_NODE_KEY_SIZE;
+}
@@ -1,85 +1,516 @@
 #include "db.h"
 
-Pager* pager_open(const char* filename) {
-	int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+int pager_open_file(const char* filename, uint32_t flags, bool* direct_io) {
+	*direct_io = false;
+
+#ifdef O_DIRECT
+	if (flags & DB_OPEN_DIRECT_IO) {
+		int fd = open(filename, O_RDWR | O_CREAT | O_DIRECT, S_IWUSR | S_IRUSR);
+		if (fd != -1) {
+			*direct_io = true;
+			return fd;
+		}
+		// Some filesystems (e.g. tmpfs) reject O_DIRECT. Fall back to buffered I/O.
+	}
+#endif
+
+	return open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+}
+
+// O_DIRECT may be accepted by open() and still fail on the first read or write.
+// Drop it for the rest of the session instead of failing the query.
+bool pager_disable_direct_io(Pager* pager) {
+#ifdef O_DIRECT
+	if (!pager->direct_io || errno != EINVAL) {
+		return false;
+	}
+
+	int flags = fcntl(pager->file_descriptor, F_GETFL);
+	if (flags == -1 || fcntl(pager->file_descriptor, F_SETFL, flags & ~O_DIRECT) == -1) {
+		return false;
+	}
+	pager->direct_io = false;
+	return true;
+#else
+	return false;
+#endif
+}
+
+// Direct I/O needs the buffer aligned to the logical block size.
+// PAGE_SIZE is a multiple of it on every filesystem we run on.
+void* pager_alloc_page() {
+	void* page;
+	if (posix_memalign(&page, PAGE_SIZE, PAGE_SIZE) != 0) {
+		printf("Error allocating page\n");
+		exit(EXIT_FAILURE);
+	}
+	return page;
+}
+
+// The rollback journal holds the on-disk image of every page a commit is
+// about to overwrite, plus the length of the file before it. It is synced
+// before the database is touched, so after a crash midway through the
+// write-back we can put the old database back.
+//
+// Layout: a header followed by one record per page. Each record carries
+// a checksum so a journal torn before its sync is recognized. In that case
+// the database has not been touched yet and the good records are no-ops.
+#define JOURNAL_MAGIC 0x6a726e6c
+#define JOURNAL_INVALID 0
+
+typedef struct {
+	uint32_t magic;
+	uint32_t num_pages; // Database length in pages before the commit
+} JournalHeader;
+
+typedef struct {
+	uint32_t page_num;
+	uint32_t checksum;
+} JournalRecordHeader;
+
+// Cheap checksum to recognize torn or stale pages
+uint32_t page_checksum(uint32_t seed, void* page) {
+	uint32_t checksum = seed;
+	uint32_t* words = page;
+	for (uint32_t i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+		checksum = (checksum << 1 | checksum >> 31) + words[i];
+	}
+	return checksum;
+}
+
+void journal_write(int fd, const void* buffer, size_t length, off_t offset) {
+	stats_add(STAT_BYTES_WRITTEN, length);
+	if (pwrite(fd, buffer, length, offset) != (ssize_t)length) {
+		printf("Error writing journal: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void sync_or_exit(int fd) {
+	stats_add(STAT_FSYNCS, 1);
+	if (fsync(fd) == -1) {
+		printf("Error syncing: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Undo a commit that crashed midway. Called before the file is looked at.
+void pager_recover(int fd, const char* journal_path) {
+	int journal_fd = open(journal_path, O_RDONLY);
+	if (journal_fd == -1) {
+		return;
+	}
+
+	JournalHeader header;
+	if (pread(journal_fd, &header, sizeof(header), 0) == sizeof(header) && header.magic == JOURNAL_MAGIC) {
+		void* page = pager_alloc_page();
+		JournalRecordHeader record;
+		off_t offset = sizeof(header);
+		while (pread(journal_fd, &record, sizeof(record), offset) == sizeof(record) &&
+				pread(journal_fd, page, PAGE_SIZE, offset + sizeof(record)) == PAGE_SIZE &&
+				record.checksum == page_checksum(record.page_num, page)) {
+			if (pwrite(fd, page, PAGE_SIZE, (off_t)record.page_num * PAGE_SIZE) == -1) {
+				printf("Error writing: %d\n", errno);
+				exit(EXIT_FAILURE);
+			}
+			offset += sizeof(record) + PAGE_SIZE;
+		}
+		free(page);
+
+		if (ftruncate(fd, (off_t)header.num_pages * PAGE_SIZE) == -1) {
+			printf("Error truncating db file: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+		sync_or_exit(fd);
+	}
+
+	close(journal_fd);
+	unlink(journal_path);
+}
+
+Pager* pager_open(const char* filename, uint32_t flags) {
+	bool direct_io;
+	int fd = pager_open_file(filename, flags, &direct_io);
 	if (fd == -1) {
 		printf("Unable to open file\n");
 		exit(EXIT_FAILURE);
 	}
 
+	char* journal_path = malloc(strlen(filename) + strlen("-journal") + 1);
+	strcpy(journal_path, filename);
+	strcat(journal_path, "-journal");
+	pager_recover(fd, journal_path);
+
 	off_t file_length = lseek(fd, 0, SEEK_END);
 
 	Pager* pager = malloc(sizeof(Pager));
 	pager->file_descriptor = fd;
 	pager->file_length = file_length;
 	pager->num_pages = file_length / PAGE_SIZE;
+	pager->direct_io = direct_io;
+	pager->journal_path = journal_path;
+	pager->journal_fd = -1;
 
+	// Direct I/O can only transfer whole pages, so a partial trailing page
+	// is never readable. It is corrupt either way.
 	if (file_length % PAGE_SIZE != 0) {
 		printf("Db file is not a whole number of pages. Corrupt file.\n");
 		exit(EXIT_FAILURE);
 	}
 
+	pager->shadow = shadow_open(pager, flags);
+
+	pthread_mutex_init(&pager->lock, NULL);
 	for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
 		pager->pages[i] = NULL;
+		pthread_rwlock_init(&pager->latches[i], NULL);
+		pager->pin_counts[i] = 0;
+		pager->commit_ts[i] = 0;
+		pager->versions[i] = NULL;
+		pager->has_versions[i] = false;
+		pager->dirty[i] = false;
 	}
+	pager->num_versioned_pages = 0;
+	cache_init(pager);
 	return pager;
 }
 
+// Read the page stored at a location in the file, in pages
+void pager_read(Pager* pager, void* page, uint32_t location) {
+	off_t offset = (off_t)location * PAGE_SIZE;
+	ssize_t bytes_read = pread(pager->file_descriptor, page, PAGE_SIZE, offset);
+	if (bytes_read == -1 && pager_disable_direct_io(pager)) {
+		bytes_read = pread(pager->file_descriptor, page, PAGE_SIZE, offset);
+	}
+	if (bytes_read == -1) {
+		printf("Error reading file: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	stats_add(STAT_PAGES_READ, 1);
+	stats_add(STAT_BYTES_READ, PAGE_SIZE);
+}
+
+void pager_write(Pager* pager, void* page, uint32_t location) {
+	off_t offset = (off_t)location * PAGE_SIZE;
+	ssize_t bytes_written = pwrite(pager->file_descriptor, page, PAGE_SIZE, offset);
+	if (bytes_written == -1 && pager_disable_direct_io(pager)) {
+		bytes_written = pwrite(pager->file_descriptor, page, PAGE_SIZE, offset);
+	}
+	if (bytes_written == -1) {
+		printf("Error writing: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	stats_add(STAT_PAGES_WRITTEN, 1);
+	stats_add(STAT_BYTES_WRITTEN, PAGE_SIZE);
+}
+
 void pager_flush(Pager* pager, uint32_t page_num) {
 	if (pager->pages[page_num] == NULL) {
 		printf("Tried to flush null page\n");
 		exit(EXIT_FAILURE);
 	}
+	pager_write(pager, pager->pages[page_num], page_num);
+}
 
-	off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+// Write every dirty page back and sync, atomically: the old image of each
+// page that is already on disk goes to the journal first. The journal is
+// invalidated once the database is synced, which is the commit point.
+// There must be no writers in flight.
+void pager_commit(Pager* pager) {
+	uint32_t num_file_pages = pager->file_length / PAGE_SIZE;
+	uint32_t num_dirty = 0;
+	for (uint32_t i = 0; i < pager->num_pages; i++) {
+		if (pager->dirty[i]) {
+			num_dirty++;
+		}
+	}
+	if (num_dirty == 0) {
+		return;
+	}
+	if (pager->shadow) {
+		shadow_commit(pager);
+		return;
+	}
 
-	if (offset == -1) {
-		printf("Error seeking: %d\n", errno);
-		exit(EXIT_FAILURE);
+	if (pager->journal_fd == -1) {
+		pager->journal_fd = open(pager->journal_path, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+		if (pager->journal_fd == -1) {
+			printf("Unable to open journal\n");
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	ssize_t bytes_written = write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
-	if (bytes_written == -1) {
-		printf("Error writing: %d\n", errno);
+	JournalHeader header = {JOURNAL_MAGIC, num_file_pages};
+	journal_write(pager->journal_fd, &header, sizeof(header), 0);
+	off_t offset = sizeof(header);
+	void* original = pager_alloc_page();
+	for (uint32_t i = 0; i < num_file_pages; i++) {
+		if (!pager->dirty[i]) {
+			continue;
+		}
+		pager_read(pager, original, i);
+		JournalRecordHeader record = {i, page_checksum(i, original)};
+		journal_write(pager->journal_fd, &record, sizeof(record), offset);
+		journal_write(pager->journal_fd, original, PAGE_SIZE, offset + sizeof(record));
+		offset += sizeof(record) + PAGE_SIZE;
+	}
+	free(original);
+	// Cut off records left over from a longer commit
+	if (ftruncate(pager->journal_fd, offset) == -1) {
+		printf("Error truncating journal: %d\n", errno);
 		exit(EXIT_FAILURE);
 	}
+	sync_or_exit(pager->journal_fd);
+
+	for (uint32_t i = 0; i < pager->num_pages; i++) {
+		if (pager->dirty[i]) {
+			pager_flush(pager, i);
+		}
+	}
+	sync_or_exit(pager->file_descriptor);
+	// Cache misses only read pages inside the file, so grow it before the
+	// new pages become clean and can be evicted
+	pthread_mutex_lock(&pager->lock);
+	if (pager->num_pages * PAGE_SIZE > pager->file_length) {
+		pager->file_length = pager->num_pages * PAGE_SIZE;
+	}
+	pthread_mutex_unlock(&pager->lock);
+	for (uint32_t i = 0; i < pager->num_pages; i++) {
+		pager->dirty[i] = false;
+	}
+
+	header.magic = JOURNAL_INVALID;
+	journal_write(pager->journal_fd, &header, sizeof(header), 0);
+	sync_or_exit(pager->journal_fd);
 }
 
-void* get_page(Pager* pager, uint32_t page_num) {
-	if (page_num > TABLE_MAX_PAGES) {
-		printf("Tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);
+// Drop a page from the cache if nobody is using it. The caller holds
+// pager->lock. Anyone reading a page pins it first and then loads the
+// pointer, so after clearing the slot a reader either shows up in the pin
+// count, and the page is put back, or finds the slot empty and waits on
+// pager->lock to load the page again.
+//
+// Dirty pages are ruled out before the slot is touched: commits read them
+// straight from the slots.
+bool pager_evict(Pager* pager, uint32_t page_num) {
+	if (pager->dirty[page_num] || pager->pin_counts[page_num] > 0 ||
+		pthread_rwlock_trywrlock(&pager->latches[page_num]) != 0) {
+		return false;
+	}
+	void* page = pager->pages[page_num];
+	pager->pages[page_num] = NULL;
+	bool evicted = pager->pin_counts[page_num] == 0 && !pager->dirty[page_num];
+	if (evicted) {
+		free(page);
+		pager->num_cached--;
+		stats_add(STAT_CACHE_EVICTIONS, 1);
+	} else {
+		pager->pages[page_num] = page;
+	}
+	pthread_rwlock_unlock(&pager->latches[page_num]);
+	return evicted;
+}
+
+// Cache a freshly loaded page, making room for it first. Internal nodes
+// are few and on every path, so one a scan loads is cached like any other.
+void pager_admit(Pager* pager, uint32_t page_num, void* page, bool scan) {
+	scan = scan && get_node_type(page) == NODE_LEAF;
+	cache_make_room(pager);
+	cache_admit(pager, page_num, scan);
+	pager->pages[page_num] = page;
+	pager->num_cached++;
+	if (page_num >= pager->num_pages) {
+		pager->num_pages = page_num + 1;
+	}
+}
+
+void pager_check_bounds(uint32_t page_num) {
+	if (page_num >= TABLE_MAX_PAGES) {
+		printf("Tried to fetch page number out of bounds. %d >= %d\n", page_num, TABLE_MAX_PAGES);
 		exit(EXIT_FAILURE);
 	}
+}
 
-	if (pager->pages[page_num] == NULL) {
-		// Cache miss. Allocate memory and load from file.
-		void* page = malloc(PAGE_SIZE);
+void* pager_load(Pager* pager, uint32_t page_num, bool scan) {
+	pager_check_bounds(page_num);
+	void* page = pager->pages[page_num];
+	if (page != NULL) {
+		stats_add(STAT_CACHE_HITS, 1);
+		return page;
+	}
+
+	// Cache miss. Readers may race to load the same page, so only one loads
+	// it and everyone else picks up the published pointer.
+	stats_add(STAT_CACHE_MISSES, 1);
+	pthread_mutex_lock(&pager->lock);
+	page = pager->pages[page_num];
+	if (page == NULL) {
+		page = pager_alloc_page();
 		uint32_t num_pages = pager->file_length / PAGE_SIZE;
 
-		// We might save a partial page at the end of the file
-		if (pager->file_length % PAGE_SIZE) {
-			num_pages += 1;
+		if (page_num < num_pages) {
+			pager_read(pager, page, pager->shadow ? pager->page_table[page_num] : page_num);
 		}
 
-		if (page_num <= num_pages) {
-			lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-			ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-			if (bytes_read == -1) {
-				printf("Error reading file: %d\n", errno);
-				exit(EXIT_FAILURE);
-			}
-		}
+		pager_admit(pager, page_num, page, scan);
+	}
+	pthread_mutex_unlock(&pager->lock);
 
-		pager->pages[page_num] = page;
+	return page;
+}
+
+// The cached image of a page. Only safe to use while the page is pinned
+// or latched, or it may be evicted under you.
+void* get_page(Pager* pager, uint32_t page_num) {
+	return pager_load(pager, page_num, false);
+}
+
+bool pager_page_cached(Pager* pager, uint32_t page_num) {
+	return pager->pages[page_num] != NULL;
+}
 
-		if (page_num >= pager->num_pages) {
-			pager->num_pages = page_num + 1;
+// Where the page's image lives in the file. Returns false for a page that
+// has never been written, which starts out blank.
+bool pager_page_offset(Pager* pager, uint32_t page_num, off_t* offset) {
+	pthread_mutex_lock(&pager->lock);
+	bool in_file = page_num < pager->file_length / PAGE_SIZE;
+	uint32_t location = pager->shadow ? pager->page_table[page_num] : page_num;
+	pthread_mutex_unlock(&pager->lock);
+	*offset = (off_t)location * PAGE_SIZE;
+	return in_file;
+}
+
+// Cache a page read without get_page(), for reads done asynchronously.
+// If the page got loaded meanwhile, the cached copy wins and ours is freed.
+void pager_install_page(Pager* pager, uint32_t page_num, void* page) {
+	stats_add(STAT_PAGES_READ, 1);
+	stats_add(STAT_BYTES_READ, PAGE_SIZE);
+	pthread_mutex_lock(&pager->lock);
+	if (pager->pages[page_num] == NULL) {
+		pager_admit(pager, page_num, page, false);
+		page = NULL;
+	}
+	pthread_mutex_unlock(&pager->lock);
+	free(page);
+}
+
+// Keep a page from being evicted without latching it, to peek at it.
+// The pin comes before the load, see pager_evict().
+void* pager_pin(Pager* pager, uint32_t page_num) {
+	pager_check_bounds(page_num);
+	atomic_fetch_add(&pager->pin_counts[page_num], 1);
+	return get_page(pager, page_num);
+}
+
+void pager_unpin(Pager* pager, uint32_t page_num) {
+	atomic_fetch_sub(&pager->pin_counts[page_num], 1);
+}
+
+void* pager_latch_page(Pager* pager, uint32_t page_num, LatchMode mode, bool scan) {
+	pager_check_bounds(page_num);
+	atomic_fetch_add(&pager->pin_counts[page_num], 1);
+	void* page = pager_load(pager, page_num, scan);
+	if (!scan && !pager->referenced[page_num]) {
+		pager->referenced[page_num] = true;
+	}
+
+	if (mode == LATCH_READ) {
+		pthread_rwlock_rdlock(&pager->latches[page_num]);
+	} else {
+		pthread_rwlock_wrlock(&pager->latches[page_num]);
+	}
+	return page;
+}
+
+// Pin a page and take its latch. The pointer stays valid until pager_unlatch().
+void* pager_latch(Pager* pager, uint32_t page_num, LatchMode mode) {
+	return pager_latch_page(pager, page_num, mode, false);
+}
+
+// Latch a page for a scan. Reading it does not count as a use, so the
+// page goes again soon unless something else wants it.
+void* pager_latch_for_scan(Pager* pager, uint32_t page_num, LatchMode mode) {
+	return pager_latch_page(pager, page_num, mode, true);
+}
+
+void pager_unlatch(Pager* pager, uint32_t page_num) {
+	pthread_rwlock_unlock(&pager->latches[page_num]);
+	atomic_fetch_sub(&pager->pin_counts[page_num], 1);
+}
+
+// Reserve a page number for a new page. Until we start recycling free pages,
+// new pages will always go onto the end of the database file
+uint32_t get_unused_page_num(Pager* pager) {
+	pthread_mutex_lock(&pager->lock);
+	uint32_t page_num = pager->num_pages++;
+	pthread_mutex_unlock(&pager->lock);
+	return page_num;
+}
+
+// Keep the current image of a page before a transaction overwrites it.
+// The caller holds the write latch.
+void pager_save_version(Pager* pager, uint32_t page_num) {
+	PageVersion* version = malloc(sizeof(PageVersion));
+	version->commit_ts = pager->commit_ts[page_num];
+	version->data = malloc(PAGE_SIZE);
+	memcpy(version->data, get_page(pager, page_num), PAGE_SIZE);
+	version->older = pager->versions[page_num];
+	pager->versions[page_num] = version;
+	if (version->older == NULL) {
+		atomic_store(&pager->has_versions[page_num], true);
+		atomic_fetch_add(&pager->num_versioned_pages, 1);
+	}
+}
+
+// The newest image of a page committed at or before snapshot_ts, or NULL
+// if the page did not exist yet. The caller holds a latch on the page.
+void* pager_image_as_of(Pager* pager, uint32_t page_num, uint64_t snapshot_ts) {
+	if (pager->commit_ts[page_num] <= snapshot_ts) {
+		return get_page(pager, page_num);
+	}
+	for (PageVersion* version = pager->versions[page_num]; version != NULL; version = version->older) {
+		if (version->commit_ts <= snapshot_ts) {
+			return version->data;
 		}
 	}
+	return NULL;
+}
+
+// Like pager_image_as_of(), for pages the snapshot reached through the tree
+void* pager_page_as_of(Pager* pager, uint32_t page_num, uint64_t snapshot_ts) {
+	void* image = pager_image_as_of(pager, page_num, snapshot_ts);
+	if (image == NULL) {
+		printf("No version of page %d visible at %llu\n", page_num, (unsigned long long)snapshot_ts);
+		exit(EXIT_FAILURE);
+	}
+	return image;
+}
 
-	return pager->pages[page_num];
+void free_versions(PageVersion* version) {
+	while (version != NULL) {
+		PageVersion* older = version->older;
+		free(version->data);
+		free(version);
+		version = older;
+	}
 }
 
-// Until we start recycling free pages, new pages will always
-// go onto the end of the database file
-uint32_t get_unused_page_num(Pager* pager) { return pager->num_pages; }
+// Drop the images of a page that no snapshot at or after oldest_snapshot_ts
+// can see. An image is visible until the commit that replaced it, so once
+// that commit is at or before the oldest snapshot, it and everything older
+// can go. The image under an uncommitted write is always kept: a snapshot
+// starting before that commit will need it. The caller holds the write latch.
+void pager_drop_versions(Pager* pager, uint32_t page_num, uint64_t oldest_snapshot_ts) {
+	uint64_t replaced_at = pager->commit_ts[page_num];
+	PageVersion** link = &pager->versions[page_num];
+	while (*link != NULL && (replaced_at == COMMIT_TS_PENDING || replaced_at > oldest_snapshot_ts)) {
+		replaced_at = (*link)->commit_ts;
+		link = &(*link)->older;
+	}
+	free_versions(*link);
+	*link = NULL;
+	if (pager->versions[page_num] == NULL) {
+		atomic_store(&pager->has_versions[page_num], false);
+		atomic_fetch_sub(&pager->num_versioned_pages, 1);
+	}
+}
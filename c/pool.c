@@ -0,0 +1,282 @@
+#include "db.h"
+
+#include <sched.h>
+
+// Work-stealing thread pool. Every worker owns a deque: it pushes and pops
+// its own tasks at the bottom, most recent first, which keeps nested work
+// cache hot. Idle threads steal from the top of other deques, taking the
+// oldest and usually largest tasks. Threads outside the pool spread their
+// tasks over the deques and help run tasks while they wait on a group.
+
+typedef struct {
+	TaskFunction fn;
+	void* arg;
+	TaskGroup* group;
+} Task;
+
+typedef struct {
+	pthread_mutex_t lock;
+	Task* tasks; // Ring buffer
+	uint32_t capacity;
+	uint32_t top; // Oldest task
+	uint32_t size;
+} TaskDeque;
+
+struct ThreadPool {
+	uint32_t num_threads;
+	pthread_t* threads;
+	TaskDeque* deques;
+	atomic_uint num_queued;
+	atomic_uint next_deque; // Round robin for tasks from outside the pool
+	pthread_mutex_t lock; // Sleeping threads wait on wake
+	pthread_cond_t wake;
+	bool shutdown;
+};
+
+typedef struct {
+	ThreadPool* pool;
+	uint32_t index;
+	bool pin;
+} WorkerStart;
+
+// Deque of the pool worker running on this thread, if any
+static __thread ThreadPool* current_pool = NULL;
+static __thread uint32_t current_worker = 0;
+
+void deque_push(TaskDeque* deque, Task task) {
+	pthread_mutex_lock(&deque->lock);
+	if (deque->size == deque->capacity) {
+		uint32_t capacity = deque->capacity ? deque->capacity * 2 : 16;
+		Task* tasks = malloc(capacity * sizeof(Task));
+		for (uint32_t i = 0; i < deque->size; i++) {
+			tasks[i] = deque->tasks[(deque->top + i) % deque->capacity];
+		}
+		free(deque->tasks);
+		deque->tasks = tasks;
+		deque->capacity = capacity;
+		deque->top = 0;
+	}
+	deque->tasks[(deque->top + deque->size) % deque->capacity] = task;
+	deque->size++;
+	pthread_mutex_unlock(&deque->lock);
+}
+
+bool deque_pop_bottom(TaskDeque* deque, Task* task) {
+	pthread_mutex_lock(&deque->lock);
+	bool found = deque->size > 0;
+	if (found) {
+		deque->size--;
+		*task = deque->tasks[(deque->top + deque->size) % deque->capacity];
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return found;
+}
+
+bool deque_steal_top(TaskDeque* deque, Task* task) {
+	pthread_mutex_lock(&deque->lock);
+	bool found = deque->size > 0;
+	if (found) {
+		*task = deque->tasks[deque->top];
+		deque->top = (deque->top + 1) % deque->capacity;
+		deque->size--;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return found;
+}
+
+// Take a task: our own newest one if we are a worker, else steal the
+// oldest one from the next deque that has any
+bool pool_take_task(ThreadPool* pool, Task* task) {
+	if (atomic_load(&pool->num_queued) == 0) {
+		return false;
+	}
+	uint32_t start = 0;
+	if (current_pool == pool) {
+		if (deque_pop_bottom(&pool->deques[current_worker], task)) {
+			atomic_fetch_sub(&pool->num_queued, 1);
+			return true;
+		}
+		start = current_worker + 1;
+	}
+	for (uint32_t i = 0; i < pool->num_threads; i++) {
+		if (deque_steal_top(&pool->deques[(start + i) % pool->num_threads], task)) {
+			atomic_fetch_sub(&pool->num_queued, 1);
+			return true;
+		}
+	}
+	return false;
+}
+
+void pool_run_task(ThreadPool* pool, Task* task) {
+	task->fn(task->arg);
+	if (atomic_fetch_sub(&task->group->pending, 1) == 1) {
+		// Last task of the group, its waiter may be asleep
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_broadcast(&pool->wake);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+void* pool_worker(void* arg) {
+	WorkerStart* start = arg;
+	ThreadPool* pool = start->pool;
+	current_pool = pool;
+	current_worker = start->index;
+
+#ifdef __linux__
+	if (start->pin) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(start->index % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+#endif
+	free(start);
+
+	Task task;
+	while (true) {
+		if (pool_take_task(pool, &task)) {
+			pool_run_task(pool, &task);
+			continue;
+		}
+		pthread_mutex_lock(&pool->lock);
+		while (atomic_load(&pool->num_queued) == 0 && !pool->shutdown) {
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		}
+		bool shutdown = pool->shutdown && atomic_load(&pool->num_queued) == 0;
+		pthread_mutex_unlock(&pool->lock);
+		if (shutdown) {
+			return NULL;
+		}
+	}
+}
+
+// num_threads of 0 means one per online CPU. pin binds worker i to CPU i.
+ThreadPool* pool_create(uint32_t num_threads, bool pin) {
+	if (num_threads == 0) {
+		long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		num_threads = num_cpus > 0 ? num_cpus : 1;
+	}
+
+	ThreadPool* pool = malloc(sizeof(ThreadPool));
+	pool->num_threads = num_threads;
+	pool->threads = malloc(num_threads * sizeof(pthread_t));
+	pool->deques = malloc(num_threads * sizeof(TaskDeque));
+	pool->num_queued = 0;
+	pool->next_deque = 0;
+	pool->shutdown = false;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+
+	for (uint32_t i = 0; i < num_threads; i++) {
+		TaskDeque* deque = &pool->deques[i];
+		pthread_mutex_init(&deque->lock, NULL);
+		deque->tasks = NULL;
+		deque->capacity = 0;
+		deque->top = 0;
+		deque->size = 0;
+	}
+	for (uint32_t i = 0; i < num_threads; i++) {
+		WorkerStart* start = malloc(sizeof(WorkerStart));
+		start->pool = pool;
+		start->index = i;
+		start->pin = pin;
+		if (pthread_create(&pool->threads[i], NULL, pool_worker, start) != 0) {
+			printf("Error starting pool thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return pool;
+}
+
+// Runs every queued task, then stops the workers
+void pool_destroy(ThreadPool* pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (uint32_t i = 0; i < pool->num_threads; i++) {
+		pthread_join(pool->threads[i], NULL);
+		pthread_mutex_destroy(&pool->deques[i].lock);
+		free(pool->deques[i].tasks);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wake);
+	free(pool->deques);
+	free(pool->threads);
+	free(pool);
+}
+
+uint32_t pool_num_threads(ThreadPool* pool) {
+	return pool->num_threads;
+}
+
+static pthread_mutex_t shared_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static ThreadPool* shared = NULL;
+static uint32_t shared_pool_threads = 0;
+static bool shared_pool_pin = false;
+
+// Size the shared pool. Only has an effect before its first use.
+void shared_pool_configure(uint32_t num_threads, bool pin) {
+	pthread_mutex_lock(&shared_pool_lock);
+	shared_pool_threads = num_threads;
+	shared_pool_pin = pin;
+	pthread_mutex_unlock(&shared_pool_lock);
+}
+
+// The pool every parallel operation in the engine runs on, so that they
+// share the CPUs instead of each starting threads of their own
+ThreadPool* shared_pool() {
+	pthread_mutex_lock(&shared_pool_lock);
+	if (shared == NULL) {
+		shared = pool_create(shared_pool_threads, shared_pool_pin);
+	}
+	pthread_mutex_unlock(&shared_pool_lock);
+	return shared;
+}
+
+void task_group_init(TaskGroup* group, ThreadPool* pool) {
+	group->pool = pool;
+	group->pending = 0;
+}
+
+void task_group_spawn(TaskGroup* group, TaskFunction fn, void* arg) {
+	ThreadPool* pool = group->pool;
+	Task task = {fn, arg, group};
+	atomic_fetch_add(&group->pending, 1);
+
+	uint32_t deque;
+	if (current_pool == pool) {
+		deque = current_worker;
+	} else {
+		deque = atomic_fetch_add(&pool->next_deque, 1) % pool->num_threads;
+	}
+	// Count the task before it can be taken, so num_queued never drops
+	// below the tasks actually queued and never wraps
+	atomic_fetch_add(&pool->num_queued, 1);
+	deque_push(&pool->deques[deque], task);
+
+	// Broadcast: a waiter whose group is done would swallow a signal
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Wait for every task spawned in the group. The caller runs queued tasks
+// meanwhile, so waiting from inside a task does not tie up a worker.
+void task_group_wait(TaskGroup* group) {
+	ThreadPool* pool = group->pool;
+	Task task;
+	while (atomic_load(&group->pending) > 0) {
+		if (pool_take_task(pool, &task)) {
+			pool_run_task(pool, &task);
+			continue;
+		}
+		pthread_mutex_lock(&pool->lock);
+		while (atomic_load(&group->pending) > 0 && atomic_load(&pool->num_queued) == 0) {
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
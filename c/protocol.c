@@ -0,0 +1,119 @@
+#include "db.h"
+
+// Encoding shared by the server and db-client. A frame is a u32 length,
+// then a u8 message type and the payload; length counts the type and the
+// payload. Integers are little endian whatever the host.
+
+void buffer_reserve(Buffer* buffer, uint32_t size) {
+	if (buffer->length + size <= buffer->capacity) {
+		return;
+	}
+	uint32_t capacity = buffer->capacity ? buffer->capacity : 4096;
+	while (capacity < buffer->length + size) {
+		capacity *= 2;
+	}
+	buffer->data = realloc(buffer->data, capacity);
+	buffer->capacity = capacity;
+}
+
+void buffer_put_bytes(Buffer* buffer, const void* bytes, uint32_t size) {
+	buffer_reserve(buffer, size);
+	memcpy(buffer->data + buffer->length, bytes, size);
+	buffer->length += size;
+}
+
+void buffer_put_u8(Buffer* buffer, uint8_t value) {
+	buffer_put_bytes(buffer, &value, 1);
+}
+
+void buffer_put_u16(Buffer* buffer, uint16_t value) {
+	uint8_t bytes[2] = {value, value >> 8};
+	buffer_put_bytes(buffer, bytes, 2);
+}
+
+void buffer_put_u32(Buffer* buffer, uint32_t value) {
+	uint8_t bytes[4] = {value, value >> 8, value >> 16, value >> 24};
+	buffer_put_bytes(buffer, bytes, 4);
+}
+
+// Drop size bytes from the front
+void buffer_consume(Buffer* buffer, uint32_t size) {
+	memmove(buffer->data, buffer->data + size, buffer->length - size);
+	buffer->length -= size;
+}
+
+void buffer_free(Buffer* buffer) {
+	free(buffer->data);
+	buffer->data = NULL;
+	buffer->length = 0;
+	buffer->capacity = 0;
+}
+
+uint32_t decode_u32(const uint8_t* bytes) {
+	return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+// Start a frame. Returns where it starts, for frame_end.
+uint32_t frame_begin(Buffer* buffer, uint8_t type) {
+	uint32_t start = buffer->length;
+	buffer_put_u32(buffer, 0);
+	buffer_put_u8(buffer, type);
+	return start;
+}
+
+// Fill in the length of the frame started at start
+void frame_end(Buffer* buffer, uint32_t start) {
+	uint32_t length = buffer->length - start - 4;
+	uint8_t bytes[4] = {length, length >> 8, length >> 16, length >> 24};
+	memcpy(buffer->data + start, bytes, 4);
+}
+
+// Length of the frame at the front of buffer including its header, 0 if
+// it has not all arrived yet, or -1 if it is malformed
+int64_t frame_size(Buffer* buffer) {
+	if (buffer->length < 4) {
+		return 0;
+	}
+	uint32_t length = decode_u32(buffer->data);
+	if (length < 1 || length > PROTOCOL_MAX_FRAME) {
+		return -1;
+	}
+	return buffer->length >= length + 4 ? length + 4 : 0;
+}
+
+// Reads the payload of one frame. Running off its end sets error.
+void reader_init(Reader* reader, uint8_t* frame) {
+	reader->data = frame + 5;
+	reader->length = decode_u32(frame) - 1;
+	reader->offset = 0;
+	reader->error = false;
+}
+
+uint8_t* reader_bytes(Reader* reader, uint32_t size) {
+	if (reader->error || reader->length - reader->offset < size) {
+		reader->error = true;
+		return NULL;
+	}
+	uint8_t* bytes = reader->data + reader->offset;
+	reader->offset += size;
+	return bytes;
+}
+
+uint8_t reader_u8(Reader* reader) {
+	uint8_t* bytes = reader_bytes(reader, 1);
+	return bytes ? bytes[0] : 0;
+}
+
+uint16_t reader_u16(Reader* reader) {
+	uint8_t* bytes = reader_bytes(reader, 2);
+	return bytes ? bytes[0] | bytes[1] << 8 : 0;
+}
+
+uint32_t reader_u32(Reader* reader) {
+	uint8_t* bytes = reader_bytes(reader, 4);
+	return bytes ? decode_u32(bytes) : 0;
+}
+
+uint32_t reader_remaining(Reader* reader) {
+	return reader->length - reader->offset;
+}
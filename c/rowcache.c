@@ -0,0 +1,128 @@
+#include "db.h"
+
+// Rows looked up by id, kept deserialized so the hottest ids skip the
+// tree and the leaf altogether. Optional, and capped at a size given
+// when it is created. Slots are direct mapped: a row takes the slot of
+// whatever row hashed there before.
+//
+// Rows are only cached from snapshot reads, so they are committed. A
+// cached row is served to snapshots at or after the one that read it;
+// older snapshots may predate the insert and go to the tree. Inserts
+// drop the id from the cache, which keeps it right once rows can change.
+
+#define ROW_CACHE_STRIPES 16
+
+typedef struct {
+	bool used;
+	uint32_t id;
+	uint64_t ts; // Visible to snapshots at or after this timestamp
+	Row row;
+} RowCacheEntry;
+
+struct RowCache {
+	RowCacheEntry* entries;
+	uint32_t num_entries;
+	pthread_rwlock_t locks[ROW_CACHE_STRIPES]; // Slot i is guarded by lock i % ROW_CACHE_STRIPES
+	atomic_uint_fast64_t hits;
+	atomic_uint_fast64_t misses;
+	atomic_uint num_rows;
+};
+
+// Cache rows in size bytes at most. A size of 0 leaves the cache off.
+void row_cache_create(Table* table, size_t size) {
+	if (size == 0) {
+		return;
+	}
+	RowCache* cache = malloc(sizeof(RowCache));
+	cache->num_entries = size / sizeof(RowCacheEntry) > 0 ? size / sizeof(RowCacheEntry) : 1;
+	cache->entries = calloc(cache->num_entries, sizeof(RowCacheEntry));
+	for (uint32_t i = 0; i < ROW_CACHE_STRIPES; i++) {
+		pthread_rwlock_init(&cache->locks[i], NULL);
+	}
+	atomic_init(&cache->hits, 0);
+	atomic_init(&cache->misses, 0);
+	atomic_init(&cache->num_rows, 0);
+	table->row_cache = cache;
+}
+
+void row_cache_free(RowCache* cache) {
+	if (cache == NULL) {
+		return;
+	}
+	for (uint32_t i = 0; i < ROW_CACHE_STRIPES; i++) {
+		pthread_rwlock_destroy(&cache->locks[i]);
+	}
+	free(cache->entries);
+	free(cache);
+}
+
+uint32_t row_cache_slot(RowCache* cache, uint32_t id) {
+	return (id * 2654435761u) % cache->num_entries;
+}
+
+// Copy the row with id into row if it is cached and visible to snapshot,
+// a NULL snapshot seeing every committed row.
+bool row_cache_get(Table* table, Snapshot* snapshot, uint32_t id, Row* row) {
+	RowCache* cache = table->row_cache;
+	if (cache == NULL) {
+		return false;
+	}
+	uint32_t slot = row_cache_slot(cache, id);
+	RowCacheEntry* entry = &cache->entries[slot];
+	pthread_rwlock_rdlock(&cache->locks[slot % ROW_CACHE_STRIPES]);
+	bool hit = entry->used && entry->id == id && (snapshot == NULL || snapshot->ts >= entry->ts);
+	if (hit) {
+		*row = entry->row;
+	}
+	pthread_rwlock_unlock(&cache->locks[slot % ROW_CACHE_STRIPES]);
+	atomic_fetch_add(hit ? &cache->hits : &cache->misses, 1);
+	return hit;
+}
+
+// Remember a row read through snapshot
+void row_cache_put(Table* table, Snapshot* snapshot, Row* row) {
+	RowCache* cache = table->row_cache;
+	if (cache == NULL || snapshot == NULL) {
+		return;
+	}
+	uint32_t slot = row_cache_slot(cache, row->id);
+	RowCacheEntry* entry = &cache->entries[slot];
+	pthread_rwlock_wrlock(&cache->locks[slot % ROW_CACHE_STRIPES]);
+	if (!entry->used) {
+		atomic_fetch_add(&cache->num_rows, 1);
+	}
+	entry->used = true;
+	entry->id = row->id;
+	entry->ts = snapshot->ts;
+	entry->row = *row;
+	pthread_rwlock_unlock(&cache->locks[slot % ROW_CACHE_STRIPES]);
+}
+
+// The row with id is being written
+void row_cache_invalidate(Table* table, uint32_t id) {
+	RowCache* cache = table->row_cache;
+	if (cache == NULL) {
+		return;
+	}
+	uint32_t slot = row_cache_slot(cache, id);
+	RowCacheEntry* entry = &cache->entries[slot];
+	pthread_rwlock_wrlock(&cache->locks[slot % ROW_CACHE_STRIPES]);
+	if (entry->used && entry->id == id) {
+		entry->used = false;
+		atomic_fetch_sub(&cache->num_rows, 1);
+	}
+	pthread_rwlock_unlock(&cache->locks[slot % ROW_CACHE_STRIPES]);
+}
+
+// Returns false if there is no cache
+bool row_cache_stats(Table* table, RowCacheStats* stats) {
+	RowCache* cache = table->row_cache;
+	if (cache == NULL) {
+		return false;
+	}
+	stats->hits = atomic_load(&cache->hits);
+	stats->misses = atomic_load(&cache->misses);
+	stats->num_rows = atomic_load(&cache->num_rows);
+	stats->capacity = cache->num_entries;
+	return true;
+}
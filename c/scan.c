@@ -0,0 +1,159 @@
+#include "db.h"
+
+// A parallel scan splits the key space at separators taken from the top of
+// the tree. Ranges then line up with subtrees, so each worker seeks once
+// and walks its own leaves.
+
+typedef struct {
+	Table* table;
+	Snapshot* snapshot;
+	uint32_t worker;
+	uint32_t first_key;
+	uint32_t last_key;
+	bool ordered;
+	ScanRowFunction fn;
+	void* arg;
+	// Ordered scans keep their rows until every range before them is out
+	RowStore rows;
+	Stats stats; // Counted by the worker, for the thread that runs the scan
+} ScanRange;
+
+// Collect separators one level at a time until there are enough to give
+// every worker a range of its own, or the next level down is leaves.
+// Returns how many were found. They come out in key order.
+uint32_t scan_separators(Table* table, Snapshot* snapshot, uint32_t num_wanted, uint32_t* separators) {
+	uint32_t level[TABLE_MAX_PAGES];
+	uint32_t num_level = 1;
+	level[0] = table->root_page_num;
+	uint32_t num_separators = 0;
+
+	Cursor* cursor = cursor_new(table, LATCH_READ);
+	cursor->snapshot = snapshot;
+	while (num_level > 0) {
+		uint32_t children[TABLE_MAX_PAGES];
+		uint32_t num_children = 0;
+		uint32_t num_found = 0;
+		bool leaves_below = false;
+
+		for (uint32_t i = 0; i < num_level; i++) {
+			void* node = cursor_latch(cursor, level[i]);
+			if (get_node_type(node) == NODE_LEAF) {
+				cursor_unlatch_all(cursor);
+				num_level = 0;
+				break;
+			}
+			uint32_t num_keys = *internal_node_num_keys(node);
+			for (uint32_t j = 0; j < num_keys; j++) {
+				separators[num_found++] = *internal_node_key(node, j);
+				children[num_children++] = *internal_node_child(node, j);
+			}
+			children[num_children++] = *internal_node_right_child(node);
+			// Non-root pages never change type, peeking is safe
+			leaves_below = get_node_type(pager_pin(table->pager, children[0])) == NODE_LEAF;
+			pager_unpin(table->pager, children[0]);
+			// A node's high key separates it from its right neighbour
+			if (i + 1 < num_level) {
+				separators[num_found++] = *internal_node_high_key(node);
+			}
+			cursor_unlatch_all(cursor);
+		}
+		if (num_level == 0) {
+			break;
+		}
+
+		num_separators = num_found;
+		if (num_separators + 1 >= num_wanted || leaves_below) {
+			break;
+		}
+		memcpy(level, children, num_children * sizeof(uint32_t));
+		num_level = num_children;
+	}
+	cursor_close(cursor);
+	return num_separators;
+}
+
+void scan_emit(ScanRange* range, void* value) {
+	if (!range->ordered) {
+		range->fn(range->worker, value, range->arg);
+		return;
+	}
+	row_store_append(&range->rows, value);
+}
+
+void scan_worker(void* arg) {
+	ScanRange* range = arg;
+	Stats since;
+	stats_thread(&since);
+	Cursor* cursor = table_scan(range->table, range->snapshot, range->first_key);
+	while (!cursor->end_of_table && cursor_key(cursor) <= range->last_key) {
+		scan_emit(range, cursor_value(cursor));
+		cursor_advance(cursor);
+	}
+	cursor_close(cursor);
+	stats_hand_over(&since, &range->stats);
+}
+
+// Call fn for every row visible to snapshot, split into up to num_workers
+// ranges that run on the shared pool. Ordered scans call fn from this thread in key order. Otherwise
+// fn runs on the workers as rows are found, and worker tells them apart
+// so callers can keep per-worker state without locking. Ordered scans
+// hold rows back within memory's budget and spill the rest.
+void table_parallel_scan(Table* table, Snapshot* snapshot, uint32_t num_workers, bool ordered, QueryMemory* memory, ScanRowFunction fn, void* arg) {
+	if (table->lsm != NULL) {
+		// Runs have no ranges to hand out, one merge does it
+		lsm_scan(table, snapshot, fn, arg);
+		return;
+	}
+	if (num_workers < 1) {
+		num_workers = 1;
+	}
+	if (num_workers > SCAN_MAX_WORKERS) {
+		num_workers = SCAN_MAX_WORKERS;
+	}
+
+	uint32_t separators[TABLE_MAX_PAGES];
+	uint32_t num_separators = num_workers > 1 ? scan_separators(table, snapshot, num_workers, separators) : 0;
+	if (num_separators + 1 < num_workers) {
+		num_workers = num_separators + 1;
+	}
+
+	ScanRange ranges[SCAN_MAX_WORKERS];
+	for (uint32_t i = 0; i < num_workers; i++) {
+		ScanRange* range = &ranges[i];
+		range->table = table;
+		range->snapshot = snapshot;
+		range->worker = i;
+		range->ordered = ordered;
+		range->fn = fn;
+		range->arg = arg;
+		row_store_init(&range->rows, memory);
+
+		// Pick evenly spaced separators so each range spans as many subtrees
+		uint32_t start = i * (num_separators + 1) / num_workers;
+		uint32_t end = (i + 1) * (num_separators + 1) / num_workers;
+		range->first_key = i == 0 ? 0 : separators[start - 1] + 1;
+		range->last_key = i == num_workers - 1 ? UINT32_MAX : separators[end - 1];
+	}
+
+	TaskGroup group;
+	task_group_init(&group, shared_pool());
+	for (uint32_t i = 1; i < num_workers; i++) {
+		task_group_spawn(&group, scan_worker, &ranges[i]);
+	}
+	scan_worker(&ranges[0]);
+	task_group_wait(&group);
+	// Pages and rows count as the work of the statement running the scan
+	for (uint32_t i = 0; i < num_workers; i++) {
+		stats_add_all(&ranges[i].stats);
+	}
+
+	if (ordered) {
+		for (uint32_t i = 0; i < num_workers; i++) {
+			void* value;
+			while ((value = row_store_next(&ranges[i].rows)) != NULL) {
+				fn(i, value, arg);
+			}
+			row_store_free(&ranges[i].rows);
+		}
+	}
+}
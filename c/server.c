@@ -0,0 +1,862 @@
+#include "db.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// Server mode. One thread runs an epoll loop over every client and
+// executes their statements itself, one request at a time. While a client
+// holds a transaction open, everybody else's requests wait in their input
+// buffers: the transaction owns the table's write lock, and a statement
+// from another session run on this thread would block on it forever.
+//
+// Clients may pipeline: every complete request in a read is handled before
+// any reply goes out, so a batch of statements costs one round trip and
+// its replies leave in as few writes as the socket allows.
+//
+// With async I/O a statement first looks for the pages it will need among
+// the cached ones. If some are missing it submits their reads and leaves
+// the request in the input buffer; the loop serves other clients until
+// the reads complete, then handles the request again. Once its pages are
+// in, the statement runs without blocking on the disk.
+
+#define SERVER_MAX_STATEMENTS 64 // Per connection
+#define SERVER_MAX_PARAMS 8
+#define SERVER_MAX_FETCH_ROWS 1024 // Keeps a ROWS frame under PROTOCOL_MAX_FRAME
+#define SERVER_MAX_INPUT (4 * PROTOCOL_MAX_FRAME) // Stop reading a waiting client past this
+#define SERVER_MAX_OUTPUT (4 * PROTOCOL_MAX_FRAME) // Stop handling requests of a client that does not read
+#define SERVER_FLUSH_BYTES 65536 // Send a streamed result once this much is pending
+#define SERVER_MAX_EVENTS 64
+#define SERVER_ASYNC_ENTRIES 128 // io_uring queue depth
+
+typedef struct {
+	bool in_use;
+	uint32_t id;
+	char* sql;
+	uint16_t num_params;
+	char* params[SERVER_MAX_PARAMS]; // Bound values as text, NULL until bound
+	// Result of the last select, handed out by fetches. Its memory is
+	// granted until the last row is fetched.
+	QueryMemory memory;
+	RowStore rows;
+} ServerStatement;
+
+typedef enum {
+	CONNECTION_CLIENT,
+	CONNECTION_LISTENER,
+	CONNECTION_COMPLETIONS // Async reads are done
+} ConnectionKind;
+
+typedef struct Connection {
+	int fd;
+	ConnectionKind kind;
+	bool tcp;
+	Session* session;
+	Buffer in;
+	Buffer out;
+	bool registered;
+	uint32_t events; // Registered with epoll
+	ServerStatement statements[SERVER_MAX_STATEMENTS];
+	uint32_t pending_reads; // Pages the request at the front waits for
+	bool waiting_for_memory; // The request at the front was not admitted
+	struct Connection* next;
+} Connection;
+
+// A page being read asynchronously, and the clients waiting for it
+typedef struct {
+	struct Server* server;
+	uint32_t page_num;
+	void* page;
+	off_t offset;
+	Connection** waiters;
+	uint32_t num_waiters;
+	uint32_t waiters_capacity;
+} PageRead;
+
+typedef struct Server {
+	Table* table;
+	int epoll_fd;
+	AsyncIO* aio; // NULL without async I/O
+	PageRead* reads[TABLE_MAX_PAGES]; // In flight
+	Connection* completions;
+	Connection* connections;
+	Connection* closed; // Freed once the events that may name them are handled
+	Connection* txn_owner; // Client with a transaction open, if any
+	bool resume; // A transaction ended or memory was freed, waiting clients can go on
+} Server;
+
+static volatile sig_atomic_t server_stopping = 0;
+
+void connection_process(Server* server, Connection* connection);
+
+void server_handle_signal(int signal) {
+	server_stopping = 1;
+}
+
+void server_watch(Server* server, Connection* connection, uint32_t events) {
+	struct epoll_event event;
+	event.events = events;
+	event.data.ptr = connection;
+	int op = connection->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(server->epoll_fd, op, connection->fd, &event) == -1) {
+		printf("Error registering socket: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	connection->registered = true;
+	connection->events = events;
+}
+
+// Requests of the client have to wait, for another client's transaction,
+// for pages to be read, for memory or for the client to read its replies
+bool connection_waiting(Server* server, Connection* connection) {
+	return (server->txn_owner != NULL && server->txn_owner != connection) ||
+		connection->pending_reads > 0 || connection->waiting_for_memory ||
+		connection->out.length >= SERVER_MAX_OUTPUT;
+}
+
+// Ask for input unless the client is waiting with plenty already
+// buffered, and for output while some is pending
+void connection_update_events(Server* server, Connection* connection) {
+	uint32_t events = 0;
+	if (!connection_waiting(server, connection) || connection->in.length < SERVER_MAX_INPUT) {
+		events |= EPOLLIN;
+	}
+	if (connection->out.length > 0) {
+		events |= EPOLLOUT;
+	}
+	if (!connection->registered || events != connection->events) {
+		server_watch(server, connection, events);
+	}
+}
+
+void statement_clear_rows(Server* server, ServerStatement* statement) {
+	if (!statement->in_use) {
+		return;
+	}
+	row_store_free(&statement->rows);
+	if (statement->memory.granted > 0) {
+		memory_finish(&statement->memory);
+		server->resume = true;
+	}
+}
+
+void statement_free(Server* server, ServerStatement* statement) {
+	statement_clear_rows(server, statement);
+	free(statement->sql);
+	for (uint32_t i = 0; i < SERVER_MAX_PARAMS; i++) {
+		free(statement->params[i]);
+		statement->params[i] = NULL;
+	}
+	statement->sql = NULL;
+	statement->in_use = false;
+}
+
+void connection_close(Server* server, Connection* connection) {
+	epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+	close(connection->fd);
+	connection->fd = -1;
+	// An open transaction is rolled back
+	session_close(connection->session);
+	if (server->txn_owner == connection) {
+		server->txn_owner = NULL;
+		server->resume = true;
+	}
+	for (uint32_t i = 0; i < SERVER_MAX_STATEMENTS; i++) {
+		statement_free(server, &connection->statements[i]);
+	}
+	// Reads it waits for go on, the page is still worth caching
+	for (uint32_t i = 0; i < TABLE_MAX_PAGES && connection->pending_reads > 0; i++) {
+		PageRead* read = server->reads[i];
+		for (uint32_t j = 0; read != NULL && j < read->num_waiters; j++) {
+			if (read->waiters[j] == connection) {
+				read->waiters[j] = read->waiters[--read->num_waiters];
+				connection->pending_reads--;
+				break;
+			}
+		}
+	}
+	buffer_free(&connection->in);
+	buffer_free(&connection->out);
+
+	Connection** link = &server->connections;
+	while (*link != connection) {
+		link = &(*link)->next;
+	}
+	*link = connection->next;
+	connection->next = server->closed;
+	server->closed = connection;
+}
+
+// Write as much pending output as the socket takes
+bool connection_flush(Connection* connection) {
+	while (connection->out.length > 0) {
+		ssize_t written = send(connection->fd, connection->out.data, connection->out.length, MSG_NOSIGNAL);
+		if (written == -1) {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+		buffer_consume(&connection->out, written);
+	}
+	return true;
+}
+
+void reply_ok(Connection* connection, uint32_t count) {
+	uint32_t start = frame_begin(&connection->out, MESSAGE_OK);
+	buffer_put_u32(&connection->out, count);
+	frame_end(&connection->out, start);
+}
+
+void reply_error(Connection* connection, const char* message) {
+	uint32_t start = frame_begin(&connection->out, MESSAGE_ERROR);
+	buffer_put_bytes(&connection->out, message, strlen(message));
+	frame_end(&connection->out, start);
+}
+
+ServerStatement* find_statement(Connection* connection, uint32_t id) {
+	for (uint32_t i = 0; i < SERVER_MAX_STATEMENTS; i++) {
+		ServerStatement* statement = &connection->statements[i];
+		if (statement->in_use && statement->id == id) {
+			return statement;
+		}
+	}
+	return NULL;
+}
+
+void handle_prepare(Server* server, Connection* connection, uint32_t id, Reader* reader) {
+	uint32_t sql_length = reader_remaining(reader);
+	char* sql = (char*)reader_bytes(reader, sql_length);
+
+	uint16_t num_params = 0;
+	for (uint32_t i = 0; i < sql_length; i++) {
+		if (sql[i] == '?') {
+			num_params++;
+		}
+	}
+	if (num_params > SERVER_MAX_PARAMS) {
+		reply_error(connection, "Too many parameters.");
+		return;
+	}
+
+	// Preparing an id again replaces the statement
+	ServerStatement* statement = find_statement(connection, id);
+	if (statement != NULL) {
+		statement_free(server, statement);
+	}
+	for (uint32_t i = 0; i < SERVER_MAX_STATEMENTS && statement == NULL; i++) {
+		if (!connection->statements[i].in_use) {
+			statement = &connection->statements[i];
+		}
+	}
+	if (statement == NULL) {
+		reply_error(connection, "Too many statements.");
+		return;
+	}
+	statement->in_use = true;
+	statement->id = id;
+	statement->sql = strndup(sql, sql_length);
+	statement->num_params = num_params;
+	row_store_init(&statement->rows, &statement->memory);
+
+	uint32_t start = frame_begin(&connection->out, MESSAGE_PREPARED);
+	buffer_put_u32(&connection->out, id);
+	buffer_put_u16(&connection->out, num_params);
+	frame_end(&connection->out, start);
+}
+
+// Returns false if the frame is malformed
+bool handle_bind(Connection* connection, ServerStatement* statement, Reader* reader) {
+	uint16_t num_params = reader_u16(reader);
+	if (reader->error) {
+		return false;
+	}
+	if (num_params != statement->num_params) {
+		reply_error(connection, "Wrong number of parameters.");
+		return true;
+	}
+
+	char* params[SERVER_MAX_PARAMS];
+	bool valid = true;
+	for (uint16_t i = 0; i < num_params; i++) {
+		uint8_t type = reader_u8(reader);
+		if (type == PARAM_INT) {
+			int32_t value = reader_u32(reader);
+			params[i] = malloc(12);
+			snprintf(params[i], 12, "%d", value);
+		} else if (type == PARAM_TEXT) {
+			uint16_t length = reader_u16(reader);
+			char* text = (char*)reader_bytes(reader, length);
+			params[i] = text != NULL ? strndup(text, length) : strdup("");
+			// Statements are split on spaces
+			valid = valid && length > 0 && strlen(params[i]) == length && strchr(params[i], ' ') == NULL;
+		} else {
+			params[i] = strdup("");
+			reader->error = true;
+		}
+	}
+	if (reader->error || !valid) {
+		for (uint16_t i = 0; i < num_params; i++) {
+			free(params[i]);
+		}
+		if (!reader->error) {
+			reply_error(connection, "Invalid parameter.");
+		}
+		return !reader->error;
+	}
+
+	for (uint16_t i = 0; i < num_params; i++) {
+		free(statement->params[i]);
+		statement->params[i] = params[i];
+	}
+	reply_ok(connection, 0);
+	return true;
+}
+
+void put_row(Buffer* out, Row* row) {
+	uint8_t username_length = strlen(row->username);
+	uint8_t email_length = strlen(row->email);
+	buffer_put_u32(out, row->id);
+	buffer_put_u8(out, username_length);
+	buffer_put_bytes(out, row->username, username_length);
+	buffer_put_u8(out, email_length);
+	buffer_put_bytes(out, row->email, email_length);
+}
+
+// A select result sent as it is produced, in ROWS frames of up to
+// chunk_rows rows
+typedef struct {
+	Connection* connection;
+	uint32_t chunk_rows;
+	uint32_t num_rows; // In the open frame
+	uint32_t frame_start;
+	uint32_t total_rows;
+} RowStream;
+
+void stream_end_chunk(RowStream* stream) {
+	Buffer* out = &stream->connection->out;
+	uint8_t* count = out->data + stream->frame_start + 5;
+	for (uint32_t i = 0; i < 4; i++) {
+		count[i] = stream->num_rows >> (8 * i);
+	}
+	frame_end(out, stream->frame_start);
+	stream->num_rows = 0;
+
+	// Let the client start on the rows while we produce the rest. A
+	// client that is not keeping up just gets the rest buffered.
+	if (out->length >= SERVER_FLUSH_BYTES) {
+		connection_flush(stream->connection);
+	}
+}
+
+void stream_row(Row* row, void* arg) {
+	RowStream* stream = arg;
+	Buffer* out = &stream->connection->out;
+	if (stream->num_rows == 0) {
+		stream->frame_start = frame_begin(out, MESSAGE_ROWS);
+		buffer_put_u32(out, 0);
+		buffer_put_u8(out, false);
+	}
+	put_row(out, row);
+	stream->num_rows++;
+	stream->total_rows++;
+	if (stream->num_rows == stream->chunk_rows) {
+		stream_end_chunk(stream);
+	}
+}
+
+void collect_row(Row* row, void* arg) {
+	ServerStatement* statement = arg;
+	uint8_t value[ROW_SIZE];
+	serialize_row(row, value);
+	row_store_append(&statement->rows, value);
+}
+
+bool connection_holds_memory(Connection* connection) {
+	for (uint32_t i = 0; i < SERVER_MAX_STATEMENTS; i++) {
+		if (connection->statements[i].in_use && connection->statements[i].memory.granted > 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Rows kept for FETCH count against the memory limit. Past it the client
+// waits until other clients fetch or close their results. What it holds
+// itself can not be freed while it waits, so then it spills everything.
+bool server_admit_select(Connection* connection, ServerStatement* statement) {
+	if (memory_try_admit(&statement->memory)) {
+		return true;
+	}
+	if (connection_holds_memory(connection)) {
+		memory_admit_spilling(&statement->memory);
+		return true;
+	}
+	connection->waiting_for_memory = true;
+	return false;
+}
+
+// The statement's text with the bound parameters in place of the ?s, or
+// NULL if some are not bound
+char* bind_parameters(ServerStatement* statement) {
+	Buffer sql = {NULL, 0, 0};
+	uint32_t param = 0;
+	for (char* c = statement->sql; *c != '\0'; c++) {
+		if (*c != '?') {
+			buffer_put_u8(&sql, *c);
+			continue;
+		}
+		if (statement->params[param] == NULL) {
+			buffer_free(&sql);
+			return NULL;
+		}
+		buffer_put_bytes(&sql, statement->params[param], strlen(statement->params[param]));
+		param++;
+	}
+	buffer_put_u8(&sql, '\0');
+	return (char*)sql.data;
+}
+
+// Make connection wait for page_num, starting a read unless one is in flight
+void server_fetch_page(Server* server, Connection* connection, uint32_t page_num) {
+	PageRead* read = server->reads[page_num];
+	if (read == NULL) {
+		Pager* pager = server->table->pager;
+		off_t offset;
+		if (!pager_page_offset(pager, page_num, &offset)) {
+			// Never written, get_page() hands out a blank page without I/O
+			return;
+		}
+		read = calloc(1, sizeof(PageRead));
+		read->server = server;
+		read->page_num = page_num;
+		read->page = pager_alloc_page();
+		read->offset = offset;
+		server->reads[page_num] = read;
+		aio_read(server->aio, pager->file_descriptor, read->page, PAGE_SIZE, offset, read);
+	}
+	if (read->num_waiters == read->waiters_capacity) {
+		read->waiters_capacity = read->waiters_capacity ? read->waiters_capacity * 2 : 4;
+		read->waiters = realloc(read->waiters, read->waiters_capacity * sizeof(Connection*));
+	}
+	read->waiters[read->num_waiters++] = connection;
+	connection->pending_reads++;
+}
+
+void server_page_read(void* data, int32_t result) {
+	PageRead* read = data;
+	Server* server = read->server;
+	Pager* pager = server->table->pager;
+	if (result < 0) {
+		// pager_read() knows how to recover from O_DIRECT being refused
+		pager_read(pager, read->page, read->offset / PAGE_SIZE);
+	} else if (result < PAGE_SIZE) {
+		memset(read->page + result, 0, PAGE_SIZE - result);
+	}
+	pager_install_page(pager, read->page_num, read->page);
+	server->reads[read->page_num] = NULL;
+
+	for (uint32_t i = 0; i < read->num_waiters; i++) {
+		Connection* connection = read->waiters[i];
+		// One closed while handling an earlier waiter is skipped
+		if (connection->fd != -1 && --connection->pending_reads == 0) {
+			connection_process(server, connection);
+		}
+	}
+	free(read->waiters);
+	free(read);
+}
+
+// With chunk_rows 0 a select's rows are kept for FETCH. Otherwise they are
+// streamed ahead of the OK.
+void handle_execute(Server* server, Connection* connection, ServerStatement* statement, uint32_t chunk_rows) {
+	char* sql = bind_parameters(statement);
+	if (sql == NULL) {
+		reply_error(connection, "Parameters are not bound.");
+		return;
+	}
+
+	Statement parsed;
+	char* text = strdup(sql);
+	PrepareResult prepare_result = prepare_statement(text, &parsed);
+	free(text);
+	if (prepare_result != PREPARE_SUCCESS) {
+		char message[256];
+		describe_prepare_result(prepare_result, sql, message, sizeof(message));
+		reply_error(connection, message);
+		free(sql);
+		return;
+	}
+	free(sql);
+	if (parsed.explain != EXPLAIN_NONE) {
+		// Its lines are not rows, there is no frame to send them in
+		reply_error(connection, "Explain is only supported in the REPL.");
+		return;
+	}
+
+	if (server->aio != NULL) {
+		uint32_t missing[TABLE_MAX_PAGES];
+		uint32_t num_missing = statement_missing_pages(&parsed, connection->session, missing);
+		for (uint32_t i = 0; i < num_missing; i++) {
+			server_fetch_page(server, connection, missing[i]);
+		}
+		if (connection->pending_reads > 0) {
+			// connection_process() keeps the request for later
+			return;
+		}
+	}
+
+	statement_clear_rows(server, statement);
+	if (chunk_rows == 0 && parsed.type == STATEMENT_SELECT && !server_admit_select(connection, statement)) {
+		// connection_process() keeps the request for later
+		return;
+	}
+	RowStream stream = {connection, chunk_rows, 0, 0, 0};
+	if (chunk_rows > SERVER_MAX_FETCH_ROWS) {
+		stream.chunk_rows = SERVER_MAX_FETCH_ROWS;
+	}
+	ExecuteResult result;
+	if (chunk_rows > 0) {
+		result = execute_statement(&parsed, connection->session, stream_row, &stream);
+		if (stream.num_rows > 0) {
+			stream_end_chunk(&stream);
+		}
+	} else {
+		result = execute_statement(&parsed, connection->session, collect_row, statement);
+	}
+	if (connection->session->txn != NULL) {
+		server->txn_owner = connection;
+	} else if (server->txn_owner == connection) {
+		server->txn_owner = NULL;
+		server->resume = true;
+	}
+
+	if (result != EXECUTE_SUCCESS) {
+		reply_error(connection, execute_result_message(result));
+	} else if (parsed.type == STATEMENT_SELECT) {
+		reply_ok(connection, chunk_rows > 0 ? stream.total_rows : row_store_count(&statement->rows));
+	} else {
+		reply_ok(connection, parsed.type == STATEMENT_INSERT ? 1 : 0);
+	}
+}
+
+void handle_fetch(Server* server, Connection* connection, ServerStatement* statement, uint32_t max_rows) {
+	if (max_rows == 0 || max_rows > SERVER_MAX_FETCH_ROWS) {
+		max_rows = SERVER_MAX_FETCH_ROWS;
+	}
+	RowStore* rows = &statement->rows;
+	uint32_t count = row_store_count(rows) - rows->next_row;
+	if (count > max_rows) {
+		count = max_rows;
+	}
+	bool done = rows->next_row + count == row_store_count(rows);
+
+	Buffer* out = &connection->out;
+	uint32_t start = frame_begin(out, MESSAGE_ROWS);
+	buffer_put_u32(out, count);
+	buffer_put_u8(out, done);
+	for (uint32_t i = 0; i < count; i++) {
+		Row row;
+		deserialize_row(row_store_next(rows), &row);
+		put_row(out, &row);
+	}
+	frame_end(out, start);
+
+	if (done) {
+		statement_clear_rows(server, statement);
+	}
+}
+
+// Handle one request. Returns false if the client broke the protocol.
+bool handle_frame(Server* server, Connection* connection, uint8_t* frame) {
+	Reader reader;
+	reader_init(&reader, frame);
+	uint8_t type = frame[4];
+	uint32_t id = reader_u32(&reader);
+	if (reader.error) {
+		return false;
+	}
+	if (type == MESSAGE_PREPARE) {
+		handle_prepare(server, connection, id, &reader);
+		return true;
+	}
+
+	ServerStatement* statement = find_statement(connection, id);
+	uint32_t max_rows = 0;
+	switch (type) {
+		case (MESSAGE_BIND):
+		case (MESSAGE_CLOSE):
+			break;
+		case (MESSAGE_EXECUTE):
+			// Optional, streams the result
+			if (reader_remaining(&reader) >= 4) {
+				max_rows = reader_u32(&reader);
+			}
+			break;
+		case (MESSAGE_FETCH):
+			max_rows = reader_u32(&reader);
+			if (reader.error) {
+				return false;
+			}
+			break;
+		default:
+			return false;
+	}
+	if (statement == NULL) {
+		reply_error(connection, "Unknown statement.");
+		return true;
+	}
+
+	switch (type) {
+		case (MESSAGE_BIND):
+			return handle_bind(connection, statement, &reader);
+		case (MESSAGE_EXECUTE):
+			handle_execute(server, connection, statement, max_rows);
+			break;
+		case (MESSAGE_FETCH):
+			handle_fetch(server, connection, statement, max_rows);
+			break;
+		case (MESSAGE_CLOSE):
+			statement_free(server, statement);
+			reply_ok(connection, 0);
+			break;
+	}
+	return true;
+}
+
+// Handle every complete request that has arrived, then send the replies
+// together. Closes the connection on a protocol error.
+void connection_process(Server* server, Connection* connection) {
+	while (!connection_waiting(server, connection)) {
+		int64_t size = frame_size(&connection->in);
+		if (size == 0) {
+			break;
+		}
+		if (size < 0 || !handle_frame(server, connection, connection->in.data)) {
+			connection_close(server, connection);
+			return;
+		}
+		if (connection->pending_reads > 0 || connection->waiting_for_memory) {
+			break;
+		}
+		buffer_consume(&connection->in, size);
+	}
+	if (!connection_flush(connection)) {
+		connection_close(server, connection);
+		return;
+	}
+	connection_update_events(server, connection);
+}
+
+void connection_read(Server* server, Connection* connection) {
+	buffer_reserve(&connection->in, 65536);
+	ssize_t bytes_read = read(connection->fd, connection->in.data + connection->in.length,
+		connection->in.capacity - connection->in.length);
+	if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if (bytes_read <= 0) {
+		connection_close(server, connection);
+		return;
+	}
+	connection->in.length += bytes_read;
+	connection_process(server, connection);
+}
+
+Connection* connection_new(int fd, ConnectionKind kind) {
+	Connection* connection = calloc(1, sizeof(Connection));
+	connection->fd = fd;
+	connection->kind = kind;
+	return connection;
+}
+
+void server_accept(Server* server, Connection* listener) {
+	while (true) {
+		int fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) {
+			return;
+		}
+		if (listener->tcp) {
+			int one = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		}
+		Connection* connection = connection_new(fd, CONNECTION_CLIENT);
+		connection->session = session_new(server->table);
+		connection->next = server->connections;
+		server->connections = connection;
+		connection_update_events(server, connection);
+	}
+}
+
+Connection* server_listen(Server* server, int fd, bool tcp) {
+	if (listen(fd, SOMAXCONN) == -1) {
+		printf("Error listening: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	Connection* listener = connection_new(fd, CONNECTION_LISTENER);
+	listener->tcp = tcp;
+	server_watch(server, listener, EPOLLIN);
+	return listener;
+}
+
+Connection* listen_unix(Server* server, const char* path) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		printf("Socket path is too long.\n");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(address.sun_path, path);
+
+	// A socket file left behind by a server that died. Anything else at
+	// path, a mistyped database file say, is not ours to delete.
+	struct stat status;
+	if (lstat(path, &status) == 0) {
+		if (!S_ISSOCK(status.st_mode)) {
+			printf("Not a socket, refusing to replace %s.\n", path);
+			exit(EXIT_FAILURE);
+		}
+		unlink(path);
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1 || bind(fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
+		printf("Unable to bind socket %s: %d\n", path, errno);
+		exit(EXIT_FAILURE);
+	}
+	return server_listen(server, fd, false);
+}
+
+// Loopback only: there is no authentication
+Connection* listen_tcp(Server* server, uint16_t port) {
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int one = 1;
+	if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 || bind(fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
+		printf("Unable to bind port %d: %d\n", port, errno);
+		exit(EXIT_FAILURE);
+	}
+	return server_listen(server, fd, true);
+}
+
+// Let clients that waited out a transaction or for memory go on, until
+// one of them opens another transaction
+void server_resume(Server* server) {
+	while (server->resume) {
+		server->resume = false;
+		Connection* connection = server->connections;
+		while (connection != NULL && !server->resume) {
+			Connection* next = connection->next;
+			connection->waiting_for_memory = false;
+			connection_process(server, connection);
+			connection = next;
+		}
+	}
+}
+
+void server_run(Table* table, const char* socket_path, uint16_t tcp_port, bool async_io) {
+	Server server;
+	memset(&server, 0, sizeof(server));
+	server.table = table;
+	server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (server.epoll_fd == -1) {
+		printf("Error creating epoll instance: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+
+	// Signals are only let in while waiting, so a stop request is never
+	// missed between checking the flag and going to sleep
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = server_handle_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	sigset_t stop_signals, wait_mask;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, &wait_mask);
+	sigdelset(&wait_mask, SIGINT);
+	sigdelset(&wait_mask, SIGTERM);
+
+	Connection* listeners[2];
+	uint32_t num_listeners = 0;
+	listeners[num_listeners++] = listen_unix(&server, socket_path);
+	if (tcp_port != 0) {
+		listeners[num_listeners++] = listen_tcp(&server, tcp_port);
+	}
+	if (async_io) {
+		server.aio = aio_create(SERVER_ASYNC_ENTRIES);
+		server.completions = connection_new(aio_event_fd(server.aio), CONNECTION_COMPLETIONS);
+		server_watch(&server, server.completions, EPOLLIN);
+	}
+
+	struct epoll_event events[SERVER_MAX_EVENTS];
+	while (!server_stopping) {
+		int num_events = epoll_pwait(server.epoll_fd, events, SERVER_MAX_EVENTS, -1, &wait_mask);
+		if (num_events == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			printf("Error waiting for events: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+
+		for (int i = 0; i < num_events; i++) {
+			Connection* connection = events[i].data.ptr;
+			if (connection->kind == CONNECTION_LISTENER) {
+				server_accept(&server, connection);
+				continue;
+			}
+			if (connection->kind == CONNECTION_COMPLETIONS) {
+				aio_reap(server.aio, server_page_read);
+				continue;
+			}
+			if (connection->fd == -1) {
+				continue;
+			}
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				connection_read(&server, connection);
+			}
+			if (connection->fd != -1 && (events[i].events & EPOLLOUT)) {
+				// Draining the output may let held back requests go on
+				connection_process(&server, connection);
+			}
+		}
+		server_resume(&server);
+
+		while (server.closed != NULL) {
+			Connection* next = server.closed->next;
+			free(server.closed);
+			server.closed = next;
+		}
+	}
+
+	while (server.connections != NULL) {
+		connection_close(&server, server.connections);
+	}
+	while (server.closed != NULL) {
+		Connection* next = server.closed->next;
+		free(server.closed);
+		server.closed = next;
+	}
+	for (uint32_t i = 0; i < num_listeners; i++) {
+		close(listeners[i]->fd);
+		free(listeners[i]);
+	}
+	if (server.aio != NULL) {
+		// Nobody waits anymore, but the pages are still being written into
+		aio_drain(server.aio, server_page_read);
+		aio_destroy(server.aio);
+		free(server.completions);
+	}
+	unlink(socket_path);
+	close(server.epoll_fd);
+}
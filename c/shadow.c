@@ -0,0 +1,131 @@
+#include "db.h"
+
+// Shadow paging keeps the committed database intact at all times. A commit
+// writes every dirty page to a free location in the file, syncs, and then
+// publishes a new page table by writing a meta page. Pages 0 and 1 of the
+// file hold two meta pages used in turn; the valid one with the highest
+// transaction id is the database. A crash at any point leaves the previous
+// meta page and everything it points to untouched, so opening the file
+// needs no recovery.
+#define SHADOW_MAGIC 0x77646873
+#define SHADOW_NUM_META_PAGES 2
+
+typedef struct {
+	uint32_t magic;
+	uint32_t checksum; // Of the whole page with this field zeroed
+	uint64_t txn_id;
+	uint32_t num_pages;
+	uint32_t page_table[TABLE_MAX_PAGES];
+} ShadowMeta;
+
+uint32_t shadow_meta_checksum(void* page) {
+	ShadowMeta* meta = page;
+	uint32_t stored = meta->checksum;
+	meta->checksum = 0;
+	uint32_t checksum = page_checksum(SHADOW_MAGIC, page);
+	meta->checksum = stored;
+	return checksum;
+}
+
+bool shadow_meta_valid(void* page) {
+	ShadowMeta* meta = page;
+	return meta->magic == SHADOW_MAGIC && meta->checksum == shadow_meta_checksum(page) &&
+		meta->num_pages <= TABLE_MAX_PAGES;
+}
+
+// Load the newest valid meta page. Returns false for a file that is not
+// in shadow paging mode.
+bool shadow_open(Pager* pager, uint32_t flags) {
+	if (sizeof(ShadowMeta) > PAGE_SIZE) {
+		printf("Page table does not fit in a meta page.\n");
+		exit(EXIT_FAILURE);
+	}
+	pager->shadow_txn_id = 0;
+
+	uint32_t num_file_pages = pager->file_length / PAGE_SIZE;
+	if (num_file_pages == 0) {
+		if (!(flags & DB_OPEN_SHADOW)) {
+			return false;
+		}
+		// New file. Nothing is committed until the first meta page is written.
+		pager->num_pages = 0;
+		return true;
+	}
+
+	void* page = pager_alloc_page();
+	bool found = false;
+	for (uint32_t i = 0; i < SHADOW_NUM_META_PAGES && i < num_file_pages; i++) {
+		pager_read(pager, page, i);
+		ShadowMeta* meta = page;
+		if (shadow_meta_valid(page) && (!found || meta->txn_id > pager->shadow_txn_id)) {
+			found = true;
+			pager->shadow_txn_id = meta->txn_id;
+			pager->num_pages = meta->num_pages;
+			memcpy(pager->page_table, meta->page_table, sizeof(meta->page_table));
+		}
+	}
+	free(page);
+
+	if (!found) {
+		if (flags & DB_OPEN_SHADOW) {
+			printf("Db file is not in shadow paging mode.\n");
+			exit(EXIT_FAILURE);
+		}
+		return false;
+	}
+	pager->file_length = pager->num_pages * PAGE_SIZE;
+	return true;
+}
+
+// Write the dirty pages out of place and swap in the new page table. Free
+// locations are the ones the committed page table does not use: if we
+// crash before the new meta page is synced, that table is the database.
+// There must be no writers in flight.
+void shadow_commit(Pager* pager) {
+	bool in_use[SHADOW_NUM_META_PAGES + 2 * TABLE_MAX_PAGES] = {false};
+	for (uint32_t i = 0; i < SHADOW_NUM_META_PAGES; i++) {
+		in_use[i] = true;
+	}
+	uint32_t num_committed_pages = pager->file_length / PAGE_SIZE;
+	for (uint32_t i = 0; i < num_committed_pages; i++) {
+		in_use[pager->page_table[i]] = true;
+	}
+
+	void* page = pager_alloc_page();
+	memset(page, 0, PAGE_SIZE);
+	ShadowMeta* meta = page;
+	memcpy(meta->page_table, pager->page_table, sizeof(meta->page_table));
+
+	uint32_t location = 0;
+	for (uint32_t i = 0; i < pager->num_pages; i++) {
+		if (!pager->dirty[i]) {
+			continue;
+		}
+		while (in_use[location]) {
+			location++;
+		}
+		in_use[location] = true;
+		pager_write(pager, pager->pages[i], location);
+		meta->page_table[i] = location;
+	}
+	sync_or_exit(pager->file_descriptor);
+
+	meta->magic = SHADOW_MAGIC;
+	meta->txn_id = pager->shadow_txn_id + 1;
+	meta->num_pages = pager->num_pages;
+	meta->checksum = shadow_meta_checksum(page);
+	pager_write(pager, page, meta->txn_id % SHADOW_NUM_META_PAGES);
+	sync_or_exit(pager->file_descriptor);
+
+	// Cache misses look pages up in the table
+	pthread_mutex_lock(&pager->lock);
+	memcpy(pager->page_table, meta->page_table, sizeof(meta->page_table));
+	pager->shadow_txn_id = meta->txn_id;
+	pager->file_length = pager->num_pages * PAGE_SIZE;
+	pthread_mutex_unlock(&pager->lock);
+	free(page);
+
+	for (uint32_t i = 0; i < pager->num_pages; i++) {
+		pager->dirty[i] = false;
+	}
+}
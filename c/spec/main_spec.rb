@@ -1,11 +1,11 @@
 describe 'database' do
   before do
-    `rm -rf test.db`
+    `rm -rf test.db test.db-*`
   end
 
-  def run_script(commands)
+  def run_script(commands, options = "")
     raw_output = nil
-    IO.popen("./db test.db", "r+") do |pipe|
+    IO.popen("./db #{options} test.db", "r+") do |pipe|
       commands.each do |command|
         begin
           pipe.puts command
@@ -115,6 +115,59 @@ describe 'database' do
     ])
   end
 
+  it 'refuses a file written in another format' do
+    # A leaf root without the format, as files from before it was recorded
+    File.binwrite("test.db", [1, 1, 0, 0].pack("CCL<L<") + "\0" * 4086)
+    result = run_script([
+      "select",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "Error: test.db was written in another file format.",
+    ])
+  end
+
+  it 'keeps data after closing connection with direct I/O' do
+    result1 = run_script([
+      "insert 1 user1 person1@example.com",
+      ".exit",
+    ], "--direct-io")
+    expect(result1).to match_array([
+      "db > Executed.",
+      "db > ",
+    ])
+    result2 = run_script([
+      "select",
+      ".exit",
+    ], "--direct-io")
+    expect(result2).to match_array([
+      "db > (1, user1, person1@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'keeps data after closing connection in shadow paging mode' do
+    script = (1..30).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script, "--shadow")
+    result = run_script([
+      "select",
+      ".exit",
+    ])
+    expected_result = ["db > (1, user1, person1@example.com)"]
+    expected_result += (2..30).map do |i|
+      "(#{i}, user#{i}, person#{i}@example.com)"
+    end
+    expected_result += [
+      "Executed.",
+      "db > ",
+    ]
+    expect(result).to match_array(expected_result)
+  end
+
   it 'prints constants' do
     script = [
       ".constants",
@@ -126,9 +179,9 @@ describe 'database' do
       "db > Constants:",
       "ROW_SIZE: 293",
       "COMMON_NODE_HEADER_SIZE: 6",
-      "LEAF_NODE_HEADER_SIZE: 14",
+      "LEAF_NODE_HEADER_SIZE: 18",
       "LEAF_NODE_CELL_SIZE: 297",
-      "LEAF_NODE_SPACE_FOR_CELLS: 4082",
+      "LEAF_NODE_SPACE_FOR_CELLS: 4078",
       "LEAF_NODE_MAX_CELLS: 13",
       "db > ",
     ])
@@ -172,6 +225,50 @@ describe 'database' do
     ])
   end
 
+  it 'rolls back a transaction' do
+    script = [
+      "insert 1 user1 person1@example.com",
+      "begin",
+    ]
+    script += (2..20).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script += [
+      "rollback",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result.last(4)).to match_array([
+      "db > Executed.",
+      "db > (1, user1, person1@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'keeps committed transactions and discards open ones after closing connection' do
+    run_script([
+      "begin",
+      "insert 1 user1 person1@example.com",
+      "insert 2 user2 person2@example.com",
+      "commit",
+      "begin",
+      "insert 3 user3 person3@example.com",
+      ".exit",
+    ])
+    result = run_script([
+      "select",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
   it 'allows printing out the structure of a 3-leaf-node btree' do
     script = (1..14).map do |i|
       "insert #{i} user#{i} person#{i}@example.com"
@@ -235,6 +332,408 @@ describe 'database' do
     ])
   end
 
+  it 'prints all rows in order with a parallel scan' do
+    script = (1..100).to_a.reverse.map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".parallel 4"
+    script << "select"
+    script << ".exit"
+    result = run_script(script)
+    expected_result = ["db > db > (1, user1, person1@example.com)"]
+    expected_result += (2..100).map do |i|
+      "(#{i}, user#{i}, person#{i}@example.com)"
+    end
+    expected_result += [
+      "Executed.",
+      "db > ",
+    ]
+    expect(result.last(102)).to eq(expected_result)
+  end
+
+  it 'scans with a small page cache and spills rows past the query budget' do
+    script = (1..200).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    result = run_script([
+      ".parallel 4",
+      "select",
+      ".exit",
+    ], "--cache-pages 4 --query-memory 4")
+    expected_result = ["db > db > (1, user1, person1@example.com)"]
+    expected_result += (2..200).map do |i|
+      "(#{i}, user#{i}, person#{i}@example.com)"
+    end
+    expected_result += [
+      "Executed.",
+      "db > ",
+    ]
+    expect(result).to match_array(expected_result)
+  end
+
+  it 'finds rows after splits below the top levels' do
+    script = (1..120).map do |i|
+      "insert #{i * 2} user#{i * 2} person#{i * 2}@example.com"
+    end
+    script << "select"
+    (1..120).reverse_each do |i|
+      script << "insert #{i * 2 - 1} user#{i * 2 - 1} person#{i * 2 - 1}@example.com"
+      script << "select" if i % 20 == 1
+    end
+    script << "insert 101 user101 person101@example.com"
+    script << "select"
+    script << ".exit"
+    result = run_script(script)
+
+    expected_result = ["db > Error: Duplicate key."]
+    expected_result << "db > (1, user1, person1@example.com)"
+    expected_result += (2..240).map do |i|
+      "(#{i}, user#{i}, person#{i}@example.com)"
+    end
+    expected_result += [
+      "Executed.",
+      "db > ",
+    ]
+    expect(result.last(expected_result.length)).to match_array(expected_result)
+  end
+
+  it 'finds rows by username through an index' do
+    script = (1..40).map do |i|
+      "insert #{i} user#{i % 3} person#{i}@example.com"
+    end
+    script << "create index on username"
+    script << "insert 41 user1 person41@example.com"
+    script << "select where username = user1"
+    script << ".exit"
+    result = run_script(script)
+    expected_result = ["db > (1, user1, person1@example.com)"]
+    expected_result += [4, 7, 10, 13, 16, 19, 22, 25, 28, 31, 34, 37, 40, 41].map do |i|
+      "(#{i}, user1, person#{i}@example.com)"
+    end
+    expected_result += [
+      "Executed.",
+      "db > ",
+    ]
+    expect(result.last(17)).to match_array(expected_result)
+  end
+
+  it 'finds rows by username after the index merges inserted rows' do
+    script = ["create index on username"]
+    script += (1..400).map { |i| "insert #{i} user#{i % 10} person#{i}@example.com" }
+    script += ["select where username = user3", ".exit"]
+    result = run_script(script)
+    expected_result = ["db > (3, user3, person3@example.com)"]
+    expected_result += (13..400).step(10).map { |i| "(#{i}, user3, person#{i}@example.com)" }
+    expected_result += ["Executed.", "db > "]
+    expect(result.last(42)).to match_array(expected_result)
+  end
+
+  it 'finds hot rows again after their leaves split' do
+    script = (1..20).map do |i|
+      "insert #{i * 10} user#{i * 10} person#{i * 10}@example.com"
+    end
+    script << "create index on username"
+    5.times { script << "select where username = user100" }
+    (91..99).each do |i|
+      script << "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select where username = user100"
+    script << ".exit"
+    result = run_script(script)
+    expect(result.last(3)).to match_array([
+      "db > (100, user100, person100@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'serves repeated lookups from the row cache' do
+    script = (1..9).map do |i|
+      "insert #{i} user#{i % 3} person#{i}@example.com"
+    end
+    script << "create index on username"
+    3.times { script << "select where username = user1" }
+    script << ".rowcache"
+    script << ".exit"
+    result = run_script(script, "--row-cache 16")
+    expect(result.last(6)).to match_array([
+      "db > (1, user1, person1@example.com)",
+      "(4, user1, person4@example.com)",
+      "(7, user1, person7@example.com)",
+      "Executed.",
+      "db > Row cache: 6 hits, 3 misses, 3 of 52 rows.",
+      "db > ",
+    ])
+  end
+
+  it 'counts what the engine did' do
+    script = ["begin"]
+    (1..20).each do |i|
+      script << "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "commit"
+    script << "insert 5 user5 person5@example.com"
+    script << "select"
+    script << ".stats"
+    script << ".exit"
+    result = run_script(script)
+    # Cache and I/O counts depend on timing, the rest does not
+    counts = result.drop_while { |line| line != "db > Stats:" }.select do |line|
+      line =~ /^(leaf_splits|internal_splits|rows_\w+|\w+_statements):/
+    end
+    expect(counts).to match_array([
+      "leaf_splits: 1",
+      "internal_splits: 0",
+      "rows_inserted: 20",
+      "rows_scanned: 20",
+      "insert_statements: 21",
+      "select_statements: 1",
+      "begin_statements: 1",
+      "commit_statements: 1",
+      "rollback_statements: 0",
+      "create_index_statements: 0",
+    ])
+  end
+
+  it 'dumps statement latency histograms' do
+    script = (1..5).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select"
+    script << ".stats test.db-latency"
+    script << ".exit"
+    run_script(script)
+    lines = File.readlines("test.db-latency").reject { |line| line.start_with?("#") }
+    samples = Hash.new(0)
+    lines.each do |line|
+      kind, phase, value, count = line.split
+      samples["#{kind} #{phase}"] += count.to_i
+    end
+    expect(samples.map { |name, count| "#{name}: #{count}" }).to match_array([
+      "insert parse: 5",
+      "insert plan: 5",
+      "insert execute: 5",
+      "insert output: 5",
+      "scan parse: 1",
+      "scan plan: 1",
+      "scan execute: 1",
+      "scan output: 1",
+    ])
+  end
+
+  it 'explains how statements get at the table' do
+    script = (1..3).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "explain select"
+    script << "explain analyze select where username = user2"
+    script << "create index on username"
+    script << "explain select where username = user2"
+    script << "explain analyze insert 14 user14 person14@example.com"
+    script << "select"
+    script << ".exit"
+    result = run_script(script)
+    # Page counts and times depend on the cache and the clock
+    result = result.reject { |line| line.start_with?("Pages:", "Time (us):") }
+    expect(result.drop(3)).to match_array([
+      "db > Full scan",
+      "Executed.",
+      "db > Full scan, filter username = user2",
+      "Rows: 3 examined, 1 returned, 0 inserted",
+      "Splits: 0 leaf, 0 internal",
+      "Executed.",
+      "db > Executed.",
+      "db > Index lookup on username = user2",
+      "Executed.",
+      "db > Key seek for id 14",
+      "Rows: 0 examined, 0 returned, 1 inserted",
+      "Splits: 0 leaf, 0 internal",
+      "Executed.",
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "(3, user3, person3@example.com)",
+      "(14, user14, person14@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'keeps rows in order across flushes and compactions of an lsm table' do
+    # Shuffled ids, enough to fill the memtable several times over
+    script = (0...1500).map do |i|
+      id = i * 7919 % 1500 + 1
+      "insert #{id} user#{id} person#{id}@example.com"
+    end
+    script << ".exit"
+    run_script(script, "--lsm")
+
+    result = run_script([
+      "insert 750 user750 person750@example.com",
+      "select",
+      ".exit",
+    ])
+    expected = ["db > Error: Duplicate key.", "db > (1, user1, person1@example.com)"]
+    expected += (2..1500).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" }
+    expected += ["Executed.", "db > "]
+    expect(result).to eq(expected)
+  end
+
+  it 'finds rows buffered in internal nodes by a transaction' do
+    # Shuffled ids, enough for levels below the top ones to buffer
+    script = ["begin"]
+    script += (0...500).map do |i|
+      id = i * 7919 % 500 + 1
+      "insert #{id} user#{id} person#{id}@example.com"
+    end
+    script += ["insert 250 user250 person250@example.com", "commit", ".exit"]
+    result = run_script(script, "--buffered")
+    expect(result.last(3)).to match_array([
+      "db > Error: Duplicate key.",
+      "db > Executed.",
+      "db > ",
+    ])
+
+    result = run_script([
+      "insert 499 user499 person499@example.com",
+      "select",
+      ".exit",
+    ])
+    expected = ["db > Error: Duplicate key.", "db > (1, user1, person1@example.com)"]
+    expected += (2..500).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" }
+    expected += ["Executed.", "db > "]
+    expect(result).to match_array(expected)
+  end
+
+  it 'finds buffered rows after a split makes the tree taller' do
+    script = (1..90).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += ["create index on username", "select", "begin"]
+    script += (91..110).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script += (91..110).map { |i| "select where username = user#{i}" }
+    script += ["commit", ".exit"]
+    result = run_script(script, "--buffered")
+    found = (91..110).select { |i| result.any? { |line| line.end_with?("(#{i}, user#{i}, person#{i}@example.com)") } }
+    expect(found).to match_array((91..110).to_a)
+
+    result = run_script((91..110).map { |i| "insert #{i} user#{i} person#{i}@example.com" } + ["select", ".exit"])
+    expected = ["db > Error: Duplicate key."] * 20 + ["db > (1, user1, person1@example.com)"]
+    expected += (2..110).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" }
+    expected += ["Executed.", "db > "]
+    expect(result).to match_array(expected)
+  end
+
+  it 'serves statements to a client over a unix socket' do
+    `rm -f test.sock`
+    server = spawn("./db --listen test.sock test.db")
+    sleep 0.05 until File.exist?("test.sock")
+
+    raw_output = nil
+    IO.popen("./db-client test.sock", "r+") do |pipe|
+      pipe.puts "insert ? ? ? | 2 user2 person2@example.com"
+      pipe.puts "insert 1 user1 person1@example.com"
+      pipe.puts "insert ? ? ? | 1 user1 person1@example.com"
+      pipe.puts "select"
+      pipe.puts ".exit"
+      pipe.close_write
+      raw_output = pipe.gets(nil)
+    end
+    Process.kill("TERM", server)
+    Process.wait(server)
+
+    expect(raw_output.split("\n")).to match_array([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Error: Duplicate key.",
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+    result = run_script(["select", ".exit"])
+    expect(result).to match_array([
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'does not replace a file that is not a socket when listening' do
+    run_script(["insert 1 user1 person1@example.com", ".exit"])
+    output = `./db --listen test.db test.db`
+    expect(output.split("\n")).to match_array([
+      "Not a socket, refusing to replace test.db.",
+    ])
+    result = run_script(["select", ".exit"])
+    expect(result).to match_array([
+      "db > (1, user1, person1@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'pipelines statements and streams results to a client' do
+    `rm -f test.sock`
+    server = spawn("./db --listen test.sock test.db")
+    sleep 0.05 until File.exist?("test.sock")
+
+    script = (1..300).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select"
+    raw_output = nil
+    IO.popen("./db-client test.sock", "r+") do |pipe|
+      pipe.puts script
+      pipe.close_write
+      raw_output = pipe.gets(nil)
+    end
+    Process.kill("TERM", server)
+    Process.wait(server)
+
+    expected_result = ["db > (1, user1, person1@example.com)"]
+    expected_result += (2..300).map do |i|
+      "(#{i}, user#{i}, person#{i}@example.com)"
+    end
+    expected_result += [
+      "Executed.",
+      "db > ",
+    ]
+    expect(raw_output.split("\n").last(302)).to match_array(expected_result)
+  end
+
+  it 'reads a cold database asynchronously in server mode' do
+    script = (1..50).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    `rm -f test.sock`
+    server = spawn("./db --listen test.sock --async-io test.db")
+    sleep 0.05 until File.exist?("test.sock")
+    raw_output = nil
+    IO.popen("./db-client test.sock", "r+") do |pipe|
+      pipe.puts "insert 51 user51 person51@example.com"
+      pipe.puts "select"
+      pipe.close_write
+      raw_output = pipe.gets(nil)
+    end
+    Process.kill("TERM", server)
+    Process.wait(server)
+
+    expected_result = ["db > Executed.", "db > (1, user1, person1@example.com)"]
+    expected_result += (2..51).map do |i|
+      "(#{i}, user#{i}, person#{i}@example.com)"
+    end
+    expected_result += [
+      "Executed.",
+      "db > ",
+    ]
+    expect(raw_output.split("\n")).to match_array(expected_result)
+  end
+
   it 'allows printing out the structure of a 4-leaf-node btree' do
     script = [
       "insert 18 user18 person18@example.com",
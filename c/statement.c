@@ -0,0 +1,522 @@
+#include "db.h"
+
+// The statement layer shared by the REPL and the server: parse a line of
+// our little SQL, then run it on behalf of a session.
+
+Session* session_new(Table* table) {
+	Session* session = malloc(sizeof(Session));
+	session->table = table;
+	session->txn = NULL;
+	session->scan_workers = 1;
+	return session;
+}
+
+// A transaction left open is rolled back
+void session_close(Session* session) {
+	if (session->txn != NULL) {
+		txn_rollback(session->txn);
+	}
+	free(session);
+}
+
+PrepareResult prepare_insert(char* sql, Statement* statement) {
+	statement->type = STATEMENT_INSERT;
+
+	char* keyword = strtok(sql, " ");
+	char* id_string = strtok(NULL, " ");
+	char* username = strtok(NULL, " ");
+	char* email = strtok(NULL, " ");
+
+	if (id_string == NULL || username == NULL || email == NULL) {
+		return PREPARE_SYNTAX_ERROR;
+	}
+
+	int id = atoi(id_string);
+	if (id < 0) {
+		return PREPARE_NEGATIVE_ID;
+	}
+	if (strlen(username) > COLUMN_USERNAME_SIZE) {
+		return PREPARE_STRING_TOO_LONG;
+	}
+	if (strlen(email) > COLUMN_EMAIL_SIZE) {
+		return PREPARE_STRING_TOO_LONG;
+	}
+
+	statement->row_to_insert.id = id;
+	strcpy(statement->row_to_insert.username, username);
+	strcpy(statement->row_to_insert.email, email);
+
+	return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_select(char* sql, Statement* statement) {
+	statement->type = STATEMENT_SELECT;
+	statement->has_username_filter = false;
+	if (strcmp(sql, "select") == 0) {
+		return PREPARE_SUCCESS;
+	}
+
+	// select where username = <username>
+	char* keyword = strtok(sql, " ");
+	char* where = strtok(NULL, " ");
+	char* column = strtok(NULL, " ");
+	char* equals = strtok(NULL, " ");
+	char* username = strtok(NULL, " ");
+
+	if (strcmp(keyword, "select") != 0) {
+		return PREPARE_UNRECOGNIZED_STATEMENT;
+	}
+	if (where == NULL || column == NULL || equals == NULL || username == NULL ||
+			strcmp(where, "where") != 0 || strcmp(column, "username") != 0 || strcmp(equals, "=") != 0) {
+		return PREPARE_SYNTAX_ERROR;
+	}
+	if (strlen(username) > COLUMN_USERNAME_SIZE) {
+		return PREPARE_STRING_TOO_LONG;
+	}
+
+	statement->has_username_filter = true;
+	strcpy(statement->username_filter, username);
+	return PREPARE_SUCCESS;
+}
+
+PrepareResult parse_statement(char* sql, Statement* statement) {
+	statement->explain = EXPLAIN_NONE;
+	if (strncmp(sql, "explain analyze ", 16) == 0) {
+		statement->explain = EXPLAIN_ANALYZE;
+		sql += 16;
+	} else if (strncmp(sql, "explain ", 8) == 0) {
+		statement->explain = EXPLAIN_PLAN;
+		sql += 8;
+	}
+	if (strncmp(sql, "insert", 6) == 0) {
+		return prepare_insert(sql, statement);
+	}
+	if (strncmp(sql, "select", 6) == 0) {
+		return prepare_select(sql, statement);
+	}
+	if (strcmp(sql, "create index on username") == 0) {
+		statement->type = STATEMENT_CREATE_INDEX;
+		return PREPARE_SUCCESS;
+	}
+	if (strcmp(sql, "begin") == 0) {
+		statement->type = STATEMENT_BEGIN;
+		return PREPARE_SUCCESS;
+	}
+	if (strcmp(sql, "commit") == 0) {
+		statement->type = STATEMENT_COMMIT;
+		return PREPARE_SUCCESS;
+	}
+	if (strcmp(sql, "rollback") == 0) {
+		statement->type = STATEMENT_ROLLBACK;
+		return PREPARE_SUCCESS;
+	}
+
+	return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+// Parse a statement. sql is tokenized in place.
+PrepareResult prepare_statement(char* sql, Statement* statement) {
+	uint64_t start = clock_ns();
+	PrepareResult result = parse_statement(sql, statement);
+	statement->profile.parse_ns = clock_ns() - start;
+	return result;
+}
+
+// How statement would get at the table if it ran now
+AccessPath statement_access_path(Statement* statement, Session* session) {
+	Table* table = session->table;
+	switch (statement->type) {
+		case (STATEMENT_INSERT):
+			if (table->lsm != NULL) {
+				return ACCESS_LSM_INSERT;
+			}
+			if (session->txn != NULL && table->buffered) {
+				return ACCESS_BUFFERED_INSERT;
+			}
+			return ACCESS_KEY_SEEK;
+		case (STATEMENT_SELECT):
+			if (statement->has_username_filter && index_ready(table)) {
+				return ACCESS_INDEX_LOOKUP;
+			}
+			if (table->lsm != NULL) {
+				return ACCESS_LSM_SCAN;
+			}
+			return session->scan_workers > 1 ? ACCESS_PARALLEL_SCAN : ACCESS_FULL_SCAN;
+		default:
+			return ACCESS_NONE;
+	}
+}
+
+ExecuteResult execute_insert(Statement *statement, Session* session) {
+	Table* table = session->table;
+	Row* row_to_insert = &(statement->row_to_insert);
+	uint32_t key_to_insert = row_to_insert->id;
+	AccessPath path = statement_access_path(statement, session);
+	Transaction* txn = session->txn != NULL ? session->txn : txn_begin(table);
+	statement->profile.planned_at = clock_ns();
+	if (path == ACCESS_LSM_INSERT) {
+		bool inserted = lsm_insert(table, txn, row_to_insert);
+		if (txn != session->txn) {
+			txn_commit(txn);
+		}
+		return inserted ? EXECUTE_SUCCESS : EXECUTE_DUPLICATE_KEY;
+	}
+	if (path == ACCESS_BUFFERED_INSERT) {
+		return buffer_insert(table, txn, row_to_insert) ? EXECUTE_SUCCESS : EXECUTE_DUPLICATE_KEY;
+	}
+	Cursor* cursor = table_find_for_write(table, txn, key_to_insert);
+
+	void* node = get_page(table->pager, cursor->page_num);
+	uint32_t num_cells = (*leaf_node_num_cells(node));
+
+	// The key may also be buffered on the way down, see buffer.c
+	bool taken = cursor->message != NULL;
+	if (cursor->cell_num < num_cells) {
+		uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
+		taken = taken || key_at_index == key_to_insert;
+	}
+	if (taken) {
+		if (txn != session->txn) {
+			txn_commit(txn);
+		}
+		cursor_close(cursor);
+		return EXECUTE_DUPLICATE_KEY;
+	}
+
+	leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+	if (txn != session->txn) {
+		txn_commit(txn);
+	}
+	cursor_close(cursor);
+
+	return EXECUTE_SUCCESS;
+}
+
+typedef struct {
+	const char* username_filter; // NULL selects every row
+	RowFunction emit;
+	void* arg;
+	StatementProfile* profile; // Timed while it hands out rows
+} SelectOutput;
+
+// Pass a row on if it passes the select's filter
+void select_row(SelectOutput* output, Row* row) {
+	output->profile->rows_examined++;
+	if (output->username_filter == NULL || strcmp(row->username, output->username_filter) == 0) {
+		uint64_t start = clock_ns();
+		output->emit(row, output->arg);
+		output->profile->output_ns += clock_ns() - start;
+		output->profile->rows_returned++;
+	}
+}
+
+void select_scanned_row(uint32_t worker, void* value, void* arg) {
+	stats_add(STAT_ROWS_SCANNED, 1);
+	Row row;
+	deserialize_row(value, &row);
+	select_row(arg, &row);
+}
+
+// Look up the rows the username index points at. The caller has seen the
+// index is there, and an index never goes away.
+void select_by_index(Table* table, Snapshot* snapshot, SelectOutput* output) {
+	uint32_t* ids;
+	int32_t num_ids = index_lookup(table, output->username_filter, &ids);
+	if (num_ids < 0) {
+		return;
+	}
+	for (int32_t i = 0; i < num_ids; i++) {
+		Row row;
+		if (row_cache_get(table, snapshot, ids[i], &row)) {
+			select_row(output, &row);
+			continue;
+		}
+		if (table->lsm != NULL) {
+			if (lsm_get(table, snapshot, ids[i], &row)) {
+				row_cache_put(table, snapshot, &row);
+				select_row(output, &row);
+			}
+			continue;
+		}
+		Cursor* cursor = table_seek(table, snapshot, ids[i]);
+		if (!cursor->end_of_table && cursor_key(cursor) == ids[i]) {
+			deserialize_row(cursor_value(cursor), &row);
+			row_cache_put(table, snapshot, &row);
+			select_row(output, &row);
+		}
+		cursor_close(cursor);
+	}
+	free(ids);
+}
+
+ExecuteResult execute_select(Statement *statement, Session* session, RowFunction emit, void* arg) {
+	Table* table = session->table;
+	// Inserts keep going while we scan, but we only see rows committed
+	// before we started. Inside a transaction we are the only writer and
+	// see our own rows.
+	Snapshot* snapshot = NULL;
+	if (session->txn == NULL) {
+		snapshot = snapshot_begin(table);
+	}
+
+	SelectOutput output;
+	output.username_filter = statement->has_username_filter ? statement->username_filter : NULL;
+	output.emit = emit;
+	output.arg = arg;
+	output.profile = &statement->profile;
+	AccessPath path = statement_access_path(statement, session);
+	statement->profile.planned_at = clock_ns();
+	if (path == ACCESS_INDEX_LOOKUP) {
+		statement->profile.kind = LATENCY_LOOKUP;
+		select_by_index(table, snapshot, &output);
+	} else if (path == ACCESS_LSM_SCAN) {
+		lsm_scan(table, snapshot, select_scanned_row, &output);
+	} else if (path == ACCESS_PARALLEL_SCAN) {
+		// Ranges hold their rows back to hand them out in key order
+		QueryMemory memory;
+		memory_admit(&memory);
+		table_parallel_scan(table, snapshot, session->scan_workers, true, &memory, select_scanned_row, &output);
+		memory_finish(&memory);
+	} else {
+		Cursor* cursor = table_start(table, snapshot);
+
+		while (!(cursor->end_of_table)) {
+			select_scanned_row(0, cursor_value(cursor), &output);
+			cursor_advance(cursor);
+		}
+
+		cursor_close(cursor);
+	}
+	if (snapshot != NULL) {
+		snapshot_end(table, snapshot);
+	}
+
+	return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_create_index(Session* session) {
+	index_create(session->table, session->txn != NULL);
+	return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_begin(Session* session) {
+	if (session->txn != NULL) {
+		return EXECUTE_TRANSACTION_ACTIVE;
+	}
+	session->txn = txn_begin_explicit(session->table);
+	return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_commit(Session* session) {
+	if (session->txn == NULL) {
+		return EXECUTE_NO_TRANSACTION;
+	}
+	txn_commit(session->txn);
+	session->txn = NULL;
+	return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_rollback(Session* session) {
+	if (session->txn == NULL) {
+		return EXECUTE_NO_TRANSACTION;
+	}
+	txn_rollback(session->txn);
+	session->txn = NULL;
+	return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_statement_type(Statement *statement, Session* session, RowFunction emit, void* arg) {
+	switch (statement->type) {
+		case (STATEMENT_INSERT):
+			return execute_insert(statement, session);
+		case (STATEMENT_SELECT):
+			return execute_select(statement, session, emit, arg);
+		case (STATEMENT_BEGIN):
+			return execute_begin(session);
+		case (STATEMENT_COMMIT):
+			return execute_commit(session);
+		case (STATEMENT_ROLLBACK):
+			return execute_rollback(session);
+		case (STATEMENT_CREATE_INDEX):
+			return execute_create_index(session);
+	}
+}
+
+// Run a statement. Rows a select returns are passed to emit.
+ExecuteResult execute_statement(Statement *statement, Session* session, RowFunction emit, void* arg) {
+	StatementProfile* profile = &statement->profile;
+	stats_add(STAT_STATEMENTS + statement->type, 1);
+	profile->kind = statement->type == STATEMENT_INSERT ? LATENCY_INSERT : statement->type == STATEMENT_SELECT ? LATENCY_SCAN : LATENCY_OTHER;
+	profile->planned_at = 0;
+	profile->output_ns = 0;
+	profile->rows_examined = 0;
+	profile->rows_returned = 0;
+	uint64_t start = clock_ns();
+	ExecuteResult result = execute_statement_type(statement, session, emit, arg);
+	uint64_t end = clock_ns();
+	if (statement->type == STATEMENT_INSERT && result == EXECUTE_SUCCESS) {
+		stats_add(STAT_ROWS_INSERTED, 1);
+	}
+
+	profile->plan_ns = profile->planned_at != 0 ? profile->planned_at - start : 0;
+	profile->execute_ns = end - start - profile->plan_ns - profile->output_ns;
+	latency_record(profile->kind, PHASE_PARSE, profile->parse_ns);
+	latency_record(profile->kind, PHASE_PLAN, profile->plan_ns);
+	latency_record(profile->kind, PHASE_EXECUTE, profile->execute_ns);
+	latency_record(profile->kind, PHASE_OUTPUT, profile->output_ns);
+	return result;
+}
+
+void describe_access_path(Statement* statement, Session* session, AccessPath path, char* text, size_t size) {
+	switch (path) {
+		case (ACCESS_NONE):
+			snprintf(text, size, "No table access");
+			break;
+		case (ACCESS_KEY_SEEK):
+			snprintf(text, size, "Key seek for id %d", statement->row_to_insert.id);
+			break;
+		case (ACCESS_BUFFERED_INSERT):
+			snprintf(text, size, "Buffered insert for id %d", statement->row_to_insert.id);
+			break;
+		case (ACCESS_LSM_INSERT):
+			snprintf(text, size, "Memtable insert for id %d", statement->row_to_insert.id);
+			break;
+		case (ACCESS_INDEX_LOOKUP):
+			snprintf(text, size, "Index lookup on username = %s", statement->username_filter);
+			break;
+		case (ACCESS_FULL_SCAN):
+			snprintf(text, size, "Full scan");
+			break;
+		case (ACCESS_PARALLEL_SCAN):
+			snprintf(text, size, "Parallel scan with %u workers", session->scan_workers);
+			break;
+		case (ACCESS_LSM_SCAN):
+			snprintf(text, size, "Merge scan of memtable and runs");
+			break;
+	}
+	if (statement->type == STATEMENT_SELECT && statement->has_username_filter && path != ACCESS_INDEX_LOOKUP) {
+		size_t length = strlen(text);
+		snprintf(text + length, size - length, ", filter username = %s", statement->username_filter);
+	}
+}
+
+void discard_row(Row* row, void* arg) {
+}
+
+// Describe how statement gets at the table. With EXPLAIN_ANALYZE run it,
+// rows and all, and add what it took: rows examined, pages touched and
+// how many of them had to be read, splits and time per phase. The lines
+// go to text.
+ExecuteResult explain_statement(Statement* statement, Session* session, char* text, size_t size) {
+	char path[128];
+	describe_access_path(statement, session, statement_access_path(statement, session), path, sizeof(path));
+	if (statement->explain != EXPLAIN_ANALYZE) {
+		snprintf(text, size, "%s\n", path);
+		return EXECUTE_SUCCESS;
+	}
+
+	// Work the statement farms out is handed back to this thread, so the
+	// difference is the statement's own
+	Stats before;
+	Stats after;
+	stats_thread(&before);
+	ExecuteResult result = execute_statement(statement, session, discard_row, NULL);
+	stats_thread(&after);
+	uint64_t delta[STAT_NUM_COUNTERS];
+	for (uint32_t i = 0; i < STAT_NUM_COUNTERS; i++) {
+		delta[i] = after.counters[i] - before.counters[i];
+	}
+
+	StatementProfile* profile = &statement->profile;
+	snprintf(text, size,
+		"%s\n"
+		"Rows: %llu examined, %llu returned, %llu inserted\n"
+		"Pages: %llu touched, %llu cached, %llu read, %llu written\n"
+		"Splits: %llu leaf, %llu internal\n"
+		"Time (us): parse %.1f, plan %.1f, execute %.1f, output %.1f\n",
+		path,
+		(unsigned long long)profile->rows_examined, (unsigned long long)profile->rows_returned,
+		(unsigned long long)delta[STAT_ROWS_INSERTED],
+		(unsigned long long)(delta[STAT_CACHE_HITS] + delta[STAT_CACHE_MISSES]), (unsigned long long)delta[STAT_CACHE_HITS],
+		(unsigned long long)delta[STAT_PAGES_READ], (unsigned long long)delta[STAT_PAGES_WRITTEN],
+		(unsigned long long)delta[STAT_LEAF_SPLITS], (unsigned long long)delta[STAT_INTERNAL_SPLITS],
+		profile->parse_ns / 1000.0, profile->plan_ns / 1000.0, profile->execute_ns / 1000.0, profile->output_ns / 1000.0);
+	return result;
+}
+
+// Pages running the statement will read that are not cached yet, so an
+// asynchronous caller can fetch them first
+uint32_t statement_missing_pages(Statement* statement, Session* session, uint32_t* pages) {
+	Table* table = session->table;
+	if (table->lsm != NULL) {
+		// Runs are read with plain reads, nothing to fetch
+		return 0;
+	}
+	switch (statement->type) {
+		case (STATEMENT_INSERT):
+			return table_missing_pages(table, false, statement->row_to_insert.id, pages);
+		case (STATEMENT_SELECT):
+			if (statement->has_username_filter) {
+				uint32_t* ids;
+				int32_t num_ids = index_lookup(table, statement->username_filter, &ids);
+				if (num_ids >= 0) {
+					bool seen[TABLE_MAX_PAGES] = {false};
+					uint32_t num_missing = 0;
+					for (int32_t i = 0; i < num_ids; i++) {
+						uint32_t path[TABLE_MAX_PAGES];
+						uint32_t num_path = table_missing_pages(table, false, ids[i], path);
+						for (uint32_t j = 0; j < num_path; j++) {
+							if (!seen[path[j]]) {
+								seen[path[j]] = true;
+								pages[num_missing++] = path[j];
+							}
+						}
+					}
+					free(ids);
+					return num_missing;
+				}
+			}
+			return table_missing_pages(table, true, 0, pages);
+		case (STATEMENT_CREATE_INDEX):
+			return table_missing_pages(table, true, 0, pages);
+		default:
+			return 0;
+	}
+}
+
+// Message for a statement that failed to parse
+void describe_prepare_result(PrepareResult result, const char* sql, char* message, size_t size) {
+	switch (result) {
+		case (PREPARE_SUCCESS):
+			snprintf(message, size, "Prepared.");
+			break;
+		case (PREPARE_NEGATIVE_ID):
+			snprintf(message, size, "ID must be positive.");
+			break;
+		case (PREPARE_STRING_TOO_LONG):
+			snprintf(message, size, "String is too long.");
+			break;
+		case (PREPARE_SYNTAX_ERROR):
+			snprintf(message, size, "Syntax error. Could not parse statement.");
+			break;
+		case (PREPARE_UNRECOGNIZED_STATEMENT):
+			snprintf(message, size, "Unrecognized keyword at start of '%s'.", sql);
+			break;
+	}
+}
+
+const char* execute_result_message(ExecuteResult result) {
+	switch (result) {
+		case (EXECUTE_SUCCESS):
+			return "Executed.";
+		case (EXECUTE_DUPLICATE_KEY):
+			return "Error: Duplicate key.";
+		case (EXECUTE_TABLE_FULL):
+			return "Error: Table full.";
+		case (EXECUTE_TRANSACTION_ACTIVE):
+			return "Error: Transaction already active.";
+		case (EXECUTE_NO_TRANSACTION):
+			return "Error: No transaction is active.";
+	}
+	return "Error: Unknown result.";
+}
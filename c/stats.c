@@ -0,0 +1,125 @@
+#include "db.h"
+
+// Engine-wide counters. Every thread counts into a block of its own, so
+// counting is a plain add to memory no other thread writes, and
+// stats_read() adds the blocks up. Blocks of threads that have exited are
+// folded into retired, so their counts are not lost.
+
+typedef struct StatsBlock {
+	atomic_uint_fast64_t counters[STAT_NUM_COUNTERS];
+	struct StatsBlock* next;
+} StatsBlock;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static StatsBlock* stats_blocks = NULL; // Of live threads, under stats_lock
+static uint64_t retired[STAT_NUM_COUNTERS]; // Under stats_lock
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static __thread StatsBlock* stats_block = NULL;
+
+static const char* stat_names[STAT_NUM_COUNTERS] = {
+	"cache_hits",
+	"cache_misses",
+	"cache_evictions",
+	"pages_read",
+	"pages_written",
+	"bytes_read",
+	"bytes_written",
+	"fsyncs",
+	"leaf_splits",
+	"internal_splits",
+	"rows_inserted",
+	"rows_scanned",
+	"insert_statements",
+	"select_statements",
+	"begin_statements",
+	"commit_statements",
+	"rollback_statements",
+	"create_index_statements",
+};
+
+// A thread is exiting
+void stats_retire(void* arg) {
+	StatsBlock* block = arg;
+	pthread_mutex_lock(&stats_lock);
+	StatsBlock** link = &stats_blocks;
+	while (*link != block) {
+		link = &(*link)->next;
+	}
+	*link = block->next;
+	for (uint32_t i = 0; i < STAT_NUM_COUNTERS; i++) {
+		retired[i] += atomic_load_explicit(&block->counters[i], memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&stats_lock);
+	free(block);
+}
+
+void stats_create_key() {
+	pthread_key_create(&stats_key, stats_retire);
+}
+
+StatsBlock* stats_register() {
+	pthread_once(&stats_key_once, stats_create_key);
+	StatsBlock* block = malloc(sizeof(StatsBlock));
+	for (uint32_t i = 0; i < STAT_NUM_COUNTERS; i++) {
+		atomic_init(&block->counters[i], 0);
+	}
+	pthread_mutex_lock(&stats_lock);
+	block->next = stats_blocks;
+	stats_blocks = block;
+	pthread_mutex_unlock(&stats_lock);
+	pthread_setspecific(stats_key, block);
+	stats_block = block;
+	return block;
+}
+
+void stats_add(StatCounter counter, uint64_t n) {
+	StatsBlock* block = stats_block != NULL ? stats_block : stats_register();
+	// Only this thread writes the block, no need for a locked add
+	uint64_t value = atomic_load_explicit(&block->counters[counter], memory_order_relaxed);
+	atomic_store_explicit(&block->counters[counter], value + n, memory_order_relaxed);
+}
+
+// The counts of this thread alone, which tell what one statement did
+void stats_thread(Stats* stats) {
+	StatsBlock* block = stats_block != NULL ? stats_block : stats_register();
+	for (uint32_t i = 0; i < STAT_NUM_COUNTERS; i++) {
+		stats->counters[i] = atomic_load_explicit(&block->counters[i], memory_order_relaxed);
+	}
+}
+
+// Work done on this thread for a statement running on another one. Take
+// what was counted since since off this thread's counts and into delta,
+// for the statement's thread to stats_add_all().
+void stats_hand_over(Stats* since, Stats* delta) {
+	StatsBlock* block = stats_block != NULL ? stats_block : stats_register();
+	for (uint32_t i = 0; i < STAT_NUM_COUNTERS; i++) {
+		uint64_t value = atomic_load_explicit(&block->counters[i], memory_order_relaxed);
+		delta->counters[i] = value - since->counters[i];
+		atomic_store_explicit(&block->counters[i], since->counters[i], memory_order_relaxed);
+	}
+}
+
+void stats_add_all(Stats* stats) {
+	for (uint32_t i = 0; i < STAT_NUM_COUNTERS; i++) {
+		stats_add(i, stats->counters[i]);
+	}
+}
+
+// Add up the counts of every thread so far
+void stats_read(Stats* stats) {
+	pthread_mutex_lock(&stats_lock);
+	for (uint32_t i = 0; i < STAT_NUM_COUNTERS; i++) {
+		stats->counters[i] = retired[i];
+	}
+	for (StatsBlock* block = stats_blocks; block != NULL; block = block->next) {
+		for (uint32_t i = 0; i < STAT_NUM_COUNTERS; i++) {
+			stats->counters[i] += atomic_load_explicit(&block->counters[i], memory_order_relaxed);
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+const char* stats_name(StatCounter counter) {
+	return stat_names[counter];
+}
@@ -1,38 +1,63 @@
 #include "db.h"
 
-void create_new_root(Table* table, uint32_t right_child_page_num);
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key);
-void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num);
-void internal_node_insert_split(Table* table, uint32_t parent_page_num, uint32_t child_page_num);
+void create_new_root(Cursor* cursor, uint32_t separator, uint32_t right_child_page_num);
+void internal_node_insert(Cursor* cursor, uint32_t parent_page_num, uint32_t separator, uint32_t new_child_page_num);
+void internal_node_insert_split(Cursor* cursor, uint32_t parent_page_num, uint32_t separator, uint32_t new_child_page_num);
 
-Table* db_open(const char* filename) {
-	Pager* pager = pager_open(filename);
+Table* db_open(const char* filename, uint32_t flags) {
+	Pager* pager = pager_open(filename, flags);
 
 	Table* table = malloc(sizeof(Table));
 	table->pager = pager;
 	table->root_page_num = 0;
+	pthread_mutex_init(&table->mvcc_lock, NULL);
+	table->last_commit_ts = 0;
+	table->snapshots = NULL;
+	table->num_snapshots = 0;
+	// Prefer the snapshot side, or a steady stream of inserts starves it
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&table->version_barrier, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	pthread_rwlock_init(&table->write_lock, NULL);
+	pthread_mutex_init(&table->index_build_lock, NULL);
+	pthread_rwlock_init(&table->index_lock, NULL);
+	table->username_index = NULL;
+	table->row_cache = NULL;
+	top_levels_init(table);
+	hash_index_init(table);
+	// The engine is chosen when the file is created
+	table->lsm = lsm_open(filename, (flags & DB_OPEN_LSM) && pager->num_pages == 0);
+	table->buffered = flags & DB_OPEN_BUFFERED;
 
 	if (pager->num_pages == 0) {
 		// New database file. Initialize page 0 as leaf node.
 		void* root_node = get_page(pager, 0);
 		initialize_leaf_node(root_node);
 		set_node_root(root_node, true);
+		pager->dirty[0] = true;
+	} else if (*root_node_format(get_page(pager, 0)) != DB_FILE_FORMAT) {
+		printf("Error: %s was written in another file format.\n", filename);
+		exit(EXIT_FAILURE);
 	}
 
 	return table;
 }
 
 void db_close(Table* table) {
+	if (table->lsm != NULL) {
+		lsm_close(table);
+	}
 	Pager* pager = table->pager;
+	pager_commit(pager);
 
-	for (uint32_t i = 0; i < pager->num_pages; i++) {
-		if (pager->pages[i] == NULL) {
-			continue;
-		}
-		pager_flush(pager, i);
-		free(pager->pages[i]);
-		pager->pages[i] = NULL;
+	// Everything is on disk, the journal has nothing left to undo
+	if (pager->journal_fd != -1) {
+		close(pager->journal_fd);
+		unlink(pager->journal_path);
 	}
+	free(pager->journal_path);
 
 	int result = close(pager->file_descriptor);
 	if (result == -1) {
@@ -45,32 +70,247 @@ void db_close(Table* table) {
 			free(page);
 			pager->pages[i] = NULL;
 		}
+		pthread_rwlock_destroy(&pager->latches[i]);
+		free_versions(pager->versions[i]);
 	}
+	pthread_mutex_destroy(&pager->lock);
+	pthread_mutex_destroy(&table->mvcc_lock);
+	pthread_rwlock_destroy(&table->version_barrier);
+	pthread_rwlock_destroy(&table->write_lock);
+	pthread_mutex_destroy(&table->index_build_lock);
+	pthread_rwlock_destroy(&table->index_lock);
+	index_free(table->username_index);
+	row_cache_free(table->row_cache);
+	top_levels_free(table);
 	free(pager);
 	free(table);
 }
 
 
 
-Cursor* table_start(Table* table) {
-	Cursor* cursor = table_find(table, 0);
+Cursor* cursor_new(Table* table, LatchMode latch_mode) {
+	Cursor* cursor = malloc(sizeof(Cursor));
+	cursor->table = table;
+	cursor->snapshot = NULL;
+	cursor->txn = NULL;
+	cursor->end_of_table = false;
+	cursor->latch_mode = latch_mode;
+	cursor->optimistic = false;
+	cursor->scan = false;
+	cursor->message = NULL;
+	cursor->messages = NULL;
+	cursor->num_messages = 0;
+	cursor->next_message = 0;
+	cursor->leaves_done = false;
+	cursor->num_latched = 0;
+	return cursor;
+}
+
+// The image of a latched page this cursor should read
+void* cursor_image(Cursor* cursor, uint32_t page_num) {
+	if (cursor->snapshot == NULL) {
+		return get_page(cursor->table->pager, page_num);
+	}
+	return pager_page_as_of(cursor->table->pager, page_num, cursor->snapshot->ts);
+}
+
+// Pages are looked up once, when they are latched. The latch pins the
+// frame and keeps writers from replacing the image, so the cursor keeps
+// a direct pointer to it instead of asking the pager on every access.
+void* cursor_page(Cursor* cursor, uint32_t page_num) {
+	for (uint32_t i = cursor->num_latched; i > 0; i--) {
+		if (cursor->latched_pages[i - 1] == page_num) {
+			return cursor->latched_frames[i - 1];
+		}
+	}
+	return cursor_image(cursor, page_num);
+}
+
+// Latch a page in the mode the cursor needs for it. An optimistic write
+// cursor only reads internal nodes. Apart from the root, a page never
+// changes type once it is linked into the tree, so peeking is safe.
+void* cursor_latch(Cursor* cursor, uint32_t page_num) {
+	if (cursor->num_latched >= CURSOR_MAX_LATCHES) {
+		printf("Cursor latched too many pages\n");
+		exit(EXIT_FAILURE);
+	}
+	Pager* pager = cursor->table->pager;
+	void* page = NULL;
+	if (cursor->optimistic) {
+		if (page_num == cursor->table->root_page_num) {
+			// A leaf root can turn internal, so check under the latch
+			page = pager_latch(pager, page_num, LATCH_READ);
+			if (get_node_type(page) != NODE_INTERNAL) {
+				pager_unlatch(pager, page_num);
+				page = NULL;
+			}
+		} else {
+			bool internal = get_node_type(pager_pin(pager, page_num)) == NODE_INTERNAL;
+			pager_unpin(pager, page_num);
+			if (internal) {
+				page = pager_latch(pager, page_num, LATCH_READ);
+			}
+		}
+	}
+	if (page == NULL && cursor->scan) {
+		page = pager_latch_for_scan(pager, page_num, cursor->latch_mode);
+	} else if (page == NULL) {
+		page = pager_latch(pager, page_num, cursor->latch_mode);
+	}
+	void* image = cursor_image(cursor, page_num);
+	cursor->latched_pages[cursor->num_latched] = page_num;
+	cursor->latched_frames[cursor->num_latched++] = image;
+	return image;
+}
+
+// Latch a page the cursor did not reach through the tree, so its snapshot
+// may not see it. Returns NULL, holding no latch, if the page did not
+// exist yet as of the snapshot.
+void* cursor_latch_if_visible(Cursor* cursor, uint32_t page_num) {
+	Pager* pager = cursor->table->pager;
+	pager_latch(pager, page_num, LATCH_READ);
+	void* image = pager_image_as_of(pager, page_num, cursor->snapshot->ts);
+	if (image == NULL) {
+		pager_unlatch(pager, page_num);
+		return NULL;
+	}
+	cursor->latched_pages[cursor->num_latched] = page_num;
+	cursor->latched_frames[cursor->num_latched++] = image;
+	return image;
+}
+
+// Release every latch except the most recently taken one
+void cursor_release_ancestors(Cursor* cursor) {
+	if (cursor->num_latched <= 1) {
+		return;
+	}
+	for (uint32_t i = 0; i < cursor->num_latched - 1; i++) {
+		pager_unlatch(cursor->table->pager, cursor->latched_pages[i]);
+	}
+	cursor->latched_pages[0] = cursor->latched_pages[cursor->num_latched - 1];
+	cursor->latched_frames[0] = cursor->latched_frames[cursor->num_latched - 1];
+	cursor->num_latched = 1;
+}
+
+// A writer that has to split page_num still holds its parent: the latches
+// of an unsafe path stay in descent order, so the parent sits just before
+// the child. Parent pointers stored in nodes are not kept up to date, since
+// moving children would mean writing pages other writers have latched.
+uint32_t cursor_parent(Cursor* cursor, uint32_t page_num) {
+	for (uint32_t i = 1; i < cursor->num_latched; i++) {
+		if (cursor->latched_pages[i] == page_num) {
+			return cursor->latched_pages[i - 1];
+		}
+	}
+	printf("Parent of page %d is not latched.\n", page_num);
+	exit(EXIT_FAILURE);
+}
+
+void cursor_unlatch_all(Cursor* cursor) {
+	for (uint32_t i = cursor->num_latched; i > 0; i--) {
+		pager_unlatch(cursor->table->pager, cursor->latched_pages[i - 1]);
+	}
+	cursor->num_latched = 0;
+}
+
+void cursor_close(Cursor* cursor) {
+	cursor_unlatch_all(cursor);
+	if (cursor->messages == NULL) {
+		free(cursor->message);
+	}
+	free(cursor->messages);
+	free(cursor);
+}
+
+// A read cursor holding only page_num follows right links until it reaches
+// the node whose range covers key. Returns the page it ends up latching.
+uint32_t cursor_move_right(Cursor* cursor, uint32_t page_num, uint32_t key) {
+	void* node = cursor_page(cursor, page_num);
+	while (key > *node_high_key(node)) {
+		page_num = *node_right_sibling(node);
+		node = cursor_latch(cursor, page_num);
+		cursor_release_ancestors(cursor);
+	}
+	return page_num;
+}
+
+Cursor* table_start(Table* table, Snapshot* snapshot) {
+	return table_scan(table, snapshot, 0);
+}
 
-	void* node = get_page(table->pager, cursor->page_num);
+// Move a cursor table_find() left past the end of its leaf on to the
+// first row of the next one
+void cursor_settle(Cursor* cursor) {
+	void* node = cursor_page(cursor, cursor->page_num);
 	uint32_t num_cells = *leaf_node_num_cells(node);
-	cursor->end_of_table = (num_cells == 0);
+	if (num_cells == 0) {
+		cursor->end_of_table = true;
+	} else if (cursor->cell_num >= num_cells) {
+		// Every key here is smaller, the row we want starts the next leaf
+		cursor->cell_num = num_cells - 1;
+		cursor_advance_leaf(cursor);
+	}
+}
+
+// Position a read cursor on the first row with a key at or after key.
+// If the row with key itself is still buffered, the cursor is on that
+// row and must not be advanced; scans use table_scan().
+Cursor* table_seek(Table* table, Snapshot* snapshot, uint32_t key) {
+	Cursor* cursor = table_find(table, snapshot, key);
+	cursor_settle(cursor);
+	if (cursor->message != NULL) {
+		cursor->end_of_table = false;
+	}
+	return cursor;
+}
 
+// Position a cursor to walk the rows from key up, merging the rows still
+// buffered in internal nodes in with the leaves, see buffer.c
+Cursor* table_scan(Table* table, Snapshot* snapshot, uint32_t key) {
+	// Collected before the leaf is latched, latches go top down
+	void* messages;
+	uint32_t num_messages = buffer_collect(table, snapshot, key, &messages);
+
+	Cursor* cursor = table_find(table, snapshot, key);
+	cursor_settle(cursor);
+	cursor->scan = true;
+	free(cursor->message);
+	cursor->message = NULL;
+	cursor->messages = messages;
+	cursor->num_messages = num_messages;
+	if (num_messages > 0) {
+		cursor->leaves_done = cursor->end_of_table;
+		buffer_merge(cursor);
+	}
 	return cursor;
 }
 
 void* cursor_value(Cursor* cursor) {
-	uint32_t page_num = cursor->page_num;
-	void* page = get_page(cursor->table->pager, page_num);
+	if (cursor->message != NULL) {
+		return cursor->message + LEAF_NODE_KEY_SIZE;
+	}
+	void* page = cursor_page(cursor, cursor->page_num);
 	return leaf_node_value(page, cursor->cell_num);
 }
 
+uint32_t cursor_key(Cursor* cursor) {
+	if (cursor->message != NULL) {
+		return *(uint32_t*)cursor->message;
+	}
+	void* page = cursor_page(cursor, cursor->page_num);
+	return *leaf_node_key(page, cursor->cell_num);
+}
+
 void cursor_advance(Cursor* cursor) {
-	uint32_t page_num = cursor->page_num;
-	void* node = get_page(cursor->table->pager, page_num);
+	if (cursor->num_messages > 0) {
+		buffer_advance(cursor);
+	} else {
+		cursor_advance_leaf(cursor);
+	}
+}
+
+void cursor_advance_leaf(Cursor* cursor) {
+	void* node = cursor_page(cursor, cursor->page_num);
 
 	cursor->cell_num += 1;
 	if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
@@ -80,6 +320,10 @@ void cursor_advance(Cursor* cursor) {
 			// This was rightmost leaf
 			cursor->end_of_table = true;
 		} else {
+			// Latch coupling from left to right. Writers never latch leaves
+			// in the other direction, so this can not deadlock.
+			cursor_latch(cursor, next_page_num);
+			cursor_release_ancestors(cursor);
 			cursor->page_num = next_page_num;
 			cursor->cell_num = 0;
 		}
@@ -88,25 +332,138 @@ void cursor_advance(Cursor* cursor) {
 
 
 
-// Return the position of the given key.
-// If the key is not present, return the position where it should be inserted
-Cursor* table_find(Table* table, uint32_t key) {
-	uint32_t root_page_num = table->root_page_num;
-	void* root_node = get_page(table->pager, root_page_num);
+// Find key from the top of the tree. Lookups that do not need the path
+// above the page they start from skip the levels in table->top_levels,
+// moving right in case the tree changed below them since.
+void cursor_descend(Cursor* cursor, uint32_t key) {
+	uint32_t page_num = cursor->table->root_page_num;
+	bool skip = cursor->latch_mode == LATCH_READ || cursor->optimistic;
+	if (skip && top_levels_find(cursor->table, cursor->snapshot, key, &page_num)) {
+		cursor_latch(cursor, page_num);
+		page_num = cursor_move_right(cursor, page_num, key);
+	} else {
+		cursor_latch(cursor, page_num);
+	}
 
-	if (get_node_type(root_node) == NODE_LEAF) {
-		return leaf_node_find(table, root_page_num, key);
+	if (get_node_type(cursor_page(cursor, page_num)) == NODE_LEAF) {
+		leaf_node_find(cursor, page_num, key);
 	} else {
-		return internal_node_find(table, root_page_num, key);
+		internal_node_find(cursor, page_num, key);
+	}
+}
+
+// Return the position of the given key.
+// If the key is not present, return the position where it should be inserted.
+// The returned cursor holds a read latch on its leaf until cursor_close().
+// With a snapshot it reads the tree as of the snapshot's timestamp.
+// Snapshot lookups of hot keys skip the descent, see hash.c.
+Cursor* table_find(Table* table, Snapshot* snapshot, uint32_t key) {
+	Cursor* cursor = cursor_new(table, LATCH_READ);
+	cursor->snapshot = snapshot;
+	if (snapshot != NULL && hash_index_find(cursor, key)) {
+		return cursor;
+	}
+	cursor_descend(cursor, key);
+	if (snapshot != NULL) {
+		hash_index_note(cursor, key);
+	}
+	return cursor;
+}
+
+// A node is safe when inserting one more cell can not split it
+bool is_node_safe(void* node) {
+	switch (get_node_type(node)) {
+		case NODE_LEAF:
+			return *leaf_node_num_cells(node) < LEAF_NODE_MAX_CELLS;
+		case NODE_INTERNAL:
+			return *internal_node_num_keys(node) < INTERNAL_NODE_MAX_CELLS;
 	}
+	return false;
+}
+
+Cursor* write_cursor_find(Table* table, Transaction* txn, uint32_t key, bool optimistic) {
+	Cursor* cursor = cursor_new(table, LATCH_WRITE);
+	cursor->txn = txn;
+	cursor->optimistic = optimistic;
+	cursor_descend(cursor, key);
+	return cursor;
 }
 
-Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
-	void* node = get_page(table->pager, page_num);
+// Like table_find(), but for inserting. The returned cursor holds write
+// latches on every page the insert may modify.
+//
+// Most inserts do not split, so the first pass crabs read latches down the
+// internal nodes and only write-latches the leaf. If the leaf turns out to
+// be full we start over, crabbing write latches and releasing ancestors as
+// soon as a node is safe (an insert below it can not split it). Either way
+// writers in different key ranges do not serialize on the root.
+//
+// Changes are made on behalf of txn. Commit it before closing the cursor.
+Cursor* table_find_for_write(Table* table, Transaction* txn, uint32_t key) {
+	Cursor* cursor = write_cursor_find(table, txn, key, true);
+	if (is_node_safe(cursor_page(cursor, cursor->page_num))) {
+		return cursor;
+	}
+	cursor_close(cursor);
+
+	return write_cursor_find(table, txn, key, false);
+}
+
+// Pages a lookup of key, or with whole_tree a scan, needs that are not
+// cached, as far as the cached pages tell. Fetching them and asking again
+// reaches the leaves a level at a time. Returns how many it put in pages.
+uint32_t table_missing_pages(Table* table, bool whole_tree, uint32_t key, uint32_t* pages) {
+	Pager* pager = table->pager;
+	uint32_t queue[TABLE_MAX_PAGES];
+	bool queued[TABLE_MAX_PAGES] = {false};
+	uint32_t head = 0;
+	uint32_t tail = 0;
+	uint32_t num_missing = 0;
+
+	queue[tail++] = table->root_page_num;
+	queued[table->root_page_num] = true;
+	while (head < tail) {
+		uint32_t page_num = queue[head++];
+		if (!pager_page_cached(pager, page_num)) {
+			pages[num_missing++] = page_num;
+			continue;
+		}
+
+		uint32_t next[TABLE_MAX_PAGES];
+		uint32_t num_next = 0;
+		void* node = pager_latch(pager, page_num, LATCH_READ);
+		if (!whole_tree && key > *node_high_key(node)) {
+			next[num_next++] = *node_right_sibling(node);
+		} else if (get_node_type(node) == NODE_INTERNAL) {
+			uint32_t num_keys = *internal_node_num_keys(node);
+			if (whole_tree) {
+				for (uint32_t i = 0; i <= num_keys; i++) {
+					next[num_next++] = *internal_node_child(node, i);
+				}
+			} else {
+				next[num_next++] = *internal_node_child(node, internal_node_find_child(node, key));
+			}
+		}
+		pager_unlatch(pager, page_num);
+
+		for (uint32_t i = 0; i < num_next; i++) {
+			if (!queued[next[i]]) {
+				queued[next[i]] = true;
+				queue[tail++] = next[i];
+			}
+		}
+	}
+	return num_missing;
+}
+
+// The caller has latched page_num through the cursor
+void leaf_node_find(Cursor* cursor, uint32_t page_num, uint32_t key) {
+	if (cursor->latch_mode == LATCH_READ) {
+		page_num = cursor_move_right(cursor, page_num, key);
+	}
+	void* node = cursor_page(cursor, page_num);
 	uint32_t num_cells = *leaf_node_num_cells(node);
 
-	Cursor* cursor = malloc(sizeof(Cursor));
-	cursor->table = table;
 	cursor->page_num = page_num;
 
 	// Binary search
@@ -117,7 +474,7 @@ Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
 		uint32_t key_at_index = *leaf_node_key(node, index);
 		if (key == key_at_index) {
 			cursor->cell_num = index;
-			return cursor;
+			return;
 		}
 		if (key < key_at_index) {
 			one_past_max_index = index;
@@ -127,20 +484,39 @@ Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
 	}
 
 	cursor->cell_num = min_index;
-	return cursor;
 }
 
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key) {
-	void* node = get_page(table->pager, page_num);
+// The caller has latched page_num through the cursor.
+//
+// Readers hold one latch at a time: they let go of the parent before
+// latching the child, and if the child split in between, the key is past
+// its high key and they move right. Writers latch the child before letting
+// go of the parent, so what they land on never needs moving right.
+void internal_node_find(Cursor* cursor, uint32_t page_num, uint32_t key) {
+	if (cursor->latch_mode == LATCH_READ) {
+		page_num = cursor_move_right(cursor, page_num, key);
+	}
+	void* node = cursor_page(cursor, page_num);
+	buffer_find(cursor, node, key);
 
 	uint32_t child_index = internal_node_find_child(node, key);
 	uint32_t child_num = *internal_node_child(node, child_index);
-	void* child = get_page(table->pager, child_num);
+	void* child;
+	if (cursor->latch_mode == LATCH_READ) {
+		cursor_unlatch_all(cursor);
+		child = cursor_latch(cursor, child_num);
+	} else {
+		child = cursor_latch(cursor, child_num);
+		if (cursor->optimistic || is_node_safe(child)) {
+			cursor_release_ancestors(cursor);
+		}
+	}
+
 	switch (get_node_type(child)) {
 		case NODE_LEAF:
-			return leaf_node_find(table, child_num, key);
+			return leaf_node_find(cursor, child_num, key);
 		case NODE_INTERNAL:
-			return internal_node_find(table, child_num, key);
+			return internal_node_find(cursor, child_num, key);
 	}
 }
 
@@ -167,8 +543,17 @@ uint32_t internal_node_find_child(void* node, uint32_t key) {
 }
 
 
+// Must be called with a write cursor from table_find_for_write()
 void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
-	void* node = get_page(cursor->table->pager, cursor->page_num);
+	index_insert_row(cursor->table, value);
+	row_cache_invalidate(cursor->table, key);
+	leaf_node_add(cursor, key, value);
+}
+
+// Put a row in the leaf without telling the index or the row cache, for
+// rows they already know about from a buffer
+void leaf_node_add(Cursor* cursor, uint32_t key, Row* value) {
+	void* node = txn_write(cursor->txn, cursor->page_num);
 
 	uint32_t num_cells = *leaf_node_num_cells(node);
 	if (num_cells >= LEAF_NODE_MAX_CELLS) {
@@ -194,14 +579,16 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
 	// Insert the new value in one of the two nodes.
 	// Update parent or create a new parent.
 
-	void* old_node = get_page(cursor->table->pager, cursor->page_num);
-	uint32_t old_max = get_node_max_key(old_node);
-	uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-	void* new_node = get_page(cursor->table->pager, new_page_num);
+	Pager* pager = cursor->table->pager;
+	void* old_node = txn_write(cursor->txn, cursor->page_num);
+	top_levels_note_split(cursor->txn, cursor->page_num);
+	stats_add(STAT_LEAF_SPLITS, 1);
+	uint32_t new_page_num = txn_new_page(cursor->txn);
+	void* new_node = get_page(pager, new_page_num);
 	initialize_leaf_node(new_node);
-	*node_parent(new_node) = *node_parent(old_node);
 	*leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
 	*leaf_node_next_leaf(old_node) = new_page_num;
+	*leaf_node_high_key(new_node) = *leaf_node_high_key(old_node);
 
 	// All existing keys plus new key should be divided
 	// evenly between old (left) and new (right) nodes.
@@ -230,29 +617,28 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
 	*(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
 	*(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
 
+	// Everything up to and including the separator stays on the left
+	uint32_t separator = *leaf_node_key(old_node, LEAF_NODE_LEFT_SPLIT_COUNT - 1);
+	*leaf_node_high_key(old_node) = separator;
+
 	if (is_node_root(old_node)) {
-		return create_new_root(cursor->table, new_page_num);
+		return create_new_root(cursor, separator, new_page_num);
 	} else {
-		uint32_t parent_page_num = *node_parent(old_node);
-		uint32_t new_max = get_node_max_key(old_node);
-		void* parent = get_page(cursor->table->pager, parent_page_num);
-
-		update_internal_node_key(parent, old_max, new_max);
-		internal_node_insert(cursor->table, parent_page_num, new_page_num);
+		internal_node_insert(cursor, cursor_parent(cursor, cursor->page_num), separator, new_page_num);
 		return;
 	}
 }
 
-void create_new_root(Table* table, uint32_t right_child_page_num) {
+void create_new_root(Cursor* cursor, uint32_t separator, uint32_t right_child_page_num) {
 	// Handle splitting the root.
 	// Old root copied to new page, becomes left child.
 	// Address of right child passed in.
 	// Re-initialize root page to contain the new root node.
 	// New root node points to two children.
 
-	void* root = get_page(table->pager, table->root_page_num);
-	void* right_child = get_page(table->pager, right_child_page_num);
-	uint32_t left_child_page_num = get_unused_page_num(table->pager);
+	Table* table = cursor->table;
+	void* root = txn_write(cursor->txn, table->root_page_num);
+	uint32_t left_child_page_num = txn_new_page(cursor->txn);
 	void* left_child = get_page(table->pager, left_child_page_num);
 
 	// Left child has data copied from old root
@@ -264,41 +650,35 @@ void create_new_root(Table* table, uint32_t right_child_page_num) {
 	set_node_root(root, true);
 	*internal_node_num_keys(root) = 1;
 	*internal_node_child(root, 0) = left_child_page_num;
-	uint32_t left_child_max_key = get_node_max_key(left_child);
-	*internal_node_key(root, 0) = left_child_max_key;
+	*internal_node_key(root, 0) = separator;
 	*internal_node_right_child(root) = right_child_page_num;
-	*node_parent(left_child) = table->root_page_num;
-	*node_parent(right_child) = table->root_page_num;
 }
 
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key) {
-	uint32_t old_child_index = internal_node_find_child(node, old_key);
-	*internal_node_key(node, old_child_index) = new_key;
-}
-
-void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num) {
-	// Add a new child/key pair to parent that corresponds to child
-	void* parent = get_page(table->pager, parent_page_num);
-	void* child = get_page(table->pager, child_page_num);
-	uint32_t child_max_key = get_node_max_key(child);
-	uint32_t index = internal_node_find_child(parent, child_max_key);
-
+// A child of parent has split. Keys up to separator stayed in the child,
+// the rest moved to the new right sibling new_child_page_num.
+//
+// Separators come from the split itself rather than from the current max
+// key of a subtree: other writers may be inserting into subtrees we have
+// not latched, so their max keys are not stable.
+void internal_node_insert(Cursor* cursor, uint32_t parent_page_num, uint32_t separator, uint32_t new_child_page_num) {
+	void* parent = get_page(cursor->table->pager, parent_page_num);
 	uint32_t original_num_keys = *internal_node_num_keys(parent);
 
 	if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-		return internal_node_insert_split(table, parent_page_num, child_page_num);
+		return internal_node_insert_split(cursor, parent_page_num, separator, new_child_page_num);
 	}
 
-	*internal_node_num_keys(parent) = original_num_keys + 1;
+	parent = txn_write(cursor->txn, parent_page_num);
 
-	uint32_t right_child_page_num = *internal_node_right_child(parent);
-	void* right_child = get_page(table->pager, right_child_page_num);
+	// The separator falls inside the range of the child that split
+	uint32_t index = internal_node_find_child(parent, separator);
+	*internal_node_num_keys(parent) = original_num_keys + 1;
 
-	if (child_max_key > get_node_max_key(right_child)) {
-		// Replace right child
-		*internal_node_child(parent, original_num_keys) = right_child_page_num;
-		*internal_node_key(parent, original_num_keys) = get_node_max_key(right_child);
-		*internal_node_right_child(parent) = child_page_num;
+	if (index == original_num_keys) {
+		// The right child split, the new node becomes the right child
+		*internal_node_child(parent, original_num_keys) = *internal_node_right_child(parent);
+		*internal_node_key(parent, original_num_keys) = separator;
+		*internal_node_right_child(parent) = new_child_page_num;
 	} else {
 		// Make room for the new cell
 		for (uint32_t i = original_num_keys; i > index; i--) {
@@ -306,58 +686,68 @@ void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child
 			void* source = internal_node_cell(parent, i - 1);
 			memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
 		}
-		*internal_node_child(parent, index) = child_page_num;
-		*internal_node_key(parent, index) = child_max_key;
+		// The old child keeps the lower half, the new child takes its old key
+		*internal_node_key(parent, index) = separator;
+		*internal_node_child(parent, index + 1) = new_child_page_num;
 	}
 }
 
-void internal_node_insert_split(Table* table, uint32_t parent_page_num, uint32_t child_page_num) {
-	void* parent = get_page(table->pager, parent_page_num);
-	uint32_t old_max = get_node_max_key(parent);
-	void* child = get_page(table->pager, child_page_num);
-	uint32_t child_max_key = get_node_max_key(child);
-
-	uint32_t original_num_keys = *internal_node_num_keys(parent);
-
-	uint32_t new_parent_page_num = get_unused_page_num(table->pager);
-	void* new_parent_node = get_page(table->pager, new_parent_page_num);
-	initialize_internal_node(new_parent_node);
-	*node_parent(new_parent_node) = *node_parent(parent);
-
-	// after split the node sum decrese 1
-	uint32_t left_num_keys = original_num_keys / 2;
-	uint32_t right_num_keys = original_num_keys - left_num_keys - 1;
-
-	*internal_node_right_child(new_parent_node) = *internal_node_right_child(parent);
-	*internal_node_right_child(parent) = *internal_node_child(parent, left_num_keys);
-
-	for (uint32_t i = left_num_keys + 1, index = 0; i < original_num_keys; i++, index++) {
-		memcpy(internal_node_cell(new_parent_node, index), internal_node_cell(parent, i), INTERNAL_NODE_CELL_SIZE);
-
-		uint32_t the_child_page_num = *internal_node_child(parent, i);
-		void* the_child = get_page(table->pager, the_child_page_num);
-		*node_parent(the_child) = new_parent_page_num;
+void internal_node_insert_split(Cursor* cursor, uint32_t parent_page_num, uint32_t separator, uint32_t new_child_page_num) {
+	// Lay out all keys and children with the new one included, keep the
+	// lower half in place, move the upper half to a new sibling and push
+	// the middle key up to the grandparent.
+
+	Pager* pager = cursor->table->pager;
+	void* old_node = txn_write(cursor->txn, parent_page_num);
+	stats_add(STAT_INTERNAL_SPLITS, 1);
+	top_levels_note_split(cursor->txn, parent_page_num);
+	uint32_t num_keys = *internal_node_num_keys(old_node);
+
+	uint32_t keys[INTERNAL_NODE_MAX_CELLS + 1];
+	uint32_t children[INTERNAL_NODE_MAX_CELLS + 2];
+	uint32_t index = internal_node_find_child(old_node, separator);
+	for (uint32_t i = 0, j = 0; i <= num_keys; i++, j++) {
+		children[j] = *internal_node_child(old_node, i);
+		if (i == index) {
+			keys[j] = separator;
+			j++;
+			children[j] = new_child_page_num;
+		}
+		if (i < num_keys) {
+			keys[j] = *internal_node_key(old_node, i);
+		}
 	}
 
-	*internal_node_num_keys(new_parent_node) = right_num_keys;
-	*internal_node_num_keys(parent) = left_num_keys;
-
-	if (is_node_root(parent)) {
-		create_new_root(table, new_parent_page_num);
-	} else {
-		uint32_t parent_parent_page_num = *node_parent(parent);
-		uint32_t new_max = get_node_max_key(parent);
-		void* parent_parent = get_page(table->pager, parent_parent_page_num);
+	uint32_t total_keys = num_keys + 1;
+	uint32_t left_num_keys = total_keys / 2;
+	uint32_t promoted_key = keys[left_num_keys];
+
+	uint32_t new_page_num = txn_new_page(cursor->txn);
+	void* new_node = get_page(pager, new_page_num);
+	initialize_internal_node(new_node);
+	*internal_node_right_sibling(new_node) = *internal_node_right_sibling(old_node);
+	*internal_node_high_key(new_node) = *internal_node_high_key(old_node);
+	*internal_node_right_sibling(old_node) = new_page_num;
+	*internal_node_high_key(old_node) = promoted_key;
+
+	*internal_node_num_keys(old_node) = left_num_keys;
+	for (uint32_t i = 0; i < left_num_keys; i++) {
+		*internal_node_child(old_node, i) = children[i];
+		*internal_node_key(old_node, i) = keys[i];
+	}
+	*internal_node_right_child(old_node) = children[left_num_keys];
 
-		update_internal_node_key(parent_parent, old_max, new_max);
-		internal_node_insert(table, parent_parent_page_num, new_parent_page_num);
+	*internal_node_num_keys(new_node) = total_keys - left_num_keys - 1;
+	for (uint32_t i = left_num_keys + 1, j = 0; i < total_keys; i++, j++) {
+		*internal_node_child(new_node, j) = children[i];
+		*internal_node_key(new_node, j) = keys[i];
 	}
+	*internal_node_right_child(new_node) = children[total_keys];
+	buffer_split(old_node, new_node, promoted_key);
 
-	uint32_t left_parent_right_child_page_num = *internal_node_right_child(parent);
-	void* left_parent_right_child = get_page(table->pager, left_parent_right_child_page_num);
-	if (child_max_key > get_node_max_key(left_parent_right_child)) {
-		internal_node_insert(table, new_parent_page_num, child_page_num);
+	if (is_node_root(old_node)) {
+		create_new_root(cursor, promoted_key, new_page_num);
 	} else {
-		internal_node_insert(table, parent_page_num, child_page_num);
+		internal_node_insert(cursor, cursor_parent(cursor, parent_page_num), promoted_key, new_page_num);
 	}
 }
@@ -0,0 +1,175 @@
+#include "db.h"
+
+// The top levels of the tree, flattened. Every lookup goes through the
+// same few pages near the root, so instead of latching them each time
+// their separators are kept in one sorted array, next to the page each
+// key range leads to TOP_LEVELS levels down. A lookup binary searches
+// the array and starts its descent from there, going through the buffer
+// pool only for the levels below. The pages themselves stay pinned, for
+// the writers that split them.
+//
+// An array is built from a snapshot, so every page it names existed at
+// the snapshot's timestamp and still does: committed pages are never
+// freed. Nodes never merge either, so the key range of a page only ever
+// shrinks from the right, and a lookup starting from an array that is out
+// of date at worst has to move right. A transaction that splits a page
+// the array covers marks it out of date when it commits, and the next
+// snapshot reader that sees the commit builds a new one.
+//
+// Arrays are read without locks. Replaced ones are kept until the table
+// is closed; only a split that allocates a page can replace one, so there
+// are never more than pages in the file.
+
+struct TopLevels {
+	uint64_t ts; // Timestamp of the snapshot it was built from
+	uint32_t num_children;
+	uint32_t high_keys[TABLE_MAX_PAGES]; // Highest key each child holds, ascending
+	uint32_t children[TABLE_MAX_PAGES];
+	uint32_t pinned[TABLE_MAX_PAGES]; // Internal nodes above the children
+	uint32_t num_pinned;
+	bool covered[TABLE_MAX_PAGES]; // Pinned or a child
+	struct TopLevels* older; // The array this one replaced
+};
+
+void top_levels_init(Table* table) {
+	atomic_init(&table->top_levels, NULL);
+	atomic_init(&table->top_levels_changed_ts, 0);
+	pthread_mutex_init(&table->top_levels_lock, NULL);
+}
+
+void top_levels_free(Table* table) {
+	TopLevels* top = atomic_load(&table->top_levels);
+	while (top != NULL) {
+		TopLevels* older = top->older;
+		free(top);
+		top = older;
+	}
+	pthread_mutex_destroy(&table->top_levels_lock);
+}
+
+// Walk down TOP_LEVELS levels as snapshot sees them, or until the next
+// level is leaves. Nodes on a level all have the same type.
+TopLevels* top_levels_build(Table* table, Snapshot* snapshot) {
+	TopLevels* top = malloc(sizeof(TopLevels));
+	top->ts = snapshot->ts;
+	top->num_children = 1;
+	top->children[0] = table->root_page_num;
+	top->high_keys[0] = HIGH_KEY_INFINITY;
+	top->num_pinned = 0;
+	top->older = NULL;
+
+	Cursor* cursor = cursor_new(table, LATCH_READ);
+	cursor->snapshot = snapshot;
+	for (uint32_t level = 0; level < TOP_LEVELS; level++) {
+		uint32_t high_keys[TABLE_MAX_PAGES];
+		uint32_t children[TABLE_MAX_PAGES];
+		uint32_t num_children = 0;
+		bool leaves = false;
+
+		for (uint32_t i = 0; i < top->num_children && !leaves; i++) {
+			void* node = cursor_latch(cursor, top->children[i]);
+			if (get_node_type(node) == NODE_LEAF) {
+				leaves = true;
+			} else {
+				uint32_t num_keys = *internal_node_num_keys(node);
+				for (uint32_t j = 0; j < num_keys; j++) {
+					high_keys[num_children] = *internal_node_key(node, j);
+					children[num_children++] = *internal_node_child(node, j);
+				}
+				high_keys[num_children] = *internal_node_high_key(node);
+				children[num_children++] = *internal_node_right_child(node);
+			}
+			cursor_unlatch_all(cursor);
+		}
+		if (leaves) {
+			break;
+		}
+
+		for (uint32_t i = 0; i < top->num_children; i++) {
+			pager_pin(table->pager, top->children[i]);
+			top->pinned[top->num_pinned++] = top->children[i];
+		}
+		memcpy(top->high_keys, high_keys, num_children * sizeof(uint32_t));
+		memcpy(top->children, children, num_children * sizeof(uint32_t));
+		top->num_children = num_children;
+	}
+	cursor_close(cursor);
+
+	memset(top->covered, 0, sizeof(top->covered));
+	for (uint32_t i = 0; i < top->num_pinned; i++) {
+		top->covered[top->pinned[i]] = true;
+	}
+	for (uint32_t i = 0; i < top->num_children; i++) {
+		top->covered[top->children[i]] = true;
+	}
+	return top;
+}
+
+// Replace an out of date array with one built from snapshot, unless
+// another reader is already doing it. Returns the current array.
+TopLevels* top_levels_rebuild(Table* table, Snapshot* snapshot) {
+	if (pthread_mutex_trylock(&table->top_levels_lock) != 0) {
+		return atomic_load(&table->top_levels);
+	}
+	TopLevels* old = atomic_load(&table->top_levels);
+	TopLevels* top = old;
+	if (old == NULL || old->ts < atomic_load(&table->top_levels_changed_ts)) {
+		top = top_levels_build(table, snapshot);
+		top->older = old;
+		atomic_store(&table->top_levels, top);
+		for (uint32_t i = 0; old != NULL && i < old->num_pinned; i++) {
+			pager_unpin(table->pager, old->pinned[i]);
+		}
+	}
+	pthread_mutex_unlock(&table->top_levels_lock);
+	return top;
+}
+
+// Find the page a lookup of key can start from instead of the root. A
+// snapshot reader may rebuild the array first. Returns false if the
+// lookup has to start at the root: the tree is too short, or the array
+// names pages snapshot may not see.
+//
+// Moving right only finds the way past splits below the array. In a
+// buffered table a stale array may also skip a node that a split made
+// deep enough to buffer rows, see buffer.c, so there lookups only use an
+// array that is up to date for what they see. Lookups without a snapshot
+// see splits no commit has marked yet and never use it.
+bool top_levels_find(Table* table, Snapshot* snapshot, uint32_t key, uint32_t* page_num) {
+	TopLevels* top = atomic_load(&table->top_levels);
+	uint64_t changed_ts = atomic_load(&table->top_levels_changed_ts);
+	if (snapshot != NULL && (top == NULL || top->ts < changed_ts) && snapshot->ts >= changed_ts) {
+		top = top_levels_rebuild(table, snapshot);
+	}
+	if (top == NULL || top->num_pinned == 0 || (snapshot != NULL && snapshot->ts < top->ts)) {
+		return false;
+	}
+	if (table->buffered && (snapshot == NULL || (top->ts < changed_ts && snapshot->ts >= changed_ts))) {
+		return false;
+	}
+
+	// The last high key is infinity, every key has a child
+	uint32_t min_index = 0;
+	uint32_t max_index = top->num_children - 1;
+	while (min_index != max_index) {
+		uint32_t index = (min_index + max_index) / 2;
+		if (top->high_keys[index] < key) {
+			min_index = index + 1;
+		} else {
+			max_index = index;
+		}
+	}
+	*page_num = top->children[min_index];
+	return true;
+}
+
+// A transaction is splitting page_num. If the array covers the page, the
+// commit has to mark it out of date. So it has if the array is already
+// out of date: the page may be one the next array covers.
+void top_levels_note_split(Transaction* txn, uint32_t page_num) {
+	Table* table = txn->table;
+	TopLevels* top = atomic_load(&table->top_levels);
+	if (top == NULL || top->ts < atomic_load(&table->top_levels_changed_ts) || top->covered[page_num]) {
+		txn->splits_top_levels = true;
+	}
+}